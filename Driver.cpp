@@ -0,0 +1,14 @@
+//===- Driver.cpp - The clang-upc2c executable -------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "UPC2C.h"
+
+int main(int argc, const char **argv) {
+  return upc2c::runCommandLine(argc, argv);
+}
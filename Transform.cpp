@@ -3,13 +3,20 @@
 #include <clang/Sema/Scope.h>
 #include <clang/Lex/HeaderSearch.h>
 #include <clang/Lex/Preprocessor.h>
+#include <clang/Lex/PPCallbacks.h>
+#include <clang/Lex/MacroInfo.h>
+#include <clang/Lex/Lexer.h>
 #include <clang/AST/Stmt.h>
 #include <clang/AST/ASTContext.h>
 #include <clang/AST/Decl.h>
 #include <clang/AST/RecursiveASTVisitor.h>
 #include <clang/Frontend/FrontendAction.h>
 #include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/TextDiagnosticPrinter.h>
+#include <clang/Frontend/FrontendActions.h>
+#include <clang/Frontend/Utils.h>
 #include <clang/Tooling/CommonOptionsParser.h>
+#include <clang/Tooling/JSONCompilationDatabase.h>
 #include <llvm/Option/OptTable.h>
 #include <llvm/Option/ArgList.h>
 #include <llvm/Option/Arg.h>
@@ -17,19 +24,65 @@
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Support/Path.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/VirtualFileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/SaveAndRestore.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringSwitch.h>
+#include <llvm/Support/FormatVariadic.h>
 #include <string>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <llvm/Config/llvm-config.h>
+#ifdef LLVM_ON_UNIX
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <csignal>
+#endif
 #include <cctype>
 #include <memory>
 #include "../../lib/Sema/TreeTransform.h"
 
 #include <clang/AST/PrettyPrinter.h>
 
+#include "UPC2C.h"
+
 using namespace clang;
 using namespace clang::tooling;
 using llvm::APInt;
 
 namespace {
 
+  // Matches UPC_VERSION.  Part of the key of anything that
+  // clang-upc2c caches on disk.
+  const char UPC2CVersion[] = "9.0.1-2";
+
+  std::string HashStrings(llvm::ArrayRef<std::string> Strings) {
+    llvm::MD5 Hash;
+    for(llvm::ArrayRef<std::string>::iterator iter = Strings.begin(), end = Strings.end(); iter != end; ++iter) {
+      Hash.update(*iter);
+      Hash.update(StringRef("", 1));
+    }
+    llvm::MD5::MD5Result Result;
+    Hash.final(Result);
+    llvm::SmallString<32> Hex;
+    llvm::MD5::stringifyResult(Result, Hex);
+    return Hex.str().str();
+  }
+
   struct is_ident_char {
     typedef bool result_type;
     typedef char argument_type;
@@ -38,9 +91,11 @@ namespace {
     }
   };
 
-  std::string get_file_id(const std::string& filename) {
+  // The id is the stem of filename followed by a hash of Hashed,
+  // which is either the name itself or the contents of the file.
+  std::string get_file_id(const std::string& filename, StringRef Hashed) {
     uint32_t seed = 0;
-    for(std::string::const_iterator iter = filename.begin(), end = filename.end(); iter != end; ++iter) {
+    for(StringRef::iterator iter = Hashed.begin(), end = Hashed.end(); iter != end; ++iter) {
       seed ^= uint32_t(*iter) + 0x9e3779b9 + (seed<<6) + (seed>>2);
     }
     std::string as_identifier(llvm::sys::path::stem(filename));
@@ -102,6 +157,12 @@ namespace {
   };
 
 
+  class RuntimeABI;
+
+  // The largest value that the runtime ABI can give sized get
+  // and put entry points for; see RuntimeABI.
+  enum { MaxSizedValue = 8 };
+
   struct UPCRDecls {
     FunctionDecl * upcr_notify;
     FunctionDecl * upcr_wait;
@@ -148,6 +209,11 @@ namespace {
     UPCRCommFn UPCR_PUT_IVAL;
     UPCRCommFn UPCR_PUT_FVAL;
     UPCRCommFn UPCR_PUT_DVAL;
+    // Gets and puts by value of one size, without a size
+    // argument, indexed by the size.  Only set if the runtime
+    // ABI provides them.
+    UPCRCommFn UPCR_GET_IVAL_SIZED[MaxSizedValue + 1];
+    UPCRCommFn UPCR_PUT_IVAL_SIZED[MaxSizedValue + 1];
     VarDecl * upcrt_forall_control;
     VarDecl * upcr_null_shared;
     VarDecl * upcr_null_pshared;
@@ -157,290 +223,7 @@ namespace {
     QualType upcr_startup_pshalloc_t;
     QualType upcr_register_value_t;
     SourceLocation FakeLocation;
-    explicit UPCRDecls(ASTContext& Context) {
-      SourceManager& SourceMgr = Context.getSourceManager();
-      FakeLocation = SourceMgr.getLocForStartOfFile(SourceMgr.getMainFileID());
-
-      // types
-
-      // Make sure that the size and alignment are correct.
-      QualType SharedPtrTy = Context.getPointerType(Context.getSharedType(Context.VoidTy));
-      upcr_shared_ptr_t = CreateTypedefType(Context, "upcr_shared_ptr_t", SharedPtrTy);
-      upcr_pshared_ptr_t = CreateTypedefType(Context, "upcr_pshared_ptr_t", SharedPtrTy);
-      upcr_startup_shalloc_t = CreateTypedefType(Context, "upcr_startup_shalloc_t");
-      upcr_startup_pshalloc_t = CreateTypedefType(Context, "upcr_startup_pshalloc_t");
-
-      // FIXME: This is a fair assumption, but should really get true type
-      upcr_register_value_t = CreateTypedefType(Context, "upcr_register_value_t", Context.getUIntPtrType());
-
-      // upcr_notify
-      {
-	QualType argTypes[] = { Context.IntTy, Context.IntTy };
-	upcr_notify = CreateFunction(Context, "upcr_notify", Context.VoidTy, argTypes, 2);
-      }
-      // upcr_wait
-      {
-	QualType argTypes[] = { Context.IntTy, Context.IntTy };
-	upcr_wait = CreateFunction(Context, "upcr_wait", Context.VoidTy, argTypes, 2);
-      }
-      // upcr_barrier
-      {
-	QualType argTypes[] = { Context.IntTy, Context.IntTy };
-	upcr_barrier = CreateFunction(Context, "upcr_barrier", Context.VoidTy, argTypes, 2);
-      }
-      // upcr_poll
-      {
-	upcr_poll = CreateFunction(Context, "upcr_poll", Context.VoidTy, 0, 0);
-      }
-      // upcr_mythread
-      {
-	upcr_mythread = CreateFunction(Context, "upcr_mythread", Context.IntTy, 0, 0);
-      }
-      // upcr_threads
-      {
-	upcr_threads = CreateFunction(Context, "upcr_threads", Context.IntTy, 0, 0);
-      }
-      // upcr_hasMyAffinity_pshared
-      {
-	QualType argTypes[] = { upcr_pshared_ptr_t };
-	upcr_hasMyAffinity_pshared = CreateFunction(Context, "upcr_hasMyAffinity_pshared", Context.IntTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // upcr_hasMyAffinity_shared
-      {
-	QualType argTypes[] = { upcr_shared_ptr_t };
-	upcr_hasMyAffinity_shared = CreateFunction(Context, "upcr_hasMyAffinity_shared", Context.IntTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_ADD_SHARED
-      {
-	QualType argTypes[] = { upcr_shared_ptr_t, Context.IntTy, Context.IntTy, Context.IntTy };
-	UPCR_ADD_SHARED = CreateFunction(Context, "upcr_add_shared", upcr_shared_ptr_t, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_ADD_PSHAREDI
-      {
-	QualType argTypes[] = { upcr_pshared_ptr_t, Context.IntTy, Context.IntTy };
-	UPCR_ADD_PSHAREDI = CreateFunction(Context, "upcr_add_psharedI", upcr_pshared_ptr_t, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_ADD_PSHARED1
-      {
-	QualType argTypes[] = { upcr_pshared_ptr_t, Context.IntTy, Context.IntTy };
-	UPCR_ADD_PSHARED1 = CreateFunction(Context, "upcr_add_pshared1", upcr_pshared_ptr_t, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_INC_SHARED
-      {
-	QualType argTypes[] = { Context.getPointerType(upcr_shared_ptr_t), Context.IntTy, Context.IntTy, Context.IntTy };
-	UPCR_INC_SHARED = CreateFunction(Context, "upcr_inc_shared", Context.VoidTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_INC_PSHAREDI
-      {
-	QualType argTypes[] = { Context.getPointerType(upcr_pshared_ptr_t), Context.IntTy, Context.IntTy };
-	UPCR_INC_PSHAREDI = CreateFunction(Context, "upcr_inc_psharedI", Context.VoidTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_INC_PSHARED1
-      {
-	QualType argTypes[] = { Context.getPointerType(upcr_pshared_ptr_t), Context.IntTy, Context.IntTy };
-	UPCR_INC_PSHARED1 = CreateFunction(Context, "upcr_inc_pshared1", Context.VoidTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_SUB_SHARED
-      {
-	QualType argTypes[] = { upcr_shared_ptr_t, upcr_shared_ptr_t, Context.IntTy, Context.IntTy };
-	UPCR_SUB_SHARED = CreateFunction(Context, "upcr_sub_shared", Context.IntTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_SUB_PSHAREDI
-      {
-	QualType argTypes[] = { upcr_pshared_ptr_t, upcr_pshared_ptr_t, Context.IntTy };
-	UPCR_SUB_PSHAREDI = CreateFunction(Context, "upcr_sub_psharedI", Context.IntTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_SUB_PSHARED1
-      {
-	QualType argTypes[] = { upcr_pshared_ptr_t, upcr_pshared_ptr_t, Context.IntTy };
-	UPCR_SUB_PSHARED1 = CreateFunction(Context, "upcr_sub_pshared1", Context.IntTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_ISEQUAL_SHARED_SHARED
-      {
-	QualType argTypes[] = { upcr_shared_ptr_t, upcr_shared_ptr_t };
-	UPCR_ISEQUAL_SHARED_SHARED = CreateFunction(Context, "upcr_isequal_shared_shared", Context.IntTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_ISEQUAL_SHARED_PSHARED
-      {
-	QualType argTypes[] = { upcr_shared_ptr_t, upcr_pshared_ptr_t };
-	UPCR_ISEQUAL_SHARED_PSHARED = CreateFunction(Context, "upcr_isequal_shared_pshared", Context.IntTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_ISEQUAL_PSHARED_SHARED
-      {
-	QualType argTypes[] = { upcr_pshared_ptr_t, upcr_shared_ptr_t };
-	UPCR_ISEQUAL_PSHARED_SHARED = CreateFunction(Context, "upcr_isequal_pshared_shared", Context.IntTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_ISEQUAL_PSHARED_PSHARED
-      {
-	QualType argTypes[] = { upcr_pshared_ptr_t, upcr_pshared_ptr_t };
-	UPCR_ISEQUAL_PSHARED_PSHARED = CreateFunction(Context, "upcr_isequal_pshared_pshared", Context.IntTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_SHARED_TO_LOCAL
-      {
-	QualType argTypes[] = { upcr_shared_ptr_t };
-	UPCR_SHARED_TO_LOCAL = CreateFunction(Context, "upcr_shared_to_local", Context.VoidPtrTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_PSHARED_TO_LOCAL
-      {
-	QualType argTypes[] = { upcr_pshared_ptr_t };
-	UPCR_PSHARED_TO_LOCAL = CreateFunction(Context, "upcr_pshared_to_local", Context.VoidPtrTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_ISNULL_SHARED
-      {
-	QualType argTypes[] = { upcr_shared_ptr_t };
-	UPCR_ISNULL_SHARED = CreateFunction(Context, "upcr_isnull_shared", Context.IntTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_ISNULL_PSHARED
-      {
-	QualType argTypes[] = { upcr_pshared_ptr_t };
-	UPCR_ISNULL_PSHARED = CreateFunction(Context, "upcr_isnull_pshared", Context.IntTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_SHARED_TO_PSHARED
-      {
-	QualType argTypes[] = { upcr_shared_ptr_t };
-	UPCR_SHARED_TO_PSHARED = CreateFunction(Context, "upcr_shared_to_pshared", upcr_pshared_ptr_t, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_PSHARED_TO_SHARED
-      {
-	QualType argTypes[] = { upcr_pshared_ptr_t };
-	UPCR_PSHARED_TO_SHARED = CreateFunction(Context, "upcr_pshared_to_shared", upcr_shared_ptr_t, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_SHARED_RESETPHASE
-      {
-	QualType argTypes[] = { upcr_shared_ptr_t };
-	UPCR_SHARED_RESETPHASE = CreateFunction(Context, "upcr_shared_resetphase", upcr_shared_ptr_t, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_ADDRFIELD_SHARED
-      {
-	QualType argTypes[] = { upcr_shared_ptr_t };
-	UPCR_ADDRFIELD_SHARED = CreateFunction(Context, "upcr_addrfield_shared", Context.getUIntPtrType(), argTypes, 1);
-      }
-      // UPCR_ADDRFIELD_PSHARED
-      {
-	QualType argTypes[] = { upcr_pshared_ptr_t };
-	UPCR_ADDRFIELD_PSHARED = CreateFunction(Context, "upcr_addrfield_pshared", Context.getUIntPtrType(), argTypes, 1);
-      }
-      // UPCR_BEGIN_FUNCTION
-      {
-	UPCR_BEGIN_FUNCTION = CreateFunction(Context, "UPCR_BEGIN_FUNCTION", Context.VoidTy, NULL, 0);
-      }
-      // UPCR_EXIT_FUNCTION
-      {
-	UPCR_EXIT_FUNCTION = CreateFunction(Context, "UPCR_EXIT_FUNCTION", Context.VoidTy, NULL, 0);
-      }
-      // UPCRT_STARTUP_PSHALLOC
-      {
-	QualType argTypes[] = { upcr_pshared_ptr_t, Context.IntTy, Context.IntTy, Context.IntTy, Context.IntTy, Context. getPointerType(Context.getConstType(Context.CharTy)) };
-	UPCRT_STARTUP_PSHALLOC = CreateFunction(Context, "UPCRT_STARTUP_PSHALLOC", upcr_startup_pshalloc_t, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCRT_STARTUP_SHALLOC
-      {
-	QualType argTypes[] = { upcr_shared_ptr_t, Context.IntTy, Context.IntTy, Context.IntTy, Context.IntTy, Context. getPointerType(Context.getConstType(Context.CharTy)) };
-	UPCRT_STARTUP_SHALLOC = CreateFunction(Context, "UPCRT_STARTUP_SHALLOC", upcr_startup_shalloc_t, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // upcr_startup_pshalloc
-      {
-	QualType argTypes[] = { Context.getPointerType(upcr_startup_pshalloc_t), Context.IntTy };
-	upcr_startup_pshalloc = CreateFunction(Context, "upcr_startup_pshalloc", Context.VoidTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // upcr_startup_shalloc
-      {
-	QualType argTypes[] = { Context.getPointerType(upcr_startup_shalloc_t), Context.IntTy };
-	upcr_startup_shalloc = CreateFunction(Context, "upcr_startup_shalloc", Context.VoidTy, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
-      }
-      // UPCR_TLD_ADDR
-      {
-	UPCR_TLD_ADDR = CreateFunction(Context, "UPCR_TLD_ADDR", Context.VoidPtrTy, NULL, 0, true/*variadic*/);
-      }
-      // UPCR_GET_{,P}SHARED{,_STRICT}
-      {
-	QualType pargTypes[] = { Context.VoidPtrTy, upcr_pshared_ptr_t, Context.IntTy, Context.IntTy };
-	UPCR_GET[CFNK_PSHARED] = CreateFunction(Context, "upcr_get_pshared", Context.VoidTy, pargTypes, 4);
-	UPCR_GET[CFNK_PSHARED_STRICT] = CreateFunction(Context, "upcr_get_pshared_strict", Context.VoidTy, pargTypes, 4);
-	QualType argTypes[] = { Context.VoidPtrTy, upcr_shared_ptr_t, Context.IntTy, Context.IntTy };
-	UPCR_GET[CFNK_SHARED] = CreateFunction(Context, "upcr_get_shared", Context.VoidTy, argTypes, 4);
-	UPCR_GET[CFNK_SHARED_STRICT] = CreateFunction(Context, "upcr_get_shared_strict", Context.VoidTy, argTypes, 4);
-      }
-      // UPCR_GET_{,P}SHARED_IVAL{,_STRICT}
-      {
-	QualType pargTypes[] = { upcr_pshared_ptr_t, Context.IntTy, Context.IntTy };
-	UPCR_GET_IVAL[CFNK_PSHARED] = CreateFunction(Context, "upcr_get_pshared_val", upcr_register_value_t, pargTypes, 3);
-	UPCR_GET_IVAL[CFNK_PSHARED_STRICT] = CreateFunction(Context, "upcr_get_pshared_val_strict", upcr_register_value_t, pargTypes, 3);
-	QualType argTypes[] = { upcr_shared_ptr_t, Context.IntTy, Context.IntTy };
-	UPCR_GET_IVAL[CFNK_SHARED] = CreateFunction(Context, "upcr_get_shared_val", upcr_register_value_t, argTypes, 3);
-	UPCR_GET_IVAL[CFNK_SHARED_STRICT] = CreateFunction(Context, "upcr_get_shared_val_strict", upcr_register_value_t, argTypes, 3);
-      }
-      // UPCR_GET_{,P}SHARED_FVAL{,_STRICT}
-      {
-	QualType pargTypes[] = { upcr_pshared_ptr_t, Context.IntTy };
-	UPCR_GET_FVAL[CFNK_PSHARED] = CreateFunction(Context, "upcr_get_pshared_floatval", Context.FloatTy, pargTypes, 2);
-	UPCR_GET_FVAL[CFNK_PSHARED_STRICT] = CreateFunction(Context, "upcr_get_pshared_floatval_strict", Context.FloatTy, pargTypes, 2);
-	QualType argTypes[] = { upcr_shared_ptr_t, Context.IntTy };
-	UPCR_GET_FVAL[CFNK_SHARED] = CreateFunction(Context, "upcr_get_shared_floatval", Context.FloatTy, argTypes, 2);
-	UPCR_GET_FVAL[CFNK_SHARED_STRICT] = CreateFunction(Context, "upcr_get_shared_floatval_strict", Context.FloatTy, argTypes, 2);
-      }
-      // UPCR_GET_{,P}SHARED_DVAL{,_STRICT}
-      {
-	QualType pargTypes[] = { upcr_pshared_ptr_t, Context.IntTy };
-	UPCR_GET_DVAL[CFNK_PSHARED] = CreateFunction(Context, "upcr_get_pshared_doubleval", Context.DoubleTy, pargTypes, 2);
-	UPCR_GET_DVAL[CFNK_PSHARED_STRICT] = CreateFunction(Context, "upcr_get_pshared_doubleval_strict", Context.DoubleTy, pargTypes, 2);
-	QualType argTypes[] = { upcr_shared_ptr_t, Context.IntTy };
-	UPCR_GET_DVAL[CFNK_SHARED] = CreateFunction(Context, "upcr_get_shared_doubleval", Context.DoubleTy, argTypes, 2);
-	UPCR_GET_DVAL[CFNK_SHARED_STRICT] = CreateFunction(Context, "upcr_get_shared_doubleval_strict", Context.DoubleTy, argTypes, 2);
-      }
-      // UPCR_PUT_{,P}SHARED{,_STRICT}
-      {
-	QualType pargTypes[] = { upcr_pshared_ptr_t, Context.IntTy, Context.VoidPtrTy, Context.IntTy };
-	UPCR_PUT[CFNK_PSHARED] = CreateFunction(Context, "upcr_put_pshared", Context.VoidTy, pargTypes, 4);
-	UPCR_PUT[CFNK_PSHARED_STRICT] = CreateFunction(Context, "upcr_put_pshared_strict", Context.VoidTy, pargTypes, 4);
-	QualType argTypes[] = { upcr_shared_ptr_t, Context.IntTy, Context.VoidPtrTy, Context.IntTy };
-	UPCR_PUT[CFNK_SHARED] = CreateFunction(Context, "upcr_put_shared", Context.VoidTy, argTypes, 4);
-	UPCR_PUT[CFNK_SHARED_STRICT] = CreateFunction(Context, "upcr_put_shared_strict", Context.VoidTy, argTypes, 4);
-      }
-      // UPCR_PUT_{,P}SHARED_IVAL{,_STRICT}
-      {
-	QualType pargTypes[] = { upcr_pshared_ptr_t, Context.IntTy, upcr_register_value_t, Context.IntTy };
-	UPCR_PUT_IVAL[CFNK_PSHARED] = CreateFunction(Context, "upcr_put_pshared_val", Context.VoidTy, pargTypes, 4);
-	UPCR_PUT_IVAL[CFNK_PSHARED_STRICT] = CreateFunction(Context, "upcr_put_pshared_val_strict", Context.VoidTy, pargTypes, 4);
-	QualType argTypes[] = { upcr_shared_ptr_t, Context.IntTy, upcr_register_value_t, Context.IntTy };
-	UPCR_PUT_IVAL[CFNK_SHARED] = CreateFunction(Context, "upcr_put_shared_val", Context.VoidTy, argTypes, 4);
-	UPCR_PUT_IVAL[CFNK_SHARED_STRICT] = CreateFunction(Context, "upcr_put_shared_val_strict", Context.VoidTy, argTypes, 4);
-      }
-      // UPCR_PUT_{,P}SHARED_FVAL{,_STRICT}
-      {
-	QualType pargTypes[] = { upcr_pshared_ptr_t, Context.IntTy, Context.FloatTy };
-	UPCR_PUT_FVAL[CFNK_PSHARED] = CreateFunction(Context, "upcr_put_pshared_floatval", Context.VoidTy, pargTypes, 3);
-	UPCR_PUT_FVAL[CFNK_PSHARED_STRICT] = CreateFunction(Context, "upcr_put_pshared_floatval_strict", Context.VoidTy, pargTypes, 3);
-	QualType argTypes[] = { upcr_shared_ptr_t, Context.IntTy, Context.FloatTy };
-	UPCR_PUT_FVAL[CFNK_SHARED] = CreateFunction(Context, "upcr_put_shared_floatval", Context.VoidTy, argTypes, 3);
-	UPCR_PUT_FVAL[CFNK_SHARED_STRICT] = CreateFunction(Context, "upcr_put_shared_floatval_strict", Context.VoidTy, argTypes, 3);
-      }
-      // UPCR_PUT_{,P}SHARED_DVAL{,_STRICT}
-      {
-	QualType pargTypes[] = { upcr_pshared_ptr_t, Context.IntTy, Context.DoubleTy };
-	UPCR_PUT_DVAL[CFNK_PSHARED] = CreateFunction(Context, "upcr_put_pshared_doubleval", Context.VoidTy, pargTypes, 3);
-	UPCR_PUT_DVAL[CFNK_PSHARED_STRICT] = CreateFunction(Context, "upcr_put_pshared_doubleval_strict", Context.VoidTy, pargTypes, 3);
-	QualType argTypes[] = { upcr_shared_ptr_t, Context.IntTy, Context.DoubleTy };
-	UPCR_PUT_DVAL[CFNK_SHARED] = CreateFunction(Context, "upcr_put_shared_doubleval", Context.VoidTy, argTypes, 3);
-	UPCR_PUT_DVAL[CFNK_SHARED_STRICT] = CreateFunction(Context, "upcr_put_shared_doubleval_strict", Context.VoidTy, argTypes, 3);
-      }
-      // upcrt_forall_control
-      {
-	DeclContext *DC = Context.getTranslationUnitDecl();
-	upcrt_forall_control = VarDecl::Create(Context, DC, SourceLocation(), SourceLocation(), &Context.Idents.get("upcrt_forall_control"), Context.IntTy, Context.getTrivialTypeSourceInfo(Context.IntTy), SC_Extern);
-      }
-      // upcr_null_shared
-      {
-	DeclContext *DC = Context.getTranslationUnitDecl();
-	upcr_null_shared = VarDecl::Create(Context, DC, SourceLocation(), SourceLocation(), &Context.Idents.get("upcr_null_shared"), upcr_shared_ptr_t, Context.getTrivialTypeSourceInfo(upcr_shared_ptr_t), SC_Extern);
-      }
-      // upcr_null_pshared
-      {
-	DeclContext *DC = Context.getTranslationUnitDecl();
-	upcr_null_pshared = VarDecl::Create(Context, DC, SourceLocation(), SourceLocation(), &Context.Idents.get("upcr_null_pshared"), upcr_pshared_ptr_t, Context.getTrivialTypeSourceInfo(upcr_pshared_ptr_t), SC_Extern);
-      }
-
-    }
+    UPCRDecls(ASTContext& Context, const RuntimeABI &ABI);
     FunctionDecl *CreateFunction(ASTContext& Context, StringRef name, QualType RetType, QualType * argTypes, int numArgs, bool Variadic = false) {
       DeclContext *DC = Context.getTranslationUnitDecl();
       FunctionProtoType::ExtProtoInfo Info;
@@ -457,6 +240,45 @@ namespace {
       Result->setParams(Params);
       return Result;
     }
+    // Creates a function from a signature of the runtime ABI
+    // table, such as "int(upcr_shared_ptr_t, int)".
+    FunctionDecl *CreateFunction(ASTContext& Context, StringRef name, StringRef Signature) {
+      std::pair<StringRef, StringRef> Parts = Signature.split('(');
+      QualType RetType = getABIType(Context, Parts.first);
+      llvm::SmallVector<QualType, 6> argTypes;
+      bool Variadic = false;
+      llvm::SmallVector<StringRef, 6> Args;
+      Parts.second.rtrim().drop_back().split(Args, ',', -1, false);
+      for(llvm::SmallVectorImpl<StringRef>::iterator iter = Args.begin(), end = Args.end(); iter != end; ++iter) {
+        if(iter->trim() == "...")
+          Variadic = true;
+        else
+          argTypes.push_back(getABIType(Context, *iter));
+      }
+      return CreateFunction(Context, name, RetType, argTypes.data(), argTypes.size(), Variadic);
+    }
+    // The type that T names in a signature of the runtime ABI
+    // table, or a null type.
+    QualType getABIType(ASTContext& Context, StringRef T) {
+      T = T.trim();
+      if(T.consume_back("*"))
+        return Context.getPointerType(getABIType(Context, T));
+      if(T.consume_front("const "))
+        return Context.getConstType(getABIType(Context, T));
+      return llvm::StringSwitch<QualType>(T)
+        .Case("void", Context.VoidTy)
+        .Case("char", Context.CharTy)
+        .Case("int", Context.IntTy)
+        .Case("float", Context.FloatTy)
+        .Case("double", Context.DoubleTy)
+        .Case("uintptr_t", Context.getUIntPtrType())
+        .Case("upcr_shared_ptr_t", upcr_shared_ptr_t)
+        .Case("upcr_pshared_ptr_t", upcr_pshared_ptr_t)
+        .Case("upcr_startup_shalloc_t", upcr_startup_shalloc_t)
+        .Case("upcr_startup_pshalloc_t", upcr_startup_pshalloc_t)
+        .Case("upcr_register_value_t", upcr_register_value_t)
+        .Default(QualType());
+    }
     QualType CreateTypedefType(ASTContext& Context, StringRef name) {
       return CreateTypedefType(Context, name, Context.IntTy);
     }
@@ -467,6 +289,250 @@ namespace {
     }
   };
 
+  // The runtime entry points that translated code calls, by
+  // role, with their names in the Berkeley UPC runtime and the
+  // signatures they are called with.  Each role sets a member
+  // of UPCRDecls, or one of the four functions of a UPCRCommFn.
+  struct RuntimeRole {
+    const char *Role;
+    const char *Name;
+    const char *Signature;
+    FunctionDecl *UPCRDecls::*Fn;
+    UPCRCommFn UPCRDecls::*CommFn;
+    int CommKind;
+  };
+
+#define UPC2C_ROLE(Role, Name, Signature, Member) \
+  { Role, Name, Signature, &UPCRDecls::Member, 0, 0 }
+#define UPC2C_COMM_ROLES(Op, Suffix, PSignature, Signature, Member)	\
+  { Op Suffix ".pshared", "upcr_" Op "_pshared" Suffix, PSignature, 0, &UPCRDecls::Member, CFNK_PSHARED }, \
+  { Op Suffix ".pshared_strict", "upcr_" Op "_pshared" Suffix "_strict", PSignature, 0, &UPCRDecls::Member, CFNK_PSHARED_STRICT }, \
+  { Op Suffix ".shared", "upcr_" Op "_shared" Suffix, Signature, 0, &UPCRDecls::Member, CFNK_SHARED }, \
+  { Op Suffix ".shared_strict", "upcr_" Op "_shared" Suffix "_strict", Signature, 0, &UPCRDecls::Member, CFNK_SHARED_STRICT }
+
+  const RuntimeRole RuntimeRoles[] = {
+    UPC2C_ROLE("notify", "upcr_notify", "void(int, int)", upcr_notify),
+    UPC2C_ROLE("wait", "upcr_wait", "void(int, int)", upcr_wait),
+    UPC2C_ROLE("barrier", "upcr_barrier", "void(int, int)", upcr_barrier),
+    UPC2C_ROLE("poll", "upcr_poll", "void()", upcr_poll),
+    UPC2C_ROLE("mythread", "upcr_mythread", "int()", upcr_mythread),
+    UPC2C_ROLE("threads", "upcr_threads", "int()", upcr_threads),
+    UPC2C_ROLE("has_affinity.pshared", "upcr_hasMyAffinity_pshared", "int(upcr_pshared_ptr_t)", upcr_hasMyAffinity_pshared),
+    UPC2C_ROLE("has_affinity.shared", "upcr_hasMyAffinity_shared", "int(upcr_shared_ptr_t)", upcr_hasMyAffinity_shared),
+    UPC2C_ROLE("add.shared", "upcr_add_shared", "upcr_shared_ptr_t(upcr_shared_ptr_t, int, int, int)", UPCR_ADD_SHARED),
+    UPC2C_ROLE("add.psharedI", "upcr_add_psharedI", "upcr_pshared_ptr_t(upcr_pshared_ptr_t, int, int)", UPCR_ADD_PSHAREDI),
+    UPC2C_ROLE("add.pshared1", "upcr_add_pshared1", "upcr_pshared_ptr_t(upcr_pshared_ptr_t, int, int)", UPCR_ADD_PSHARED1),
+    UPC2C_ROLE("inc.shared", "upcr_inc_shared", "void(upcr_shared_ptr_t*, int, int, int)", UPCR_INC_SHARED),
+    UPC2C_ROLE("inc.psharedI", "upcr_inc_psharedI", "void(upcr_pshared_ptr_t*, int, int)", UPCR_INC_PSHAREDI),
+    UPC2C_ROLE("inc.pshared1", "upcr_inc_pshared1", "void(upcr_pshared_ptr_t*, int, int)", UPCR_INC_PSHARED1),
+    UPC2C_ROLE("sub.shared", "upcr_sub_shared", "int(upcr_shared_ptr_t, upcr_shared_ptr_t, int, int)", UPCR_SUB_SHARED),
+    UPC2C_ROLE("sub.psharedI", "upcr_sub_psharedI", "int(upcr_pshared_ptr_t, upcr_pshared_ptr_t, int)", UPCR_SUB_PSHAREDI),
+    UPC2C_ROLE("sub.pshared1", "upcr_sub_pshared1", "int(upcr_pshared_ptr_t, upcr_pshared_ptr_t, int)", UPCR_SUB_PSHARED1),
+    UPC2C_ROLE("isequal.shared.shared", "upcr_isequal_shared_shared", "int(upcr_shared_ptr_t, upcr_shared_ptr_t)", UPCR_ISEQUAL_SHARED_SHARED),
+    UPC2C_ROLE("isequal.shared.pshared", "upcr_isequal_shared_pshared", "int(upcr_shared_ptr_t, upcr_pshared_ptr_t)", UPCR_ISEQUAL_SHARED_PSHARED),
+    UPC2C_ROLE("isequal.pshared.shared", "upcr_isequal_pshared_shared", "int(upcr_pshared_ptr_t, upcr_shared_ptr_t)", UPCR_ISEQUAL_PSHARED_SHARED),
+    UPC2C_ROLE("isequal.pshared.pshared", "upcr_isequal_pshared_pshared", "int(upcr_pshared_ptr_t, upcr_pshared_ptr_t)", UPCR_ISEQUAL_PSHARED_PSHARED),
+    UPC2C_ROLE("to_local.shared", "upcr_shared_to_local", "void*(upcr_shared_ptr_t)", UPCR_SHARED_TO_LOCAL),
+    UPC2C_ROLE("to_local.pshared", "upcr_pshared_to_local", "void*(upcr_pshared_ptr_t)", UPCR_PSHARED_TO_LOCAL),
+    UPC2C_ROLE("isnull.shared", "upcr_isnull_shared", "int(upcr_shared_ptr_t)", UPCR_ISNULL_SHARED),
+    UPC2C_ROLE("isnull.pshared", "upcr_isnull_pshared", "int(upcr_pshared_ptr_t)", UPCR_ISNULL_PSHARED),
+    UPC2C_ROLE("shared_to_pshared", "upcr_shared_to_pshared", "upcr_pshared_ptr_t(upcr_shared_ptr_t)", UPCR_SHARED_TO_PSHARED),
+    UPC2C_ROLE("pshared_to_shared", "upcr_pshared_to_shared", "upcr_shared_ptr_t(upcr_pshared_ptr_t)", UPCR_PSHARED_TO_SHARED),
+    UPC2C_ROLE("resetphase.shared", "upcr_shared_resetphase", "upcr_shared_ptr_t(upcr_shared_ptr_t)", UPCR_SHARED_RESETPHASE),
+    UPC2C_ROLE("addrfield.shared", "upcr_addrfield_shared", "uintptr_t(upcr_shared_ptr_t)", UPCR_ADDRFIELD_SHARED),
+    UPC2C_ROLE("addrfield.pshared", "upcr_addrfield_pshared", "uintptr_t(upcr_pshared_ptr_t)", UPCR_ADDRFIELD_PSHARED),
+    UPC2C_ROLE("begin_function", "UPCR_BEGIN_FUNCTION", "void()", UPCR_BEGIN_FUNCTION),
+    UPC2C_ROLE("exit_function", "UPCR_EXIT_FUNCTION", "void()", UPCR_EXIT_FUNCTION),
+    UPC2C_ROLE("startup_shalloc.pshared", "upcr_startup_pshalloc", "void(upcr_startup_pshalloc_t*, int)", upcr_startup_pshalloc),
+    UPC2C_ROLE("startup_shalloc.shared", "upcr_startup_shalloc", "void(upcr_startup_shalloc_t*, int)", upcr_startup_shalloc),
+    UPC2C_ROLE("tld_addr", "UPCR_TLD_ADDR", "void*(...)", UPCR_TLD_ADDR),
+    UPC2C_COMM_ROLES("get", "", "void(void*, upcr_pshared_ptr_t, int, int)", "void(void*, upcr_shared_ptr_t, int, int)", UPCR_GET),
+    UPC2C_COMM_ROLES("get", "_val", "upcr_register_value_t(upcr_pshared_ptr_t, int, int)", "upcr_register_value_t(upcr_shared_ptr_t, int, int)", UPCR_GET_IVAL),
+    UPC2C_COMM_ROLES("get", "_floatval", "float(upcr_pshared_ptr_t, int)", "float(upcr_shared_ptr_t, int)", UPCR_GET_FVAL),
+    UPC2C_COMM_ROLES("get", "_doubleval", "double(upcr_pshared_ptr_t, int)", "double(upcr_shared_ptr_t, int)", UPCR_GET_DVAL),
+    UPC2C_COMM_ROLES("put", "", "void(upcr_pshared_ptr_t, int, void*, int)", "void(upcr_shared_ptr_t, int, void*, int)", UPCR_PUT),
+    UPC2C_COMM_ROLES("put", "_val", "void(upcr_pshared_ptr_t, int, upcr_register_value_t, int)", "void(upcr_shared_ptr_t, int, upcr_register_value_t, int)", UPCR_PUT_IVAL),
+    UPC2C_COMM_ROLES("put", "_floatval", "void(upcr_pshared_ptr_t, int, float)", "void(upcr_shared_ptr_t, int, float)", UPCR_PUT_FVAL),
+    UPC2C_COMM_ROLES("put", "_doubleval", "void(upcr_pshared_ptr_t, int, double)", "void(upcr_shared_ptr_t, int, double)", UPCR_PUT_DVAL),
+  };
+
+#undef UPC2C_ROLE
+#undef UPC2C_COMM_ROLES
+
+  const char *const CommKindNames[] = { "pshared", "pshared_strict", "shared", "shared_strict" };
+
+  // The role of a get or put by value of Size bytes, such as
+  // "get_val.shared_strict.4"
+  std::string SizedValueRole(bool Put, int Kind, int Size) {
+    return (Twine(Put? "put_val." : "get_val.") + CommKindNames[Kind] + "." + Twine(Size)).str();
+  }
+
+  // The names of the runtime entry points.  The built-in table
+  // is that of the Berkeley UPC runtime.  A file given with
+  // -runtime-abi= renames entry points, for runtimes that use
+  // other names, and can add gets and puts for values of one
+  // size, which are called instead of get_val.<kind> and
+  // put_val.<kind> without their size argument.  Each line of
+  // the file is
+  //
+  //   role name [signature]
+  //
+  // with the roles and signatures of RuntimeRoles, or a role
+  // get_val.<kind>.<size> or put_val.<kind>.<size> with the
+  // signature of get_val.<kind> or put_val.<kind> less the size.
+  // A signature is only checked.  Blank lines and lines that
+  // start with # are ignored.
+  class RuntimeABI {
+  public:
+    RuntimeABI() {
+      for(const RuntimeRole *R = std::begin(RuntimeRoles); R != std::end(RuntimeRoles); ++R)
+        Names[R->Role] = R->Name;
+    }
+    static const RuntimeABI &getDefault() {
+      static const RuntimeABI Default;
+      return Default;
+    }
+    // Applies the lines of a table file on top of this table
+    bool load(const std::string &Path, llvm::raw_ostream &Errs) {
+      llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer> > File = llvm::MemoryBuffer::getFile(Path);
+      if(!File) {
+        Errs << "clang-upc2c: cannot read runtime ABI '" << Path << "': " << File.getError().message() << "\n";
+        return false;
+      }
+      llvm::SmallVector<StringRef, 128> Lines;
+      (*File)->getBuffer().split(Lines, '\n');
+      for(std::size_t i = 0; i < Lines.size(); ++i) {
+        StringRef Line = Lines[i].trim();
+        if(Line.empty() || Line.startswith("#"))
+          continue;
+        std::pair<StringRef, StringRef> Role = llvm::getToken(Line);
+        std::pair<StringRef, StringRef> Name = llvm::getToken(Role.second);
+        std::string Error;
+        std::string Expected = getSignature(Role.first);
+        if(Expected.empty())
+          Error = "unknown role '" + Role.first.str() + "'";
+        else if(Name.first.empty() ||
+                std::find_if(Name.first.begin(), Name.first.end(), std::not1(is_ident_char())) != Name.first.end())
+          Error = "invalid name '" + Name.first.str() + "'";
+        else if(!Name.second.trim().empty() &&
+                normalizeSignature(Name.second) != normalizeSignature(Expected))
+          Error = "role '" + Role.first.str() + "' has the signature " + Expected;
+        if(!Error.empty()) {
+          Errs << Path << ":" << i + 1 << ": " << Error << "\n";
+          return false;
+        }
+        Names[Role.first.str()] = Name.first.str();
+      }
+      return true;
+    }
+    // The name of the entry point for Role, or "" if there is none
+    StringRef lookup(StringRef Role) const {
+      std::map<std::string, std::string>::const_iterator pos = Names.find(Role.str());
+      return pos == Names.end()? StringRef() : StringRef(pos->second);
+    }
+    // The signature that Role is called with, or "" if it is not
+    // a role
+    static std::string getSignature(StringRef Role) {
+      for(const RuntimeRole *R = std::begin(RuntimeRoles); R != std::end(RuntimeRoles); ++R)
+        if(Role == R->Role)
+          return R->Signature;
+      for(int Kind = 0; Kind < 4; ++Kind) {
+        for(int Size = 1; Size <= MaxSizedValue; ++Size) {
+          if(Role == SizedValueRole(false, Kind, Size))
+            return std::string("upcr_register_value_t(") + (Kind < CFNK_SHARED? "upcr_pshared_ptr_t" : "upcr_shared_ptr_t") + ", int)";
+          if(Role == SizedValueRole(true, Kind, Size))
+            return std::string("void(") + (Kind < CFNK_SHARED? "upcr_pshared_ptr_t" : "upcr_shared_ptr_t") + ", int, upcr_register_value_t)";
+        }
+      }
+      return std::string();
+    }
+    // Identifies the table in cache keys
+    std::string getKey() const {
+      std::vector<std::string> Parts;
+      for(std::map<std::string, std::string>::const_iterator iter = Names.begin(), end = Names.end(); iter != end; ++iter) {
+        Parts.push_back(iter->first);
+        Parts.push_back(iter->second);
+      }
+      return HashStrings(Parts);
+    }
+  private:
+    static std::string normalizeSignature(StringRef Signature) {
+      std::string Result;
+      for(StringRef::iterator iter = Signature.begin(), end = Signature.end(); iter != end; ++iter) {
+        if(!isspace(static_cast<unsigned char>(*iter)))
+          Result += *iter;
+      }
+      return Result;
+    }
+    // Ordered, so that the key does not depend on hashing
+    std::map<std::string, std::string> Names;
+  };
+
+  UPCRDecls::UPCRDecls(ASTContext& Context, const RuntimeABI &ABI) {
+    SourceManager& SourceMgr = Context.getSourceManager();
+    FakeLocation = SourceMgr.getLocForStartOfFile(SourceMgr.getMainFileID());
+
+    // types
+
+    // Make sure that the size and alignment are correct.
+    QualType SharedPtrTy = Context.getPointerType(Context.getSharedType(Context.VoidTy));
+    upcr_shared_ptr_t = CreateTypedefType(Context, "upcr_shared_ptr_t", SharedPtrTy);
+    upcr_pshared_ptr_t = CreateTypedefType(Context, "upcr_pshared_ptr_t", SharedPtrTy);
+    upcr_startup_shalloc_t = CreateTypedefType(Context, "upcr_startup_shalloc_t");
+    upcr_startup_pshalloc_t = CreateTypedefType(Context, "upcr_startup_pshalloc_t");
+
+    // FIXME: This is a fair assumption, but should really get true type
+    upcr_register_value_t = CreateTypedefType(Context, "upcr_register_value_t", Context.getUIntPtrType());
+
+    // runtime entry points
+    for(const RuntimeRole *R = std::begin(RuntimeRoles); R != std::end(RuntimeRoles); ++R) {
+      FunctionDecl *FD = CreateFunction(Context, ABI.lookup(R->Role), R->Signature);
+      if(R->Fn)
+	this->*R->Fn = FD;
+      else
+	(this->*R->CommFn)[R->CommKind] = FD;
+    }
+    for(int Kind = 0; Kind < 4; ++Kind) {
+      for(int Size = 1; Size <= MaxSizedValue; ++Size) {
+	for(int Put = 0; Put < 2; ++Put) {
+	  std::string Role = SizedValueRole(Put, Kind, Size);
+	  StringRef Name = ABI.lookup(Role);
+	  if(!Name.empty())
+	    (Put? UPCR_PUT_IVAL_SIZED : UPCR_GET_IVAL_SIZED)[Size][Kind] =
+	      CreateFunction(Context, Name, RuntimeABI::getSignature(Role));
+	}
+      }
+    }
+
+    // The startup allocation macros are defined by the header of
+    // each translated file, so they are not part of the runtime ABI.
+    // UPCRT_STARTUP_PSHALLOC
+    {
+      QualType argTypes[] = { upcr_pshared_ptr_t, Context.IntTy, Context.IntTy, Context.IntTy, Context.IntTy, Context. getPointerType(Context.getConstType(Context.CharTy)) };
+      UPCRT_STARTUP_PSHALLOC = CreateFunction(Context, "UPCRT_STARTUP_PSHALLOC", upcr_startup_pshalloc_t, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
+    }
+    // UPCRT_STARTUP_SHALLOC
+    {
+      QualType argTypes[] = { upcr_shared_ptr_t, Context.IntTy, Context.IntTy, Context.IntTy, Context.IntTy, Context. getPointerType(Context.getConstType(Context.CharTy)) };
+      UPCRT_STARTUP_SHALLOC = CreateFunction(Context, "UPCRT_STARTUP_SHALLOC", upcr_startup_shalloc_t, argTypes, sizeof(argTypes)/sizeof(argTypes[0]));
+    }
+    // upcrt_forall_control
+    {
+      DeclContext *DC = Context.getTranslationUnitDecl();
+      upcrt_forall_control = VarDecl::Create(Context, DC, SourceLocation(), SourceLocation(), &Context.Idents.get("upcrt_forall_control"), Context.IntTy, Context.getTrivialTypeSourceInfo(Context.IntTy), SC_Extern);
+    }
+    // upcr_null_shared
+    {
+      DeclContext *DC = Context.getTranslationUnitDecl();
+      upcr_null_shared = VarDecl::Create(Context, DC, SourceLocation(), SourceLocation(), &Context.Idents.get("upcr_null_shared"), upcr_shared_ptr_t, Context.getTrivialTypeSourceInfo(upcr_shared_ptr_t), SC_Extern);
+    }
+    // upcr_null_pshared
+    {
+      DeclContext *DC = Context.getTranslationUnitDecl();
+      upcr_null_pshared = VarDecl::Create(Context, DC, SourceLocation(), SourceLocation(), &Context.Idents.get("upcr_null_pshared"), upcr_pshared_ptr_t, Context.getTrivialTypeSourceInfo(upcr_pshared_ptr_t), SC_Extern);
+    }
+  }
+
   class SubstituteType : public clang::TreeTransform<SubstituteType> {
     typedef TreeTransform<SubstituteType> TreeTransformS;
   public:
@@ -541,79 +607,750 @@ namespace {
     bool Found;
   };
 
-  class RemoveUPCTransform : public clang::TreeTransform<RemoveUPCTransform> {
-    typedef TreeTransform<RemoveUPCTransform> TreeTransformUPC;
+  // The counters reported by -print-stats and -stats-file=.
+#define UPC2C_STATS(X) \
+  X(ValueGets,        "upcr_get_*_val calls") \
+  X(BulkGets,         "upcr_get_* calls by reference") \
+  X(ValuePuts,        "upcr_put_*_val calls") \
+  X(BulkPuts,         "upcr_put_* calls by reference") \
+  X(StrictAccesses,   "strict gets and puts") \
+  X(RelaxedAccesses,  "relaxed gets and puts") \
+  X(AddShared,        "upcr_add_shared calls") \
+  X(AddPsharedI,      "upcr_add_psharedI calls") \
+  X(AddPshared1,      "upcr_add_pshared1 calls") \
+  X(FoldedIntoAccess, "conversions and offsets folded into gets and puts") \
+  X(FoldedAdds,       "nested pointer additions folded together") \
+  X(Temporaries,      "temporaries created") \
+  X(TLDReferences,    "TLD references built") \
+  X(ForallLoops,      "upc_forall loops lowered") \
+  X(ReusedFunctions,  "function definitions copied by -incremental-dir=") \
+  X(VerbatimFunctions, "function definitions copied by -verbatim-c") \
+  X(ForallTestsRemoved, "upcrt_forall_control tests left out by -whole-program=") \
+  X(UnusedDecls,      "unused declarations left out by -strip-unused")
+
+  // What the translator generated for one translation unit.
+  struct TransformStats {
+#define UPC2C_STAT_FIELD(Name, Desc) unsigned Name;
+    UPC2C_STATS(UPC2C_STAT_FIELD)
+#undef UPC2C_STAT_FIELD
+    // False if the file was not transformed, e.g. on a cache hit
+    bool Collected;
+    TransformStats() { std::memset(this, 0, sizeof(*this)); }
+  };
+
+  // Counts the runtime calls that a transformed declaration
+  // contains, as opposed to the ones that were built and then
+  // folded into others.
+  class CountRuntimeCalls : public RecursiveASTVisitor<CountRuntimeCalls> {
+  public:
+    enum CallKind { ValueGet, BulkGet, ValuePut, BulkPut, AddShared, AddPsharedI, AddPshared1 };
+    CountRuntimeCalls(UPCRDecls &Decls, TransformStats &S) : Stats(S) {
+      addAccessor(Decls.UPCR_GET_IVAL, ValueGet);
+      addAccessor(Decls.UPCR_GET_FVAL, ValueGet);
+      addAccessor(Decls.UPCR_GET_DVAL, ValueGet);
+      addAccessor(Decls.UPCR_GET, BulkGet);
+      addAccessor(Decls.UPCR_PUT_IVAL, ValuePut);
+      addAccessor(Decls.UPCR_PUT_FVAL, ValuePut);
+      addAccessor(Decls.UPCR_PUT_DVAL, ValuePut);
+      addAccessor(Decls.UPCR_PUT, BulkPut);
+      for(int Size = 1; Size <= MaxSizedValue; ++Size) {
+        addAccessor(Decls.UPCR_GET_IVAL_SIZED[Size], ValueGet);
+        addAccessor(Decls.UPCR_PUT_IVAL_SIZED[Size], ValuePut);
+      }
+      Kinds[Decls.UPCR_ADD_SHARED] = std::make_pair(AddShared, false);
+      Kinds[Decls.UPCR_ADD_PSHAREDI] = std::make_pair(AddPsharedI, false);
+      Kinds[Decls.UPCR_ADD_PSHARED1] = std::make_pair(AddPshared1, false);
+    }
+    bool VisitCallExpr(CallExpr *E) {
+      llvm::DenseMap<FunctionDecl*, std::pair<CallKind, bool> >::const_iterator pos = Kinds.find(E->getDirectCallee());
+      if(pos == Kinds.end())
+        return true;
+      switch(pos->second.first) {
+      case ValueGet: ++Stats.ValueGets; break;
+      case BulkGet: ++Stats.BulkGets; break;
+      case ValuePut: ++Stats.ValuePuts; break;
+      case BulkPut: ++Stats.BulkPuts; break;
+      case AddShared: ++Stats.AddShared; return true;
+      case AddPsharedI: ++Stats.AddPsharedI; return true;
+      case AddPshared1: ++Stats.AddPshared1; return true;
+      }
+      if(pos->second.second)
+        ++Stats.StrictAccesses;
+      else
+        ++Stats.RelaxedAccesses;
+      return true;
+    }
   private:
-    bool haveOffsetOf;
-    bool haveVAArg;
+    void addAccessor(UPCRCommFn &Fn, CallKind Kind) {
+      for(int i = 0; i < 4; ++i) {
+        if(Fn[i])
+          Kinds[Fn[i]] = std::make_pair(Kind, i == CFNK_PSHARED_STRICT || i == CFNK_SHARED_STRICT);
+      }
+    }
+    llvm::DenseMap<FunctionDecl*, std::pair<CallKind, bool> > Kinds;
+    TransformStats &Stats;
+  };
+
+  // What -whole-program= learns from one file: the functions it
+  // defines, the calls each of them makes, and the functions whose
+  // address is taken.  A call is InForall if it is anywhere in a
+  // upc_forall with an affinity expression, where
+  // upcrt_forall_control is always set.  Functions are named by
+  // ProgramSummary::getKey.
+  struct FileSummary {
+    struct Call {
+      std::string Caller;
+      std::string Callee;
+      bool InForall;
+    };
+    std::vector<std::string> Defined;
+    std::vector<Call> Calls;
+    std::vector<std::string> AddressTaken;
+  };
+
+  // The call graph of all the files of a program.  For each
+  // function, it finds whether upcrt_forall_control can be clear
+  // and whether it can be set when the function runs, so that
+  // the upc_forall loops in it only test the flag when both are
+  // possible.  Functions whose address is taken, and externally
+  // visible functions without callers in the program, which code
+  // outside the inputs may call, are assumed to be called from
+  // anywhere.  main is only called from outside any upc_forall.
+  class ProgramSummary {
   public:
-    RemoveUPCTransform(Sema& S, UPCRDecls* D, const std::string& fileid)
-      : TreeTransformUPC(S), AnonRecordID(0), StaticLocalVarID(0),
-        Decls(D), FileString(fileid) {
-      haveOffsetOf = haveVAArg = false;
+    enum ForallContext { MaybeInForall, InForall, NotInForall };
+    // Functions with internal linkage are qualified by the id of
+    // their file.
+    static std::string getKey(const FunctionDecl *FD, StringRef FileId) {
+      if(FD->isExternallyVisible())
+        return FD->getName().str();
+      return (FileId + ":" + FD->getName()).str();
     }
-    bool HaveOffsetOf() { return haveOffsetOf; }
-    ExprResult TransformOffsetOfExpr(OffsetOfExpr *E) {
-      haveOffsetOf = true;
-      return TreeTransformUPC::TransformOffsetOfExpr(E);
+    void add(const FileSummary &File) {
+      for(std::vector<std::string>::const_iterator iter = File.Defined.begin(), end = File.Defined.end(); iter != end; ++iter)
+        Functions[getIndex(*iter)].Defined = true;
+      for(std::vector<FileSummary::Call>::const_iterator iter = File.Calls.begin(), end = File.Calls.end(); iter != end; ++iter) {
+        unsigned Caller = getIndex(iter->Caller);
+        unsigned Callee = getIndex(iter->Callee);
+        Functions[Caller].Callees.push_back(std::make_pair(Callee, iter->InForall));
+        Functions[Callee].HasCaller = true;
+      }
+      for(std::vector<std::string>::const_iterator iter = File.AddressTaken.begin(), end = File.AddressTaken.end(); iter != end; ++iter)
+        Functions[getIndex(*iter)].AddressTaken = true;
     }
-    bool HaveVAArg() { return haveVAArg; }
-    ExprResult TransformVAArgExpr(VAArgExpr *E) {
-      haveVAArg = true;
-      return TreeTransformUPC::TransformVAArgExpr(E);
+    // Propagates the state of upcrt_forall_control from the
+    // callers of each function to its callees, once every file
+    // has been added.
+    void analyze() {
+      std::vector<unsigned> Worklist;
+      for(unsigned i = 0; i < Functions.size(); ++i) {
+        FunctionInfo &Info = Functions[i];
+        bool Main = Names[i] == "main";
+        if(Info.AddressTaken || !Info.HasCaller || Main) {
+          // Only functions with internal linkage have keys with a
+          // file id, and those without callers are never called
+          bool External = Names[i].find(':') == std::string::npos;
+          Info.Outside = true;
+          Info.Inside |= Info.AddressTaken || (!Info.HasCaller && External && !Main);
+          Worklist.push_back(i);
+        }
+        for(std::vector<std::pair<unsigned, bool> >::const_iterator iter = Info.Callees.begin(), end = Info.Callees.end(); iter != end; ++iter) {
+          if(iter->second && !Functions[iter->first].Inside) {
+            Functions[iter->first].Inside = true;
+            Worklist.push_back(iter->first);
+          }
+        }
+      }
+      while(!Worklist.empty()) {
+        unsigned Caller = Worklist.back();
+        Worklist.pop_back();
+        for(std::vector<std::pair<unsigned, bool> >::const_iterator iter = Functions[Caller].Callees.begin(), end = Functions[Caller].Callees.end(); iter != end; ++iter) {
+          if(iter->second)
+            continue;
+          FunctionInfo &Callee = Functions[iter->first];
+          if((Functions[Caller].Inside && !Callee.Inside) || (Functions[Caller].Outside && !Callee.Outside)) {
+            Callee.Inside |= Functions[Caller].Inside;
+            Callee.Outside |= Functions[Caller].Outside;
+            Worklist.push_back(iter->first);
+          }
+        }
+      }
+      std::vector<std::string> Parts;
+      for(unsigned i = 0; i < Functions.size(); ++i) {
+        if(Functions[i].Defined) {
+          Parts.push_back(Names[i]);
+          Parts.push_back(Functions[i].Inside? (Functions[i].Outside? "maybe" : "inside") : "outside");
+        }
+      }
+      std::sort(Parts.begin(), Parts.end());
+      Hash = HashStrings(Parts);
     }
-    bool AlwaysRebuild() { return true; }
-    ExprResult BuildParens(Expr * E) {
-      return SemaRef.ActOnParenExpr(SourceLocation(), SourceLocation(), E);
+    ForallContext getForallContext(const FunctionDecl *FD, StringRef FileId) const {
+      if(!FD)
+        return MaybeInForall;
+      llvm::StringMap<unsigned>::const_iterator pos = Index.find(getKey(FD, FileId));
+      if(pos == Index.end())
+        return MaybeInForall;
+      const FunctionInfo &Info = Functions[pos->second];
+      if(Info.Inside && !Info.Outside)
+        return InForall;
+      if(Info.Outside && !Info.Inside)
+        return NotInForall;
+      return MaybeInForall;
     }
-    ExprResult BuildComma(Expr * LHS, Expr * RHS) {
-      return SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Comma, LHS, RHS);
+    // Identifies the result of analyze in cache keys
+    const std::string &getHash() const { return Hash; }
+  private:
+    struct FunctionInfo {
+      FunctionInfo() : Defined(false), HasCaller(false), AddressTaken(false), Inside(false), Outside(false) {}
+      // Each callee, and whether it is called in a upc_forall
+      std::vector<std::pair<unsigned, bool> > Callees;
+      bool Defined;
+      bool HasCaller;
+      bool AddressTaken;
+      // Whether upcrt_forall_control can be set, or clear, when
+      // the function runs
+      bool Inside;
+      bool Outside;
+    };
+    unsigned getIndex(const std::string &Name) {
+      std::pair<llvm::StringMap<unsigned>::iterator, bool> Result = Index.insert(std::make_pair(Name, Functions.size()));
+      if(Result.second) {
+        Functions.push_back(FunctionInfo());
+        Names.push_back(Name);
+      }
+      return Result.first->second;
     }
-    // TreeTransform ignores AlwayRebuild for literals
-    ExprResult TransformIntegerLiteral(IntegerLiteral *E) {
-      return IntegerLiteral::Create(SemaRef.Context, E->getValue(), E->getType(), E->getLocation());
+    llvm::StringMap<unsigned> Index;
+    std::vector<FunctionInfo> Functions;
+    std::vector<std::string> Names;
+    std::string Hash;
+  };
+
+  // Receives the top-level declarations of the translated
+  // file in order, as soon as each one has been transformed.
+  class DeclEmitter {
+  public:
+    virtual ~DeclEmitter() {}
+    virtual void emit(Decl *D) = 0;
+    virtual void finish() = 0;
+  };
+
+  // The numbering of the names that lowering invents, and the
+  // helper macros that a function definition's text needs.
+  struct UnitState {
+    UnitState() : AnonRecordID(0), StaticLocalVarID(0), VAArg(false), OffsetOf(false) {}
+    int AnonRecordID;
+    int StaticLocalVarID;
+    bool VAArg;
+    bool OffsetOf;
+  };
+
+  // Lets function definitions be copied from an earlier
+  // translation of the same file instead of being lowered.
+  class UnitCache {
+  public:
+    virtual ~UnitCache() {}
+    // Called before FD is lowered, with the numbering so far.  If
+    // the text of FD has been emitted from the cache, returns true
+    // and sets State to what it would have been after lowering FD.
+    virtual bool reuse(FunctionDecl *FD, UnitState &State) = 0;
+    // Called after FD has been lowered.  Reusable is false if the
+    // lowering of FD added to state that other declarations see.
+    virtual void lowered(FunctionDecl *FD, const UnitState &Before,
+                         const UnitState &After, bool Reusable) = 0;
+  };
+
+  // Records where macros are expanded and which way conditional
+  // directives go, for the parts of a declaration's meaning that
+  // its text does not show.
+  class MacroUseRecorder : public PPCallbacks {
+  public:
+    enum UseKind { UseMacro, UseCondition, UseLine, UseDefine, UseUncacheable };
+    MacroUseRecorder(Preprocessor &P) : PP(P) {}
+    virtual void MacroExpands(const Token &MacroNameTok, const MacroDefinition &MD,
+                              SourceRange Range, const MacroArgs *Args) {
+      noteModelMacro(MacroNameTok);
+      const MacroInfo *MI = MD.getMacroInfo();
+      if(!MI)
+        return;
+      if(!MI->isBuiltinMacro()) {
+        add(Range.getBegin(), UseMacro, 0, MI);
+        return;
+      }
+      // __LINE__ is the only builtin whose value depends on where
+      // a definition is.  The ones that change on every run make
+      // the declaration uncacheable.
+      StringRef Name = MacroNameTok.getIdentifierInfo()->getName();
+      if(Name == "__DATE__" || Name == "__TIME__" || Name == "__TIMESTAMP__" || Name == "__COUNTER__")
+        add(Range.getBegin(), UseUncacheable, 0, 0);
+      else
+        add(Range.getBegin(), UseLine, PP.getSourceManager().getPresumedLineNumber(
+              PP.getSourceManager().getExpansionLoc(Range.getBegin())), 0);
     }
-    ExprResult BuildUPCRCall(FunctionDecl *FD, std::vector<Expr*>& args, SourceLocation Loc) {
-      ExprResult Fn = SemaRef.BuildDeclRefExpr(FD, FD->getType(), VK_LValue, Loc);
-      return SemaRef.BuildResolvedCallExpr(Fn.get(), FD, Loc, args, Loc);
+    virtual void If(SourceLocation Loc, SourceRange ConditionRange, ConditionValueKind ConditionValue) {
+      add(Loc, UseCondition, ConditionValue, 0);
     }
-    ExprResult BuildUPCRCall(FunctionDecl *FD, std::vector<Expr*>& args) {
-      return BuildUPCRCall(FD, args, SourceLocation());
+    virtual void Elif(SourceLocation Loc, SourceRange ConditionRange, ConditionValueKind ConditionValue,
+                      SourceLocation IfLoc) {
+      add(Loc, UseCondition, ConditionValue, 0);
     }
-    ExprResult BuildUPCRDeclRef(VarDecl *VD) {
-      return SemaRef.BuildDeclRefExpr(VD, VD->getType(), VK_LValue, SourceLocation());
+    virtual void Ifdef(SourceLocation Loc, const Token &MacroNameTok, const MacroDefinition &MD) {
+      noteModelMacro(MacroNameTok);
+      add(Loc, UseCondition, bool(MD), 0);
     }
-    Expr * CreateSimpleDeclRef(VarDecl *VD) {
-      //return SemaRef.BuildDeclRefExpr(VD, VD->getType(), VK_LValue, SourceLocation()).get();
-      //return dynamic_cast<Expr *>(SemaRef.BuildDeclRefExpr(VD, VD->getType(), VK_LValue, SourceLocation()));
-      return dyn_cast<Expr>(SemaRef.BuildDeclRefExpr(VD, VD->getType(), VK_LValue, SourceLocation()));
+    virtual void Ifndef(SourceLocation Loc, const Token &MacroNameTok, const MacroDefinition &MD) {
+      noteModelMacro(MacroNameTok);
+      add(Loc, UseCondition, !MD, 0);
     }
-    int AnonRecordID;
-    int StaticLocalVarID;
-    IdentifierInfo *getRecordDeclName(IdentifierInfo * OrigName) {
-      return OrigName;
+    virtual void Defined(const Token &MacroNameTok, const MacroDefinition &MD, SourceRange Range) {
+      noteModelMacro(MacroNameTok);
     }
-    struct ArrayDimensionT {
-      ArrayDimensionT(ASTContext& Context) :
-	ArrayDimension(Context.getTypeSize(Context.getSizeType()), 1),
-	HasThread(false),
-	ElementSize(0),
-	E(NULL)
-      {}
-      llvm::APInt ArrayDimension;
-      bool HasThread;
-      int64_t ElementSize; // Matches representation of CharUnits
-      Expr *E;
-    };
-    ArrayDimensionT GetArrayDimension(QualType Ty) {
-      ArrayDimensionT Result(SemaRef.Context);
-      QualType ElemTy = Ty.getCanonicalType();
-      while(const ArrayType *AT = dyn_cast<ArrayType>(ElemTy.getTypePtr())) {
-	if(const ConstantArrayType *CAT = dyn_cast<ConstantArrayType>(AT)) {
-	  Result.ArrayDimension *= CAT->getSize();
-	} else if(const UPCThreadArrayType *TAT = dyn_cast<UPCThreadArrayType>(AT)) {
-	  if(TAT->getThread()) {
-	    Result.HasThread = true;
+    // The contents of a file included in the middle of a
+    // declaration are not part of its text.
+    virtual void InclusionDirective(SourceLocation HashLoc, const Token &IncludeTok, StringRef FileName,
+                                    bool IsAngled, CharSourceRange FilenameRange, const FileEntry *File,
+                                    StringRef SearchPath, StringRef RelativePath, const Module *Imported,
+                                    SrcMgr::CharacteristicKind FileType) {
+      add(HashLoc, UseUncacheable, 0, 0);
+    }
+    // A definition copied by -verbatim-c must not leave a macro
+    // behind that the declarations printed after it would see.
+    virtual void MacroDefined(const Token &MacroNameTok, const MacroDirective *MD) {
+      add(MacroNameTok.getLocation(), UseDefine, 0, 0);
+    }
+    virtual void MacroUndefined(const Token &MacroNameTok, const MacroDefinition &MD,
+                                const MacroDirective *Undef) {
+      add(MacroNameTok.getLocation(), UseDefine, 0, 0);
+    }
+    // Adds the uses between offsets Begin and End of File to Parts.
+    // Returns false if one of them makes the range uncacheable.
+    bool addUses(FileID File, unsigned Begin, unsigned End, std::vector<std::string> &Parts) {
+      llvm::DenseMap<FileID, std::vector<Use> >::const_iterator pos = Uses.find(File);
+      if(pos == Uses.end())
+        return true;
+      const std::vector<Use> &FileUses = pos->second;
+      Use Key = { Begin, UseMacro, 0, 0 };
+      for(std::vector<Use>::const_iterator iter = std::lower_bound(FileUses.begin(), FileUses.end(), Key),
+            end = FileUses.end(); iter != end && iter->Offset < End; ++iter) {
+        if(iter->Kind == UseUncacheable)
+          return false;
+        std::string Part = (llvm::Twine(iter->Offset - Begin) + " " + llvm::Twine(int(iter->Kind)) + " " +
+                            llvm::Twine(iter->Value)).str();
+        if(iter->Macro)
+          Part += getMacroHash(iter->Macro);
+        Parts.push_back(Part);
+      }
+      return true;
+    }
+    // Adds the macros expanded between offsets Begin and End of
+    // File to Macros.  Returns false if anything else is there.
+    bool getMacros(FileID File, unsigned Begin, unsigned End,
+                   llvm::SmallVectorImpl<const MacroInfo *> &Macros) {
+      llvm::DenseMap<FileID, std::vector<Use> >::const_iterator pos = Uses.find(File);
+      if(pos == Uses.end())
+        return true;
+      const std::vector<Use> &FileUses = pos->second;
+      Use Key = { Begin, UseMacro, 0, 0 };
+      for(std::vector<Use>::const_iterator iter = std::lower_bound(FileUses.begin(), FileUses.end(), Key),
+            end = FileUses.end(); iter != end && iter->Offset < End; ++iter) {
+        if(iter->Kind != UseMacro)
+          return false;
+        Macros.push_back(iter->Macro);
+      }
+      return true;
+    }
+    // The first use outside the system headers of a macro that
+    // the threading model predefines, if any.  -variants= cannot
+    // lower such code for another model.
+    SourceLocation getModelMacroUse() const { return ModelMacroUse; }
+    StringRef getModelMacro() const { return ModelMacro; }
+  private:
+    static bool isModelMacro(StringRef Name) {
+      return Name.startswith("__UPC_PTHREADS") || Name.startswith("__BERKELEY_UPC_PTHREADS") ||
+        Name == "__UPC_TLD__" || Name == "UPCRI_USING_TLD";
+    }
+    void noteModelMacro(const Token &MacroNameTok) {
+      if(ModelMacroUse.isValid() || !isModelMacro(MacroNameTok.getIdentifierInfo()->getName()) ||
+         PP.getSourceManager().isInSystemHeader(MacroNameTok.getLocation()))
+        return;
+      ModelMacroUse = MacroNameTok.getLocation();
+      ModelMacro = MacroNameTok.getIdentifierInfo()->getName().str();
+    }
+    struct Use {
+      unsigned Offset;
+      UseKind Kind;
+      unsigned Value;
+      const MacroInfo *Macro;
+      bool operator<(const Use &Other) const { return Offset < Other.Offset; }
+    };
+    // Each file is lexed from start to end, so the uses in it are
+    // recorded in order.
+    void add(SourceLocation Loc, UseKind Kind, unsigned Value, const MacroInfo *Macro) {
+      std::pair<FileID, unsigned> Decomposed =
+        PP.getSourceManager().getDecomposedLoc(PP.getSourceManager().getExpansionLoc(Loc));
+      Use U = { Decomposed.second, Kind, Value, Macro };
+      Uses[Decomposed.first].push_back(U);
+    }
+    const std::string &getMacroHash(const MacroInfo *MI) {
+      std::string &Result = MacroHashes[MI];
+      if(Result.empty()) {
+        std::vector<std::string> Parts;
+        Parts.push_back(MI->isFunctionLike()? "(" : "");
+        for(MacroInfo::param_iterator iter = MI->param_begin(), end = MI->param_end(); iter != end; ++iter)
+          Parts.push_back((*iter)->getName().str());
+        Parts.push_back(MI->isVariadic()? "..." : "");
+        for(MacroInfo::const_tokens_iterator iter = MI->tokens_begin(), end = MI->tokens_end(); iter != end; ++iter)
+          Parts.push_back((iter->hasLeadingSpace()? " " : "") + PP.getSpelling(*iter));
+        Result = HashStrings(Parts);
+      }
+      return Result;
+    }
+    Preprocessor &PP;
+    llvm::DenseMap<FileID, std::vector<Use> > Uses;
+    llvm::DenseMap<const MacroInfo *, std::string> MacroHashes;
+    SourceLocation ModelMacroUse;
+    std::string ModelMacro;
+  };
+
+  // Finds what lowering would change in a function definition:
+  // UPC statements, expressions and types, and the declarations
+  // and builtins that lowering renames or moves.
+  class FindLoweredConstructs : public RecursiveASTVisitor<FindLoweredConstructs> {
+  public:
+    FindLoweredConstructs(ASTContext &C) : Context(C), Found(false) {}
+    bool find(FunctionDecl *FD) {
+      Found = FD->isMain() || (FD->isInlineSpecified() && FD->getStorageClass() != SC_Static);
+      if(!Found)
+        TraverseDecl(FD);
+      return Found;
+    }
+    bool VisitStmt(Stmt *S) {
+      if(isa<UPCBarrierStmt>(S) || isa<UPCFenceStmt>(S) || isa<UPCForAllStmt>(S) ||
+         isa<UPCNotifyStmt>(S) || isa<UPCWaitStmt>(S) || isa<UPCPragmaStmt>(S) ||
+         isa<UPCMyThreadExpr>(S) || isa<UPCThreadExpr>(S) ||
+         isa<VAArgExpr>(S) || isa<OffsetOfExpr>(S))
+        Found = true;
+      return !Found;
+    }
+    bool VisitExpr(Expr *E) {
+      check(E->getType());
+      return !Found;
+    }
+    bool VisitUnaryExprOrTypeTraitExpr(UnaryExprOrTypeTraitExpr *E) {
+      switch(E->getKind()) {
+      case UETT_UPC_LocalSizeOf:
+      case UETT_UPC_BlockSizeOf:
+      case UETT_UPC_ElemSizeOf:
+        Found = true;
+        break;
+      default:
+        if(E->isArgumentType())
+          check(E->getArgumentType());
+      }
+      return !Found;
+    }
+    bool VisitExplicitCastExpr(ExplicitCastExpr *E) {
+      check(E->getTypeAsWritten());
+      return !Found;
+    }
+    bool VisitDeclRefExpr(DeclRefExpr *E) {
+      if(FunctionDecl *FD = dyn_cast<FunctionDecl>(E->getDecl())) {
+        StringRef Name = FD->getName();
+        if(FD->isMain() || Name == "__builtin_va_start" || Name == "__builtin_va_end" ||
+           Name == "__builtin_va_copy")
+          Found = true;
+      } else if(VarDecl *VD = dyn_cast<VarDecl>(E->getDecl())) {
+        // TLD globals are accessed through UPCR_TLD_ADDR
+        if(VD->hasGlobalStorage() && Context.getLangOpts().UPCTLDEnable) {
+          SourceLocation Loc = Context.getSourceManager().getExpansionLoc(VD->getLocation());
+          if(Loc.isInvalid() || !Context.getSourceManager().isInSystemHeader(Loc))
+            Found = true;
+        }
+      }
+      return !Found;
+    }
+    bool VisitDecl(Decl *D) {
+      // Local records are moved to file scope and renamed
+      if(isa<TagDecl>(D)) {
+        Found = true;
+      } else if(VarDecl *VD = dyn_cast<VarDecl>(D)) {
+        // Static and extern locals are moved to file scope, and
+        // anonymous struct types are given names
+        QualType Element = Context.getBaseElementType(VD->getType());
+        if(const ElaboratedType *ET = dyn_cast<ElaboratedType>(Element))
+          Element = ET->getNamedType();
+        if(VD->hasGlobalStorage() ||
+           (isa<TagType>(Element) && !cast<TagType>(Element)->getDecl()->getIdentifier()))
+          Found = true;
+        else
+          check(VD->getType());
+      } else if(ValueDecl *VD = dyn_cast<ValueDecl>(D)) {
+        check(VD->getType());
+      } else if(TypedefNameDecl *TD = dyn_cast<TypedefNameDecl>(D)) {
+        check(TD->getUnderlyingType());
+      }
+      return !Found;
+    }
+  private:
+    void check(QualType T) {
+      if(!T.isNull() && hasUPCType(T.getCanonicalType()))
+        Found = true;
+    }
+    static bool hasUPCType(QualType T) {
+      if(T.getQualifiers().hasShared() || isa<UPCThreadArrayType>(T))
+        return true;
+      if(const PointerType *PT = dyn_cast<PointerType>(T))
+        return hasUPCType(PT->getPointeeType());
+      if(const ArrayType *AT = dyn_cast<ArrayType>(T))
+        return hasUPCType(AT->getElementType());
+      if(const FunctionProtoType *FPT = dyn_cast<FunctionProtoType>(T)) {
+        for(FunctionProtoType::param_type_iterator iter = FPT->param_type_begin(),
+              end = FPT->param_type_end(); iter != end; ++iter)
+          if(hasUPCType(*iter))
+            return true;
+      }
+      if(const FunctionType *FT = dyn_cast<FunctionType>(T))
+        return hasUPCType(FT->getReturnType());
+      return false;
+    }
+    ASTContext &Context;
+    bool Found;
+  };
+
+  // Peak resident set size of the whole process, in kilobytes.
+  long GetPeakRSS() {
+#ifdef LLVM_ON_UNIX
+    struct rusage Usage;
+    if(getrusage(RUSAGE_SELF, &Usage) == 0) {
+#ifdef __APPLE__
+      return Usage.ru_maxrss / 1024;
+#else
+      return Usage.ru_maxrss;
+#endif
+    }
+#endif
+    return 0;
+  }
+
+  // Records the nested phases of one translation.  Times are
+  // relative to an origin shared by all the translations of
+  // a command line, so that their traces line up.
+  class PhaseProfiler {
+  public:
+    struct Span {
+      std::string Name;
+      std::string Detail;
+      unsigned Depth;
+      double Start;    // microseconds
+      double Duration; // microseconds
+      long PeakRSS;    // kilobytes, when the span ended
+    };
+    PhaseProfiler(std::chrono::steady_clock::time_point Origin) : origin(Origin) {}
+    void begin(StringRef Name, StringRef Detail) {
+      Span S;
+      S.Name = Name.str();
+      S.Detail = Detail.str();
+      S.Depth = Open.size();
+      S.Start = now();
+      S.Duration = 0;
+      S.PeakRSS = 0;
+      Open.push_back(Spans.size());
+      Spans.push_back(S);
+    }
+    void end() {
+      Span &S = Spans[Open.back()];
+      Open.pop_back();
+      S.Duration = now() - S.Start;
+      S.PeakRSS = GetPeakRSS();
+    }
+    const std::vector<Span> &getSpans() const { return Spans; }
+  private:
+    double now() const {
+      return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();
+    }
+    std::chrono::steady_clock::time_point origin;
+    std::vector<Span> Spans;
+    std::vector<std::size_t> Open;
+  };
+
+  // Times the enclosing scope if a profiler is given.
+  class PhaseScope {
+  public:
+    PhaseScope(PhaseProfiler *P, StringRef Name, StringRef Detail = StringRef()) : Profiler(P) {
+      if(Profiler)
+        Profiler->begin(Name, Detail);
+    }
+    ~PhaseScope() {
+      if(Profiler)
+        Profiler->end();
+    }
+  private:
+    PhaseProfiler *Profiler;
+  };
+
+  class RemoveUPCTransform : public clang::TreeTransform<RemoveUPCTransform> {
+    typedef TreeTransform<RemoveUPCTransform> TreeTransformUPC;
+  private:
+    bool haveOffsetOf;
+    bool haveVAArg;
+    DeclEmitter *Emitter;
+    UnitCache *Units;
+    MacroUseRecorder *VerbatimMacros;
+    bool VerbatimLines;
+    bool Compact;
+    llvm::DenseMap<Decl*, std::string> VerbatimText;
+    PhaseProfiler *Profiler;
+    std::unique_ptr<CountRuntimeCalls> CallCounter;
+    const ProgramSummary *Program;
+    // The function whose body is being transformed, and the
+    // number of upc_forall loops with an affinity around the
+    // current statement
+    FunctionDecl *CurrentFunction;
+    unsigned ForallDepth;
+  public:
+    TransformStats Stats;
+    RemoveUPCTransform(Sema& S, UPCRDecls* D, const std::string& fileid)
+      : TreeTransformUPC(S), Emitter(0), Units(0), VerbatimMacros(0), VerbatimLines(false), Compact(false), Profiler(0),
+        Program(0), CurrentFunction(0), ForallDepth(0), AnonRecordID(0), StableNames(false), InSystemDecl(false),
+        SkipFunctionBodies(false), StaticLocalVarID(0),
+        Decls(D), FileString(fileid) {
+      haveOffsetOf = haveVAArg = false;
+      PreprocessedInput = false;
+    }
+    // Without an emitter, declarations are added to the new
+    // translation unit, to be printed when it is complete.
+    void setEmitter(DeclEmitter *E) { Emitter = E; }
+    void setUnitCache(UnitCache *U) { Units = U; }
+    // Copies the text of function definitions that lowering would
+    // not change, given where the macros in them come from.
+    void setVerbatim(MacroUseRecorder *M, bool Lines) {
+      VerbatimMacros = M;
+      VerbatimLines = Lines;
+    }
+    // The text printed for a copied definition, or empty
+    StringRef getVerbatimText(Decl *D) const {
+      llvm::DenseMap<Decl*, std::string>::const_iterator pos = VerbatimText.find(D);
+      return pos == VerbatimText.end()? StringRef() : StringRef(pos->second);
+    }
+    void setProfiler(PhaseProfiler *P) { Profiler = P; }
+    void enableStableNames() { StableNames = true; }
+    // Leave out the parentheses, casts and blocks that lowering
+    // adds where C does not need them
+    void enableCompact() { Compact = true; }
+    // Counts the runtime calls in each top-level declaration
+    void enableCallCounts() { CallCounter.reset(new CountRuntimeCalls(*Decls, Stats)); }
+    // Leave out the upcrt_forall_control tests whose result the
+    // program's call graph decides
+    void setProgram(const ProgramSummary *P) { Program = P; }
+    // The input has already been preprocessed, so it is a single
+    // file whose linemarkers tell which header each line is from
+    void enablePreprocessedInput() { PreprocessedInput = true; }
+    bool HaveOffsetOf() { return haveOffsetOf; }
+    ExprResult TransformOffsetOfExpr(OffsetOfExpr *E) {
+      haveOffsetOf = true;
+      return TreeTransformUPC::TransformOffsetOfExpr(E);
+    }
+    bool HaveVAArg() { return haveVAArg; }
+    ExprResult TransformVAArgExpr(VAArgExpr *E) {
+      haveVAArg = true;
+      return TreeTransformUPC::TransformVAArgExpr(E);
+    }
+    bool AlwaysRebuild() { return true; }
+    // True if E prints as a primary or postfix expression, which
+    // never needs parentheses.
+    static bool isPostfixExpr(Expr *E) {
+      E = E->IgnoreImpCasts();
+      if(IntegerLiteral *Lit = dyn_cast<IntegerLiteral>(E))
+        return !Lit->getValue().isNegative();
+      return isa<ParenExpr>(E) || isa<DeclRefExpr>(E) || isa<FloatingLiteral>(E) ||
+        isa<CharacterLiteral>(E) || isa<StringLiteral>(E) || isa<CallExpr>(E) ||
+        isa<ArraySubscriptExpr>(E) || isa<MemberExpr>(E) || isa<CompoundLiteralExpr>(E);
+    }
+    ExprResult BuildParens(Expr * E) {
+      if(Compact && isPostfixExpr(E))
+        return E;
+      return SemaRef.ActOnParenExpr(SourceLocation(), SourceLocation(), E);
+    }
+    // In compact mode, a cast is left out only where it cannot
+    // change anything: E is already a cast to the type, or a literal
+    // or variable of the program that has it.  The results of the
+    // runtime are always cast, because upcr.h may define its entry
+    // points as macros whose types differ from the declarations here.
+    ExprResult BuildCast(TypeSourceInfo *Ty, Expr *E) {
+      if(Compact && SemaRef.Context.hasSameUnqualifiedType(Ty->getType(), E->IgnoreImpCasts()->getType()) &&
+         isKnownToHaveType(E->IgnoreImpCasts()) && (isPostfixExpr(E) || isa<CStyleCastExpr>(E->IgnoreImpCasts())))
+        return E;
+      return SemaRef.BuildCStyleCastExpr(SourceLocation(), Ty, SourceLocation(), E);
+    }
+    // Whether E prints as C whose type is the one in the AST
+    static bool isKnownToHaveType(Expr *E) {
+      if(isa<CStyleCastExpr>(E) || isa<IntegerLiteral>(E) || isa<FloatingLiteral>(E))
+        return true;
+      if(DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E)) {
+        // The runtime's variables are declared without a location
+        VarDecl *VD = dyn_cast<VarDecl>(DRE->getDecl());
+        return VD && !(VD->getStorageClass() == SC_Extern && VD->getLocation().isInvalid());
+      }
+      return false;
+    }
+    ExprResult BuildComma(Expr * LHS, Expr * RHS) {
+      return SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Comma, LHS, RHS);
+    }
+    // TreeTransform ignores AlwayRebuild for literals
+    ExprResult TransformIntegerLiteral(IntegerLiteral *E) {
+      return IntegerLiteral::Create(SemaRef.Context, E->getValue(), E->getType(), E->getLocation());
+    }
+    ExprResult BuildUPCRCall(FunctionDecl *FD, ArrayRef<Expr*> args, SourceLocation Loc) {
+      ExprResult Fn = SemaRef.BuildDeclRefExpr(FD, FD->getType(), VK_LValue, Loc);
+      return SemaRef.BuildResolvedCallExpr(Fn.get(), FD, Loc, args, Loc);
+    }
+    ExprResult BuildUPCRCall(FunctionDecl *FD, ArrayRef<Expr*> args) {
+      return BuildUPCRCall(FD, args, SourceLocation());
+    }
+    ExprResult BuildUPCRDeclRef(VarDecl *VD) {
+      return SemaRef.BuildDeclRefExpr(VD, VD->getType(), VK_LValue, SourceLocation());
+    }
+    Expr * CreateSimpleDeclRef(VarDecl *VD) {
+      //return SemaRef.BuildDeclRefExpr(VD, VD->getType(), VK_LValue, SourceLocation()).get();
+      //return dynamic_cast<Expr *>(SemaRef.BuildDeclRefExpr(VD, VD->getType(), VK_LValue, SourceLocation()));
+      return dyn_cast<Expr>(SemaRef.BuildDeclRefExpr(VD, VD->getType(), VK_LValue, SourceLocation()));
+    }
+    int AnonRecordID;
+    // Inserted in invented names before their number; see BeginNaming
+    std::string NamePrefix;
+    bool StableNames;
+    llvm::StringMap<std::pair<int, int> > NameCounters;
+    // Set while a system header declaration is transformed on demand
+    bool InSystemDecl;
+    // Set while a function definition copied from the unit
+    // cache is transformed as a declaration
+    bool SkipFunctionBodies;
+    int StaticLocalVarID;
+    IdentifierInfo *getRecordDeclName(IdentifierInfo * OrigName) {
+      return OrigName;
+    }
+    struct ArrayDimensionT {
+      ArrayDimensionT(ASTContext& Context) :
+	ArrayDimension(Context.getTypeSize(Context.getSizeType()), 1),
+	HasThread(false),
+	ElementSize(0),
+	E(NULL)
+      {}
+      llvm::APInt ArrayDimension;
+      bool HasThread;
+      int64_t ElementSize; // Matches representation of CharUnits
+      Expr *E;
+    };
+    ArrayDimensionT GetArrayDimension(QualType Ty) {
+      ArrayDimensionT Result(SemaRef.Context);
+      QualType ElemTy = Ty.getCanonicalType();
+      while(const ArrayType *AT = dyn_cast<ArrayType>(ElemTy.getTypePtr())) {
+	if(const ConstantArrayType *CAT = dyn_cast<ConstantArrayType>(AT)) {
+	  Result.ArrayDimension *= CAT->getSize();
+	} else if(const UPCThreadArrayType *TAT = dyn_cast<UPCThreadArrayType>(AT)) {
+	  if(TAT->getThread()) {
+	    Result.HasThread = true;
 	  }
 	  Result.ArrayDimension *= TAT->getSize();
 	} else if(const VariableArrayType *VAT = dyn_cast<VariableArrayType>(AT)) {
@@ -646,7 +1383,7 @@ namespace {
       } else {
 	Expr *Dimension = IntegerLiteral::Create(SemaRef.Context, Dims.ArrayDimension, SemaRef.Context.getSizeType(), SourceLocation());
 	if(Dims.HasThread) {
-	  std::vector<Expr*> args;
+	  llvm::SmallVector<Expr*, 4> args;
 	  Expr *Threads = BuildUPCRCall(Decls->upcr_threads, args).get();
 	  Dimension = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Mul, Dimension, Threads).get();
 	}
@@ -659,7 +1396,7 @@ namespace {
 	return BuildParens(SemaRef.CreateBuiltinBinOp(SourceLocation(), Op, MaybeAddParensForMultiply(E), Dimension).get());
       }
     }
-    std::vector<Expr*> BuildUPCBarrierArgs(Expr *ID) {
+    llvm::SmallVector<Expr*, 4> BuildUPCBarrierArgs(Expr *ID) {
       ASTContext& Context = SemaRef.Context;
       bool isAnon = !ID;
       if(isAnon) {
@@ -677,45 +1414,45 @@ namespace {
 	    ID = SemaRef.BuildCStyleCastExpr(SourceLocation(), Type, SourceLocation(), ID).get();
 	  }
 	  Type = Context.getTrivialTypeSourceInfo(Context.IntTy);
-	  ID = SemaRef.BuildCStyleCastExpr(SourceLocation(), Type, SourceLocation(), ID).get();
+	  ID = BuildCast(Type, ID).get();
 	}
       } else {
 	ID = TransformExpr(ID).get();
       }
-      std::vector<Expr*> args;
+      llvm::SmallVector<Expr*, 4> args;
       args.push_back(ID);
       args.push_back(IntegerLiteral::Create(Context, APInt(32, isAnon), Context.IntTy, SourceLocation()));
       return args;
     }
     StmtResult TransformUPCNotifyStmt(UPCNotifyStmt *S) {
-      std::vector<Expr*> args = BuildUPCBarrierArgs(S->getIdValue());
+      llvm::SmallVector<Expr*, 4> args = BuildUPCBarrierArgs(S->getIdValue());
       Stmt *result = BuildUPCRCall(Decls->upcr_notify, args, S->getBeginLoc()).get();
       return result;
     }
     StmtResult TransformUPCWaitStmt(UPCWaitStmt *S) {
-      std::vector<Expr*> args = BuildUPCBarrierArgs(S->getIdValue());
+      llvm::SmallVector<Expr*, 4> args = BuildUPCBarrierArgs(S->getIdValue());
       Stmt *result = BuildUPCRCall(Decls->upcr_wait, args, S->getBeginLoc()).get();
       return result;
     }
     StmtResult TransformUPCBarrierStmt(UPCBarrierStmt *S) {
-      std::vector<Expr*> args = BuildUPCBarrierArgs(S->getIdValue());
+      llvm::SmallVector<Expr*, 4> args = BuildUPCBarrierArgs(S->getIdValue());
       Stmt *result = BuildUPCRCall(Decls->upcr_barrier, args, S->getBeginLoc()).get();
       return result;
     }
     StmtResult TransformUPCFenceStmt(UPCFenceStmt *S) {
-      std::vector<Expr*> args;
+      llvm::SmallVector<Expr*, 4> args;
       Stmt *result = BuildUPCRCall(Decls->upcr_poll, args, S->getBeginLoc()).get();
       return result;
     }
     ExprResult TransformUPCThreadExpr(UPCThreadExpr *E) {
-      std::vector<Expr*> args;
+      llvm::SmallVector<Expr*, 4> args;
       Expr *Call = BuildUPCRCall(Decls->upcr_threads, args).get();
-      return SemaRef.BuildCStyleCastExpr(SourceLocation(), SemaRef.Context.getTrivialTypeSourceInfo(SemaRef.Context.IntTy), SourceLocation(), Call);
+      return BuildCast(SemaRef.Context.getTrivialTypeSourceInfo(SemaRef.Context.IntTy), Call);
     }
     ExprResult TransformUPCMyThreadExpr(UPCMyThreadExpr *E) {
-      std::vector<Expr*> args;
+      llvm::SmallVector<Expr*, 4> args;
       Expr *Call = BuildUPCRCall(Decls->upcr_mythread, args).get();
-      return SemaRef.BuildCStyleCastExpr(SourceLocation(), SemaRef.Context.getTrivialTypeSourceInfo(SemaRef.Context.IntTy), SourceLocation(), Call);
+      return BuildCast(SemaRef.Context.getTrivialTypeSourceInfo(SemaRef.Context.IntTy), Call);
     }
     ExprResult TransformInitializer(Expr *Init, bool CXXDirectInit) {
       if(!Init)
@@ -805,9 +1542,11 @@ namespace {
           // It is acceptible here ONLY because Put and Get don't use the phase.
           E = CE->getArg(0);
           Phaseless = !Phaseless;
+          ++Stats.FoldedIntoAccess;
         } else if (FD == Decls->UPCR_ADD_PSHAREDI) {
           // Fold (non-zero) indefinite address arithmetic into the Offset
           E = CE->getArg(0);
+          ++Stats.FoldedIntoAccess;
           Expr *Elemsz = CE->getArg(1);
           Expr *Inc = CE->getArg(2);
           Expr *NewOffset;
@@ -830,6 +1569,20 @@ namespace {
       if (Offset) return Offset;
       return CreateInteger(SemaRef.Context.getSizeType(), 0);
     }
+    // The C type of a value of the shared type Ty.  Every access
+    // needs it, so it is kept for each type, except for variably
+    // modified types, whose size expressions are transformed again
+    // for each use.
+    QualType TransformAccessType(QualType Ty) {
+      if(Ty->isVariablyModifiedType())
+        return TransformType(Ty).getUnqualifiedType();
+      llvm::DenseMap<QualType, QualType>::const_iterator pos = AccessTypes.find(Ty);
+      if(pos != AccessTypes.end())
+        return pos->second;
+      QualType Result = TransformType(Ty).getUnqualifiedType();
+      AccessTypes[Ty] = Result;
+      return Result;
+    }
     // If LoadVar is passed, then the result will contain an assignment to it.
     // Otherwise the result will use a temporary only if necessary.
     // Regardless, the value of the expression will be the result of the Load.
@@ -839,9 +1592,9 @@ namespace {
       bool Strict = Quals.hasStrict();
       // Try to fold offset and phased/phaseless conversions:
       Expr *Offset = FoldUPCRLoadStore(Ptr, Phaseless);
-      std::vector<Expr*> args;
+      llvm::SmallVector<Expr*, 4> args;
       Expr *Result;
-      QualType ResultType = TransformType(Ty).getUnqualifiedType();
+      QualType ResultType = TransformAccessType(Ty);
       if(typeFitsUPCRValuePutGet(ResultType)) {
 	// Case 1.  Get by value, with type cast if necesssary
 	args.push_back(Ptr);
@@ -852,8 +1605,14 @@ namespace {
 	} else if(ResultType->isSpecificBuiltinType(BuiltinType::Double)) {
 	  Accessor = &Decls->UPCR_GET_DVAL;
 	} else {
-	  Accessor = &Decls->UPCR_GET_IVAL;
-	  args.push_back(CreateInteger(SemaRef.Context.getSizeType(),SemaRef.Context.getTypeSizeInChars(Ty).getQuantity()));
+	  int64_t Size = SemaRef.Context.getTypeSizeInChars(Ty).getQuantity();
+	  // Use the runtime's get for values of this size, if it has one
+	  if(Size <= MaxSizedValue && Decls->UPCR_GET_IVAL_SIZED[Size](Phaseless,Strict)) {
+	    Accessor = &Decls->UPCR_GET_IVAL_SIZED[Size];
+	  } else {
+	    Accessor = &Decls->UPCR_GET_IVAL;
+	    args.push_back(CreateInteger(SemaRef.Context.getSizeType(),Size));
+	  }
 	}
 	Result = BuildUPCRCall((*Accessor)(Phaseless,Strict), args).get();
 	// NOTE: Without a cast the float and double cases yield an assertion failure!?
@@ -889,7 +1648,7 @@ namespace {
 	// shared_to_pshared(resetphase(p)) -> shared_to_pshared(p)
 	Ptr = CE->getArg(0);
       }
-      std::vector<Expr*> args;
+      llvm::SmallVector<Expr*, 4> args;
       args.push_back(Ptr);
       return BuildUPCRCall(Decls->UPCR_SHARED_TO_PSHARED, args);
     }
@@ -900,7 +1659,7 @@ namespace {
 	// pshared_to_shared(shared_to_pshared(p)) -> resetphase(p)
 	return BuildUPCRSharedResetPhase(CE->getArg(0));
       }
-      std::vector<Expr*> args;
+      llvm::SmallVector<Expr*, 4> args;
       args.push_back(Ptr);
       return BuildUPCRCall(Decls->UPCR_PSHARED_TO_SHARED, args);
     }
@@ -911,7 +1670,7 @@ namespace {
 	// resetphase(resetphase(p)) -> resetphase(p)
 	return ExprResult(Ptr);
       }
-      std::vector<Expr*> args;
+      llvm::SmallVector<Expr*, 4> args;
       args.push_back(Ptr);
       return BuildUPCRCall(Decls->UPCR_SHARED_RESETPHASE, args);
     }
@@ -919,11 +1678,11 @@ namespace {
       if(E->getCastKind() == CK_UPCSharedToLocal) {
 	bool Phaseless = isPhaseless(E->getSubExpr()->getType()->getAs<PointerType>()->getPointeeType());
 	FunctionDecl *Accessor = Phaseless? Decls->UPCR_PSHARED_TO_LOCAL : Decls->UPCR_SHARED_TO_LOCAL;
-	std::vector<Expr*> args;
+	llvm::SmallVector<Expr*, 4> args;
 	args.push_back(TransformExpr(E->getSubExpr()).get());
 	ExprResult Result = BuildUPCRCall(Accessor, args);
 	TypeSourceInfo *Ty = SemaRef.Context.getTrivialTypeSourceInfo(TransformType(E->getType()));
-	return SemaRef.BuildCStyleCastExpr(SourceLocation(), Ty, SourceLocation(), Result.get());
+	return BuildCast(Ty, Result.get());
       } else if(E->getCastKind() == CK_NullToPointer && isPointerToShared(E->getType())) {
 	bool Phaseless = isPhaseless(E->getType()->getAs<PointerType>()->getPointeeType());
 	return BuildUPCRDeclRef(Phaseless? Decls->upcr_null_pshared : Decls->upcr_null_shared);
@@ -947,11 +1706,11 @@ namespace {
 		isPointerToShared(E->getSubExpr()->getType())) {
 	bool Phaseless = isPhaseless(E->getSubExpr()->getType()->getAs<PointerType>()->getPointeeType());
 	FunctionDecl *Accessor = Phaseless? Decls->UPCR_ADDRFIELD_PSHARED : Decls->UPCR_ADDRFIELD_SHARED;
-	std::vector<Expr*> args;
+	llvm::SmallVector<Expr*, 4> args;
 	args.push_back(TransformExpr(E->getSubExpr()).get());
 	Expr *Result = BuildUPCRCall(Accessor, args).get();
 	TypeSourceInfo *Type = SemaRef.Context.getTrivialTypeSourceInfo(TransformType(E->getType()));
-	return SemaRef.BuildCStyleCastExpr(SourceLocation(), Type, SourceLocation(), Result);
+	return BuildCast(Type, Result);
       }
       return ExprError();
     }
@@ -967,7 +1726,7 @@ namespace {
       Expr *SrcArg = NULL;
       Expr *RetVal = NULL;
       bool NeedSize = true;
-      QualType ResultType = TransformType(Ty).getUnqualifiedType();
+      QualType ResultType = TransformAccessType(Ty);
       QualType RHSType = RHS->getType().getUnqualifiedType();
       if(typeFitsUPCRValuePutGet(ResultType)) {
 	if (RHS->isLValue() && !ReturnValue) {
@@ -975,7 +1734,7 @@ namespace {
 	  SrcArg = RHS;
 	  if(!SemaRef.Context.typesAreCompatible(ResultType, RHSType)) {
 	    TypeSourceInfo *TSI = SemaRef.Context.getTrivialTypeSourceInfo(ResultType);
-	    SrcArg = SemaRef.BuildCStyleCastExpr(SourceLocation(), TSI, SourceLocation(), SrcArg).get();
+	    SrcArg = BuildCast(TSI, SrcArg).get();
 	  }
 	} else {
 	  // Case 2. Store value of RHS in a temporary. which is Put by value
@@ -993,8 +1752,15 @@ namespace {
 	  NeedSize = false;
 	} else {
 	  TypeSourceInfo *TSI = SemaRef.Context.getTrivialTypeSourceInfo(Decls->upcr_register_value_t);
-	  SrcArg = SemaRef.BuildCStyleCastExpr(SourceLocation(), TSI, SourceLocation(), SrcArg).get();
-	  Accessor = &Decls->UPCR_PUT_IVAL;
+	  SrcArg = BuildCast(TSI, SrcArg).get();
+	  int64_t Size = SemaRef.Context.getTypeSizeInChars(Ty).getQuantity();
+	  // Use the runtime's put for values of this size, if it has one
+	  if(Size <= MaxSizedValue && Decls->UPCR_PUT_IVAL_SIZED[Size](Phaseless,Strict)) {
+	    Accessor = &Decls->UPCR_PUT_IVAL_SIZED[Size];
+	    NeedSize = false;
+	  } else {
+	    Accessor = &Decls->UPCR_PUT_IVAL;
+	  }
 	}
       } else if (RHS->isLValue() && !ReturnValue &&
 		 SemaRef.Context.typesAreCompatible(ResultType, RHSType)) {
@@ -1008,7 +1774,7 @@ namespace {
 	SrcArg = SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_AddrOf, CreateSimpleDeclRef(TmpVar)).get();
 	if(ReturnValue) RetVal = CreateSimpleDeclRef(TmpVar);
       }
-      std::vector<Expr*> args;
+      llvm::SmallVector<Expr*, 4> args;
       args.push_back(LHS);
       args.push_back(Offset);
       args.push_back(SrcArg);
@@ -1029,6 +1795,7 @@ namespace {
 	if(CE->getDirectCallee() == Decls->UPCR_ADD_PSHAREDI) {
 	  // Can fold nested UPCR_ADD_PSHAREDI regardless of whether ElemSz matches
 	  Ptr = CE->getArg(0);
+	  ++Stats.FoldedAdds;
 	  if(isLiteralInt(CE->getArg(1),ElemSz)) {
 	    // Can fold simply if ElemSz matches:
 	    Inc = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Add, Inc, CE->getArg(2)).get();
@@ -1044,7 +1811,7 @@ namespace {
 	  }
 	}
       }
-      std::vector<Expr*> args;
+      llvm::SmallVector<Expr*, 4> args;
       args.push_back(Ptr);
       args.push_back(CreateInteger(SemaRef.Context.getSizeType(), ElemSz));
       args.push_back(Inc);
@@ -1057,10 +1824,11 @@ namespace {
 	if((CE->getDirectCallee() == Decls->UPCR_ADD_PSHARED1) &&
 	   isLiteralInt(CE->getArg(1),ElemSz)) {
 	  Ptr = CE->getArg(0);
+	  ++Stats.FoldedAdds;
 	  Inc = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Add, Inc, CE->getArg(2)).get();
 	}
       }
-      std::vector<Expr*> args;
+      llvm::SmallVector<Expr*, 4> args;
       args.push_back(Ptr);
       args.push_back(CreateInteger(SemaRef.Context.getSizeType(), ElemSz));
       args.push_back(Inc);
@@ -1076,7 +1844,7 @@ namespace {
 	  Inc = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Add, Inc, CE->getArg(2)).get();
 	}
       }
-      std::vector<Expr*> args;
+      llvm::SmallVector<Expr*, 4> args;
       args.push_back(Ptr);
       args.push_back(CreateInteger(SemaRef.Context.getSizeType(), ElemSz));
       args.push_back(Inc);
@@ -1158,7 +1926,7 @@ namespace {
 	return BuildParens(BuildComma(Setup, BuildComma(Expr1, BuildComma(Expr2, TmpVal).get()).get()).get());
       } else if(isPointerToShared(ArgType) && E->getOpcode() == UO_LNot) {
 	bool Phaseless = isPhaseless(ArgType->getAs<PointerType>()->getPointeeType());
-	std::vector<Expr*> args;
+	llvm::SmallVector<Expr*, 4> args;
 	args.push_back(TransformExpr(E->getSubExpr()).get());
 	return BuildUPCRCall(Phaseless?Decls->UPCR_ISNULL_PSHARED:Decls->UPCR_ISNULL_SHARED, args);
       } else {
@@ -1192,7 +1960,7 @@ namespace {
 	  QualType PointeeType = LHS->getType()->getAs<PointerType>()->getPointeeType();
 	  ArrayDimensionT Dims = GetArrayDimension(PointeeType);
 	  int64_t ElementSize = Dims.ElementSize;
-	  std::vector<Expr*> args;
+	  llvm::SmallVector<Expr*, 4> args;
 	  args.push_back(TransformExpr(LHS).get());
 	  args.push_back(TransformExpr(RHS).get());
 	  args.push_back(CreateInteger(SemaRef.Context.getSizeType(), ElementSize));
@@ -1216,7 +1984,7 @@ namespace {
 	  return CreateUPCPointerArithmetic(TransformExpr(LHS).get(), IntVal, LHS->getType());
 	} else if(LHSIsShared && RHSIsShared && (E->getOpcode() == BO_EQ || E->getOpcode() == BO_NE)) {
 	  // Equality Comparison
-	  std::vector<Expr*> args;
+	  llvm::SmallVector<Expr*, 4> args;
 	  args.push_back(TransformExpr(LHS).get());
 	  args.push_back(TransformExpr(RHS).get());
 	  QualType LHSPointee = LHS->getType()->getAs<PointerType>()->getPointeeType();
@@ -1239,7 +2007,7 @@ namespace {
 	  // Relational Comparison
 	  QualType PointeeType = LHS->getType()->getAs<PointerType>()->getPointeeType();
 	  int64_t ElementSize = SemaRef.Context.getTypeSizeInChars(PointeeType).getQuantity();
-	  std::vector<Expr*> args;
+	  llvm::SmallVector<Expr*, 4> args;
 	  args.push_back(TransformExpr(LHS).get());
 	  args.push_back(TransformExpr(RHS).get());
 	  args.push_back(CreateInteger(SemaRef.Context.getSizeType(), ElementSize));
@@ -1358,12 +2126,13 @@ namespace {
       }
     }
     ExprResult BuildTLDRefExpr(DeclRefExpr *DRE) {
+      ++Stats.TLDReferences;
       QualType Ty = DRE->getDecl()->getType();
       TypeSourceInfo *PtrTy = SemaRef.Context.getTrivialTypeSourceInfo(SemaRef.Context.getPointerType(Ty));
-      std::vector<Expr*> args;
+      llvm::SmallVector<Expr*, 4> args;
       args.push_back(DRE);
       Expr *Call = BuildUPCRCall(Decls->UPCR_TLD_ADDR, args).get();
-      return BuildParens(SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_Deref, SemaRef.BuildCStyleCastExpr(SourceLocation(), PtrTy, SourceLocation(), Call).get()).get());
+      return BuildParens(SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_Deref, BuildCast(PtrTy, Call).get()).get());
     }
     ExprResult TransformDeclRefExpr(DeclRefExpr *E) {
       ExprResult Result = TreeTransformUPC::TransformDeclRefExpr(E);
@@ -1377,6 +2146,14 @@ namespace {
       return Result;
     }
     StmtResult TransformUPCForAllStmt(UPCForAllStmt *S) {
+      ++Stats.ForallLoops;
+      // Inside another upc_forall, upcrt_forall_control is always
+      // set.  Otherwise the program summary may know its value for
+      // every call of the function.
+      ProgramSummary::ForallContext Context = ProgramSummary::MaybeInForall;
+      if(Program)
+        Context = ForallDepth? ProgramSummary::InForall : Program->getForallContext(CurrentFunction, FileString);
+      llvm::SaveAndRestore<unsigned> Depth(ForallDepth, ForallDepth + (S->getAfnty()? 1 : 0));
       // Transform the initialization statement
       StmtResult Init = getDerived().TransformStmt(S->getInit());
 
@@ -1407,16 +2184,20 @@ namespace {
       if(!S->getAfnty()) {
 	return PlainFor;
       }
+      if(Context == ProgramSummary::InForall) {
+        ++Stats.ForallTestsRemoved;
+	return PlainFor;
+      }
 
       ExprResult Afnty = TransformExpr(S->getAfnty());
       ExprResult ThreadTest_;
       if(isPointerToShared(S->getAfnty()->getType())) {
 	bool Phaseless = isPhaseless(S->getAfnty()->getType()->getAs<PointerType>()->getPointeeType());
-	std::vector<Expr*> args;
+	llvm::SmallVector<Expr*, 4> args;
 	args.push_back(Afnty.get());
 	ThreadTest_ = BuildUPCRCall(Phaseless?Decls->upcr_hasMyAffinity_pshared:Decls->upcr_hasMyAffinity_shared, args);
       } else {
-	std::vector<Expr*> args;
+	llvm::SmallVector<Expr*, 4> args;
 	Expr * Affinity = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Rem, BuildParens(Afnty.get()).get(), BuildUPCRCall(Decls->upcr_threads, args).get()).get();
 	ThreadTest_ = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_EQ, Affinity, BuildUPCRCall(Decls->upcr_mythread, args).get());
       }
@@ -1448,6 +2229,10 @@ namespace {
 
 	UPCForWrapper = SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Statements, false);
       }
+      if(Context == ProgramSummary::NotInForall) {
+        ++Stats.ForallTestsRemoved;
+        return UPCForWrapper;
+      }
 
       StmtResult PlainForWrapper;
       {
@@ -1461,7 +2246,7 @@ namespace {
       ExprResult Result = TransformExpr(E);
       if(isPointerToShared(E->getType())) {
 	bool Phaseless = isPhaseless(E->getType()->getAs<PointerType>()->getPointeeType());
-	std::vector<Expr*> args;
+	llvm::SmallVector<Expr*, 4> args;
 	args.push_back(Result.get());
 	ExprResult Test = BuildUPCRCall(Phaseless?Decls->UPCR_ISNULL_PSHARED:Decls->UPCR_ISNULL_SHARED, args);
 	return SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_LNot, Test.get());
@@ -1543,6 +2328,21 @@ namespace {
 	if(!Result.isInvalid() && isa<NullStmt>(Result.get()))
 	  continue;
 
+	// In compact mode, a block that lowering made out of a
+	// statement is merged into this one, unless it declares
+	// something.
+	if(Compact && !isa<CompoundStmt>(*B)) {
+	  if(CompoundStmt *Block = dyn_cast<CompoundStmt>(Result.get())) {
+	    bool HasDecls = false;
+	    for(CompoundStmt::body_iterator iter = Block->body_begin(), end = Block->body_end(); iter != end; ++iter)
+	      HasDecls |= isa<DeclStmt>(*iter);
+	    if(!HasDecls) {
+	      Statements.append(Block->body_begin(), Block->body_end());
+	      continue;
+	    }
+	  }
+	}
+
 	Statements.push_back(Result.getAs<Stmt>());
       }
 
@@ -1563,7 +2363,7 @@ namespace {
       if(Result)
 	Result = TransformExpr(Result).get();
       SmallVector<Stmt*, 2> Statements;
-      std::vector<Expr*> args;
+      llvm::SmallVector<Expr*, 4> args;
       FunctionDecl * CurFunction = SemaRef.getCurFunctionDecl();
       QualType ResultType = CurFunction->getReturnType();
       if(ResultType->isVoidType() && Result) {
@@ -1590,6 +2390,7 @@ namespace {
       std::string name = (llvm::Twine("_bupc_spilld") + llvm::Twine(ID)).str();
       VarDecl *TmpVar = VarDecl::Create(SemaRef.Context, SemaRef.getFunctionLevelDeclContext(), SourceLocation(), SourceLocation(), &SemaRef.Context.Idents.get(name), Ty, SemaRef.Context.getTrivialTypeSourceInfo(Ty), SC_None);
       LocalTemps.push_back(TmpVar);
+      ++Stats.Temporaries;
       return TmpVar;
     }
     // Creates a typedef for arrays and other types
@@ -1601,7 +2402,7 @@ namespace {
       if(check.Found) {
         TypeSourceInfo *TSI = SemaRef.Context.getTrivialTypeSourceInfo(Ty);
         TranslationUnitDecl *TU = SemaRef.Context.getTranslationUnitDecl();
-        std::string Name = (Twine("_cupc2c_tld") + Twine(AnonRecordID++)).str();
+        std::string Name = (Twine("_cupc2c_tld") + NamePrefix + Twine(AnonRecordID++)).str();
         TypedefDecl *NewTypedef = TypedefDecl::Create(SemaRef.Context, TU,
                                          SourceLocation(), SourceLocation(),
                                          &SemaRef.Context.Idents.get(Name),
@@ -1641,11 +2442,46 @@ namespace {
     Decl *TransformDecl(SourceLocation Loc, Decl *D) {
       if(D == NULL) return NULL;
       Decl *Result = TreeTransformUPC::TransformDecl(Loc, D);
+      if(Result == D && isInSystemHeader(D)) {
+	if(Decl *Lazy = TransformSystemDecl(Loc, D))
+	  return Lazy;
+      }
       if(Result == D) {
 	Result = TransformDeclaration(D, SemaRef.CurContext);
       }
       return Result;
     }
+    bool isInSystemHeader(Decl *D) {
+      SourceManager& SrcManager = SemaRef.Context.getSourceManager();
+      SourceLocation Loc = SrcManager.getExpansionLoc(D->getLocation());
+      return Loc.isValid() && SrcManager.isInSystemHeader(Loc);
+    }
+    // Declarations from system headers are not printed, so they
+    // are only transformed when user code refers to them.  Their
+    // function bodies are skipped, and any typedefs they create
+    // are dropped, as they would be at the top level.
+    Decl *TransformSystemDecl(SourceLocation Loc, Decl *D) {
+      DeclContext *OldDC = D->getDeclContext();
+      if(isa<TranslationUnitDecl>(OldDC)) {
+	std::vector<Decl*> SavedLocalStatics;
+	SavedLocalStatics.swap(LocalStatics);
+	bool SavedInSystemDecl = InSystemDecl;
+	InSystemDecl = true;
+	Decl *Result = TransformDeclaration(D, SemaRef.Context.getTranslationUnitDecl());
+	InSystemDecl = SavedInSystemDecl;
+	LocalStatics.swap(SavedLocalStatics);
+	return Result;
+      }
+      // Fields and enumerators are mapped when their
+      // enclosing declaration is transformed.
+      if(isa<TagDecl>(OldDC)) {
+	TransformDecl(Loc, cast<Decl>(OldDC));
+	Decl *Result = TreeTransformUPC::TransformDecl(Loc, D);
+	if(Result != D)
+	  return Result;
+      }
+      return NULL;
+    }
     //Decl *TransformDefinition(SourceLocation Loc, Decl *D) {
     //  return TransformDeclaration(D, SemaRef.CurContext);
     //}
@@ -1726,7 +2562,7 @@ namespace {
 
       Expr *Size = IntegerLiteral::Create(SemaRef.Context, T->getSize(), SemaRef.Context.getSizeType(), SourceLocation());
       if(T->getThread()) {
-	std::vector<Expr*> args;
+	llvm::SmallVector<Expr*, 4> args;
 	Expr *Threads = BuildUPCRCall(Decls->upcr_threads, args).get();
 	Size = MaybeAddParensForMultiply(Size);
 	Size = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Mul, Size, Threads).get();
@@ -1818,7 +2654,7 @@ namespace {
 	  TranslationUnitDecl *TU = SemaRef.Context.getTranslationUnitDecl();
           TypedefDecl *& NewTypedef = ExtraAnonTagDecls[TT->getDecl()];
           if(NewTypedef == NULL) {
-            std::string Name = (Twine("_bupc_anon_struct") + Twine(AnonRecordID++)).str();
+            std::string Name = (Twine("_bupc_anon_struct") + NamePrefix + Twine(AnonRecordID++)).str();
             NewTypedef = TypedefDecl::Create(SemaRef.Context, TU,
                                              SourceLocation(), SourceLocation(),
                                              &SemaRef.Context.Idents.get(Name),
@@ -1833,6 +2669,14 @@ namespace {
       return NULL;
     }
     QualType MakeTypedefForAnonRecord(QualType RealType) {
+      // Variables of the same anonymous type are common, and the
+      // substitution is the same for all of them.
+      bool Cacheable = !RealType->isVariablyModifiedType();
+      if(Cacheable) {
+        llvm::DenseMap<QualType, QualType>::const_iterator pos = AnonRecordTypes.find(RealType);
+        if(pos != AnonRecordTypes.end())
+          return pos->second;
+      }
       QualType Element = SemaRef.Context.getBaseElementType(RealType);
       RecordDecl *RD = nullptr;
 
@@ -1849,7 +2693,10 @@ namespace {
         }
 
         SubstituteType Sub(SemaRef, Element, SemaRef.Context.getTypedefType(NewTypedef));
-        RealType = Sub.TransformType(RealType);
+        QualType Result = Sub.TransformType(RealType);
+        if(Cacheable)
+          AnonRecordTypes[RealType] = Result;
+        return Result;
       }
       return RealType;
     }
@@ -1865,17 +2712,70 @@ namespace {
       return RealType;
     }
     IdentifierInfo * mangleStaticLocalName(IdentifierInfo * VarName) {
-      std::string Name = (llvm::Twine("_bupc_static_local") +
+      std::string Name = (llvm::Twine("_bupc_static_local") + NamePrefix +
                           llvm::Twine(StaticLocalVarID++) + 
                           VarName->getName()).str();
       return &SemaRef.Context.Idents.get(Name);
     }
     IdentifierInfo * mangleLocalRecordName(IdentifierInfo * VarName) {
-      std::string Name = (llvm::Twine("_bupc_local_decl") +
+      std::string Name = (llvm::Twine("_bupc_local_decl") + NamePrefix +
                           llvm::Twine(StaticLocalVarID++) + 
                           VarName->getName()).str();
       return &SemaRef.Context.Idents.get(Name);
     }
+    // Copies the source text of FD if lowering would not change
+    // it, and the only macros in it come from the C headers that
+    // the output includes.  The text is printed by UPCPrintHelper
+    // in place of result, which is marked as having a body.
+    bool CopyVerbatim(FunctionDecl *FD, FunctionDecl *result) {
+      if(!VerbatimMacros)
+        return false;
+      SourceManager& SrcManager = SemaRef.Context.getSourceManager();
+      SourceRange Range = FD->getSourceRange();
+      if(!Range.getBegin().isFileID() || !Range.getEnd().isFileID())
+        return false;
+      std::pair<FileID, unsigned> Begin = SrcManager.getDecomposedLoc(Range.getBegin());
+      std::pair<FileID, unsigned> End = SrcManager.getDecomposedLoc(Range.getEnd());
+      if(Begin.first != End.first)
+        return false;
+      End.second += Lexer::MeasureTokenLength(Range.getEnd(), SrcManager, SemaRef.getLangOpts());
+      // Attributes written before the declaration specifiers are
+      // outside of the range.
+      for(Decl::attr_iterator iter = FD->attr_begin(), end = FD->attr_end(); iter != end; ++iter) {
+        SourceLocation Loc = (*iter)->getLocation();
+        if(Loc.isValid() && SrcManager.isBeforeInTranslationUnit(Loc, Range.getBegin()))
+          return false;
+      }
+      llvm::SmallVector<const MacroInfo *, 8> Macros;
+      if(!VerbatimMacros->getMacros(Begin.first, Begin.second, End.second, Macros))
+        return false;
+      for(llvm::SmallVectorImpl<const MacroInfo *>::const_iterator iter = Macros.begin(), end = Macros.end(); iter != end; ++iter) {
+        StringRef Header = GetIncludedHeader((*iter)->getDefinitionLoc());
+        if(Header.empty() || !CollectedIncludes.count(Header))
+          return false;
+      }
+      FindLoweredConstructs Finder(SemaRef.Context);
+      if(Finder.find(FD))
+        return false;
+      bool Invalid = false;
+      StringRef Buffer = SrcManager.getBufferData(Begin.first, &Invalid);
+      if(Invalid)
+        return false;
+
+      std::string Text;
+      llvm::raw_string_ostream OS(Text);
+      if(VerbatimLines) {
+        PresumedLoc PLoc = SrcManager.getPresumedLoc(Range.getBegin());
+        OS << "#line " << PLoc.getLine() << " \"";
+        OS.write_escaped(PLoc.getFilename());
+        OS << "\"\n";
+      }
+      OS << Buffer.substr(Begin.second, End.second - Begin.second);
+      VerbatimText[result] = OS.str();
+      result->setHasSkippedBody();
+      ++Stats.VerbatimFunctions;
+      return true;
+    }
     Decl *TransformDeclarationImpl(Decl *D, DeclContext *DC) {
       if(isa<NamedDecl>(D) && cast<NamedDecl>(D)->getIdentifier() == &SemaRef.Context.Idents.get("__builtin_va_list")) {
 	return SemaRef.Context.getBuiltinVaListDecl();
@@ -1934,7 +2834,10 @@ namespace {
 	}
 	result->setParams(Parms);
 
-	if(FD->doesThisDeclarationHaveABody()) {
+	if(FD->doesThisDeclarationHaveABody() && !InSystemDecl && !SkipFunctionBodies &&
+	   !CopyVerbatim(FD, result)) {
+	  PhaseScope Phase(Profiler, "Function", FD->getName());
+	  llvm::SaveAndRestore<FunctionDecl*> Function(CurrentFunction, FD);
 	  SemaRef.ActOnStartOfFunctionDef(0, result);
 	  Sema::SynthesizedFunctionScope Scope(SemaRef, result);
 	  Stmt *FnBody;
@@ -1943,7 +2846,7 @@ namespace {
 	    Stmt *UserBody = TransformStmt(FD->getBody()).get();
 	    llvm::SmallVector<Stmt*, 8> Body;
 	    {
-	      std::vector<Expr*> args;
+	      llvm::SmallVector<Expr*, 4> args;
 	      Body.push_back(BuildUPCRCall(Decls->UPCR_BEGIN_FUNCTION, args, UserBody->getBeginLoc()).get());
 	    }
 	    // Insert all the temporary variables that we created
@@ -1955,7 +2858,7 @@ namespace {
 	    // Insert the user code
 	    Body.push_back(UserBody);
 	    {
-	      std::vector<Expr*> args;
+	      llvm::SmallVector<Expr*, 4> args;
 	      Body.push_back(BuildUPCRCall(Decls->UPCR_EXIT_FUNCTION, args, UserBody->getEndLoc()).get());
 	    }
 	    if(isMain)
@@ -2283,14 +3186,171 @@ namespace {
     bool TreatAsCHeader(SourceLocation Loc) {
       if(Loc.isInvalid()) return false;
       SourceManager& SrcManager = SemaRef.Context.getSourceManager();
-      if(SrcManager.getFileID(Loc) == SrcManager.getMainFileID()) return false;
+      if(PreprocessedInput) {
+        // Each entry into a header has its own include location.
+        // The code outside of any header has none.
+        PresumedLoc PLoc = SrcManager.getPresumedLoc(SrcManager.getExpansionLoc(Loc));
+        if(PLoc.isInvalid() || PLoc.getIncludeLoc().isInvalid())
+          return false;
+        std::pair<llvm::DenseMap<unsigned, bool>::iterator, bool> Inserted =
+          MarkedCHeaders.insert(std::make_pair(PLoc.getIncludeLoc().getRawEncoding(), false));
+        if(Inserted.second)
+          Inserted.first->second = StringRef(PLoc.getFilename()).find("/upcr_preinclude/") == StringRef::npos &&
+            SrcManager.isInSystemHeader(SrcManager.getExpansionLoc(Loc));
+        return Inserted.first->second;
+      }
+      FileID File = SrcManager.getFileID(Loc);
+      if(File == SrcManager.getMainFileID()) return false;
+      // The answer is the same for every location in a file (or
+      // macro expansion), and this is asked for every declaration.
+      llvm::DenseMap<FileID, bool>::const_iterator pos = CHeaderFiles.find(File);
+      if(pos != CHeaderFiles.end())
+        return pos->second;
       // Make sure we don't output any UPC system includes
-      std::string FilePath = SrcManager.getFilename(Loc).str();
-      return FilePath.find("/upcr_preinclude/") == std::string::npos &&
+      bool Result = SrcManager.getFilename(Loc).find("/upcr_preinclude/") == StringRef::npos &&
 	SrcManager.isInSystemHeader(Loc);
+      CHeaderFiles[File] = Result;
+      return Result;
     }
+    llvm::DenseMap<FileID, bool> CHeaderFiles;
+    bool PreprocessedInput;
+    llvm::DenseMap<unsigned, bool> MarkedCHeaders;
     std::set<StringRef> UPCSystemHeaders;
     std::map<StringRef, StringRef> UPCHeaderRenames;
+    // Finds the outermost C header through which user code
+    // included Loc, or returns an empty name.
+    StringRef GetIncludedHeader(SourceLocation Loc) {
+      if(!TreatAsCHeader(Loc))
+        return StringRef();
+      SourceManager& SrcManager = SemaRef.Context.getSourceManager();
+      if(PreprocessedInput) {
+        PresumedLoc PLoc = SrcManager.getPresumedLoc(SrcManager.getExpansionLoc(Loc));
+        StringRef &Result = MarkedHeaders[PLoc.getIncludeLoc().getRawEncoding()];
+        if(Result.empty()) {
+          SourceLocation IncludeLoc = PLoc.getIncludeLoc();
+          while(TreatAsCHeader(IncludeLoc)) {
+            PLoc = SrcManager.getPresumedLoc(IncludeLoc);
+            IncludeLoc = PLoc.getIncludeLoc();
+          }
+          Result = PLoc.getFilename();
+        }
+        return Result;
+      }
+      StringRef &Result = IncludedHeaders[SrcManager.getFileID(Loc)];
+      if(Result.empty()) {
+        SourceLocation HeaderLoc;
+        SourceLocation IncludeLoc = Loc;
+        do {
+          HeaderLoc = IncludeLoc;
+          IncludeLoc = SrcManager.getIncludeLoc(SrcManager.getFileID(HeaderLoc));
+        } while(TreatAsCHeader(IncludeLoc));
+        Result = SrcManager.getFilename(HeaderLoc);
+      }
+      return Result;
+    }
+    llvm::DenseMap<FileID, StringRef> IncludedHeaders;
+    llvm::DenseMap<unsigned, StringRef> MarkedHeaders;
+    // Records the outermost C header through which user code
+    // included the declaration at Loc.
+    void RecordInclude(SourceLocation Loc) {
+      StringRef Name = GetIncludedHeader(Loc);
+      if(!Name.empty()) {
+        CollectedIncludes.insert(Name);
+      }
+    }
+    // Finds the includes without transforming anything, so that
+    // they are known before the first declaration is transformed.
+    void CollectIncludes(TranslationUnitDecl *D) {
+      SourceManager& SrcManager = SemaRef.Context.getSourceManager();
+      for(DeclContext::decl_iterator iter = D->decls_begin(),
+          end = D->decls_end(); iter != end; ++iter) {
+        SourceLocation Loc = SrcManager.getExpansionLoc((*iter)->getLocation());
+        if(Loc.isValid() && SrcManager.isInSystemHeader(Loc))
+          RecordInclude(Loc);
+      }
+    }
+    void AddTopLevelDecl(TranslationUnitDecl *TU, Decl *D) {
+      if(CallCounter)
+        CallCounter->TraverseDecl(D);
+      if(Emitter)
+        Emitter->emit(D);
+      else
+        TU->addDecl(D);
+    }
+    // Starts numbering the names invented for a top-level
+    // declaration.  With stable names, each declared name has its
+    // own numbering, which is part of the invented names, so that
+    // editing one function renames nothing in the others.
+    void BeginNaming(Decl *D) {
+      if(!StableNames)
+        return;
+      NameCounters[NamePrefix] = std::make_pair(AnonRecordID, StaticLocalVarID);
+      NamedDecl *ND = dyn_cast_or_null<NamedDecl>(D);
+      NamePrefix = ND && ND->getIdentifier()? ("_" + ND->getName() + "_").str() : std::string("_");
+      std::pair<int, int> Counters = NameCounters.lookup(NamePrefix);
+      AnonRecordID = Counters.first;
+      StaticLocalVarID = Counters.second;
+    }
+    // What lowering one function definition changed, found by
+    // comparing the state before and after it.
+    struct UnitSnapshot {
+      UnitState State;
+      std::size_t SharedGlobals, SharedInitializers, DynamicInitializers, AnonTags;
+      bool VAArg, OffsetOf;
+    };
+    UnitState GetUnitState() {
+      UnitState State;
+      State.AnonRecordID = AnonRecordID;
+      State.StaticLocalVarID = StaticLocalVarID;
+      return State;
+    }
+    // The helper macro flags are cleared, so that EndUnit sees
+    // which ones this definition needs by itself.
+    UnitSnapshot BeginUnit() {
+      UnitSnapshot Before;
+      Before.State = GetUnitState();
+      Before.SharedGlobals = SharedGlobals.size();
+      Before.SharedInitializers = SharedInitializers.size();
+      Before.DynamicInitializers = DynamicInitializers.size();
+      Before.AnonTags = ExtraAnonTagDecls.size();
+      Before.VAArg = haveVAArg;
+      Before.OffsetOf = haveOffsetOf;
+      haveVAArg = haveOffsetOf = false;
+      return Before;
+    }
+    // A definition that allocates or initializes shared or TLD
+    // data, or names an anonymous type for later declarations, is
+    // always lowered again, so UPCRI_ALLOC_* and UPCRI_INIT_* are
+    // always built from fresh lowerings.
+    void EndUnit(FunctionDecl *FD, const UnitSnapshot &Before) {
+      UnitState After = GetUnitState();
+      After.VAArg = haveVAArg;
+      After.OffsetOf = haveOffsetOf;
+      haveVAArg |= Before.VAArg;
+      haveOffsetOf |= Before.OffsetOf;
+      bool Reusable = SharedGlobals.size() == Before.SharedGlobals &&
+        SharedInitializers.size() == Before.SharedInitializers &&
+        DynamicInitializers.size() == Before.DynamicInitializers &&
+        ExtraAnonTagDecls.size() == Before.AnonTags;
+      Units->lowered(FD, Before.State, After, Reusable);
+    }
+    // Copies a function definition from the unit cache.  It is
+    // still transformed without its body, for the declarations
+    // after it that refer to the function.
+    bool ReuseUnit(FunctionDecl *FD, TranslationUnitDecl *TU) {
+      UnitState State = GetUnitState();
+      if(!Units->reuse(FD, State))
+        return false;
+      SkipFunctionBodies = true;
+      TransformDeclaration(FD, TU);
+      SkipFunctionBodies = false;
+      AnonRecordID = State.AnonRecordID;
+      StaticLocalVarID = State.StaticLocalVarID;
+      haveVAArg |= State.VAArg;
+      haveOffsetOf |= State.OffsetOf;
+      ++Stats.ReusedFunctions;
+      return true;
+    }
     Decl *TransformTranslationUnitDecl(TranslationUnitDecl *D) {
       TranslationUnitDecl *result = SemaRef.Context.getTranslationUnitDecl();
       transformedLocalDecl(D, result);
@@ -2298,46 +3358,65 @@ namespace {
       SemaRef.setCurScope(&CurScope);
       SemaRef.PushDeclContext(&CurScope, result);
 
+      // Definitions are only copied if the macros in them come
+      // from headers that are known to be included.
+      if(VerbatimMacros)
+        CollectIncludes(D);
+
       // Process all Decls
       for(DeclContext::decl_iterator iter = D->decls_begin(),
           end = D->decls_end(); iter != end; ++iter) {
-	Decl *decl = TransformDeclaration(*iter, result);
 	SourceManager& SrcManager = SemaRef.Context.getSourceManager();
 	SourceLocation Loc = SrcManager.getExpansionLoc((*iter)->getLocation());
 
 	// Don't output Decls declared in system headers
 	if(Loc.isInvalid() || !SrcManager.isInSystemHeader(Loc)) {
+	  BeginNaming(*iter);
+	  FunctionDecl *Unit = Units? dyn_cast<FunctionDecl>(*iter) : 0;
+	  if(Unit && !Unit->doesThisDeclarationHaveABody())
+	    Unit = 0;
+	  if(Unit && ReuseUnit(Unit, result)) {
+	    LocalStatics.clear();
+	    continue;
+	  }
+	  UnitSnapshot Before;
+	  if(Unit)
+	    Before = BeginUnit();
+	  Decl *decl = TransformDeclaration(*iter, result);
 	  for(std::vector<Decl*>::const_iterator locals_iter = LocalStatics.begin(), locals_end = LocalStatics.end(); locals_iter != locals_end; ++locals_iter) {
 	    if(!(*locals_iter)->isImplicit())
-	      result->addDecl(*locals_iter);
+	      AddTopLevelDecl(result, *locals_iter);
 	  }
 	  if(decl && !decl->isImplicit())
-	    result->addDecl(decl);
+	    AddTopLevelDecl(result, decl);
+	  if(Unit)
+	    EndUnit(Unit, Before);
         } else {
-	  if(TreatAsCHeader(Loc)) {
-	    // Record the system headers included by user code
-	    SourceLocation HeaderLoc;
-	    SourceLocation IncludeLoc = Loc;
-	    do {
-	      HeaderLoc = IncludeLoc;
-	      IncludeLoc = SrcManager.getIncludeLoc(SrcManager.getFileID(HeaderLoc));
-	    } while(TreatAsCHeader(IncludeLoc));
-
-	    StringRef Name = SrcManager.getFilename(HeaderLoc);
-	    if(!Name.empty()) {
-	      CollectedIncludes.insert(Name);
-	    }
-          }
+	  // Record the system headers included by user code
+	  RecordInclude(Loc);
 	}
 	LocalStatics.clear();
       }
 
-      if(FunctionDecl *Alloc = GetSharedAllocationFunction()) {
-	result->addDecl(Alloc);
+      BeginNaming(0);
+      FunctionDecl *Alloc;
+      {
+        PhaseScope Phase(Profiler, "SharedAllocation");
+        Alloc = GetSharedAllocationFunction();
       }
-      if(FunctionDecl *Init = GetSharedInitializationFunction()) {
-	result->addDecl(Init);
+      if(Alloc) {
+	AddTopLevelDecl(result, Alloc);
       }
+      FunctionDecl *Init;
+      {
+        PhaseScope Phase(Profiler, "SharedInitialization");
+        Init = GetSharedInitializationFunction();
+      }
+      if(Init) {
+	AddTopLevelDecl(result, Init);
+      }
+      if(Emitter)
+        Emitter->finish();
       SemaRef.setCurScope(0);
       return result;
     }
@@ -2349,10 +3428,12 @@ namespace {
       return Loc.isInvalid() || !SrcManager.isInSystemHeader(Loc);
     }
     bool isUPCThreadLocal(Decl *D) {
-      return ThreadLocalDecls.find(D) != ThreadLocalDecls.end();
+      return ThreadLocalDecls.count(D);
     }
-    std::set<Decl*> ThreadLocalDecls;
-    std::map<Decl*, TypedefDecl*> ExtraAnonTagDecls;
+    llvm::SmallPtrSet<Decl*, 32> ThreadLocalDecls;
+    llvm::DenseMap<QualType, QualType> AccessTypes;
+    llvm::DenseMap<Decl*, TypedefDecl*> ExtraAnonTagDecls;
+    llvm::DenseMap<QualType, QualType> AnonRecordTypes;
     std::vector<Stmt*> SplitDecls;
     std::vector<Decl*> LocalStatics;
     UPCRDecls *Decls;
@@ -2375,7 +3456,7 @@ namespace {
 	Sema::CompoundScopeRAII BodyScope(SemaRef);
 	SmallVector<Stmt*, 8> Statements;
 	{
-	  std::vector<Expr*> args;
+	  llvm::SmallVector<Expr*, 4> args;
 	  Statements.push_back(BuildUPCRCall(Decls->UPCR_BEGIN_FUNCTION, args).get());
 	}
 	int SizeTypeSize = SemaRef.Context.getTypeSize(SemaRef.Context.getSizeType());
@@ -2385,7 +3466,7 @@ namespace {
 	SmallVector<Expr*, 8> PInitializers;
 	for(SharedGlobalsType::const_iterator iter = SharedGlobals.begin(), end = SharedGlobals.end();
 	    iter != end; ++iter) {
-	  std::vector<Expr*> args;
+	  llvm::SmallVector<Expr*, 4> args;
 	  bool Phaseless = (iter->first->getType() == Decls->upcr_pshared_ptr_t);
 	  //args.push_back(SemaRef.BuildDeclRefExpr(iter->first, iter->first->getType(), VK_LValue, SourceLocation()).get());
 	  //args.push_back(dynamic_cast<Expr *>(SemaRef.BuildDeclRefExpr(iter->first, iter->first->getType(), VK_LValue, SourceLocation())));
@@ -2445,7 +3526,7 @@ namespace {
 	  Statements.push_back(SemaRef.ActOnDeclStmt(Sema::DeclGroupPtrTy::make(DeclGroupRef::Create(SemaRef.Context, _bupc_pinfo_arr, 1)), SourceLocation(), SourceLocation()).get());
 	}
 	if(!Initializers.empty()) {
-	  std::vector<Expr*> args;
+	  llvm::SmallVector<Expr*, 4> args;
 	  //args.push_back(SemaRef.BuildDeclRefExpr(_bupc_info, _bupc_info_type, VK_LValue, SourceLocation()).get());
 	  //args.push_back(dynamic_cast<Expr *>(SemaRef.BuildDeclRefExpr(_bupc_info, _bupc_info_type, VK_LValue, SourceLocation())));
 	  args.push_back(dyn_cast<Expr>(SemaRef.BuildDeclRefExpr(_bupc_info, _bupc_info_type, VK_LValue, SourceLocation())));
@@ -2453,7 +3534,7 @@ namespace {
 	  Statements.push_back(BuildUPCRCall(Decls->upcr_startup_shalloc, args).get());
 	}
 	if(!PInitializers.empty()) {
-	  std::vector<Expr*> args;
+	  llvm::SmallVector<Expr*, 4> args;
 	  //args.push_back(SemaRef.BuildDeclRefExpr(_bupc_pinfo, _bupc_pinfo_type, VK_LValue, SourceLocation()).get());
 	  //args.push_back(dynamic_cast<Expr *>(SemaRef.BuildDeclRefExpr(_bupc_pinfo, _bupc_pinfo_type, VK_LValue, SourceLocation())));
 	  args.push_back(dyn_cast<Expr>(SemaRef.BuildDeclRefExpr(_bupc_pinfo, _bupc_pinfo_type, VK_LValue, SourceLocation())));
@@ -2494,13 +3575,13 @@ namespace {
 	Sema::CompoundScopeRAII BodyScope(SemaRef);
 	SmallVector<Stmt*, 8> Statements;
 	{
-	  std::vector<Expr*> args;
+	  llvm::SmallVector<Expr*, 4> args;
 	  Statements.push_back(BuildUPCRCall(Decls->UPCR_BEGIN_FUNCTION, args).get());
 	}
 	
 	Expr *Cond_;
 	{
-	  std::vector<Expr*> args;
+	  llvm::SmallVector<Expr*, 4> args;
 	  Expr *mythread = BuildUPCRCall(Decls->upcr_mythread, args).get();
 	  Cond_ = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_EQ, mythread, CreateInteger(SemaRef.Context.IntTy, 0)).get();
 	}
@@ -2520,7 +3601,7 @@ namespace {
 	{
 	  SmallVector<Stmt*, 8> PutOnce;
 	  for(std::size_t i = 0; i < SharedInitializers.size(); ++i) {
-	    std::vector<Expr*> args;
+	    llvm::SmallVector<Expr*, 4> args;
 	    args.push_back(CreateSimpleDeclRef(SharedInitializers[i].first));
 	    args.push_back(CreateInteger(SemaRef.Context.IntTy, 0));
 	    args.push_back(SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_AddrOf, CreateSimpleDeclRef(Initializers[i])).get());
@@ -2555,11 +3636,16 @@ namespace {
     virtual bool handledStmt(Stmt *, raw_ostream &) { return false; }
     virtual bool handledDecl(Decl *D, PrintingPolicy const& Policy,
                              raw_ostream & OS) {
+      if(FunctionDecl * FD = dyn_cast<FunctionDecl>(D)) {
+        StringRef Text = Trans.getVerbatimText(FD);
+        if(!Text.empty()) {
+          OS << Text;
+          return true;
+        }
+      }
       if(VarDecl * VD = dyn_cast<VarDecl>(D)) {
         if(Trans.isUPCThreadLocal(VD) && !VD->hasExternalStorage()) {
-          VD->getType().print(OS, Policy);
-          OS << " UPCR_TLD_DEFINE(" << VD->getIdentifier()->getName() << ", "
-             << Trans.getSema().Context.getTypeSizeInChars(VD->getType()).getQuantity() << ", " << Trans.getSema().Context.getTypeAlignInChars(VD->getType()).getQuantity() << ")";
+          printTLDDefine(VD, Policy, OS);
           if(Expr * Init = VD->getInit()) {
             OS << " = ";
             Init->printPretty(OS, this, Policy);
@@ -2569,35 +3655,1150 @@ namespace {
       }
       return false;
     }
+    // Declares a variable or function that another file of
+    // -split= defines.
+    void printExternDecl(ValueDecl *D, PrintingPolicy const& Policy, raw_ostream &OS) {
+      if(VarDecl * VD = dyn_cast<VarDecl>(D)) {
+        OS << "extern ";
+        if(Trans.isUPCThreadLocal(VD))
+          printTLDDefine(VD, Policy, OS);
+        else
+          VD->getType().print(OS, Policy, VD->getName());
+      } else {
+        D->getType().print(OS, Policy, D->getName());
+      }
+      OS << ";\n";
+    }
     RemoveUPCTransform &Trans;
+    std::mutex LayoutMutex;
+  private:
+    void printTLDDefine(VarDecl *VD, PrintingPolicy const& Policy, raw_ostream &OS) {
+      VD->getType().print(OS, Policy);
+      CharUnits Size, Align;
+      {
+        // Layout queries memoize in the ASTContext, and
+        // declarations may be printed on several threads.
+        std::lock_guard<std::mutex> Lock(LayoutMutex);
+        Size = Trans.getSema().Context.getTypeSizeInChars(VD->getType());
+        Align = Trans.getSema().Context.getTypeAlignInChars(VD->getType());
+      }
+      OS << " UPCR_TLD_DEFINE(" << VD->getIdentifier()->getName() << ", "
+         << Size.getQuantity() << ", " << Align.getQuantity() << ")";
+    }
   };
 
-  class RemoveUPCConsumer : public clang::SemaConsumer {
+  // Splits top-level declarations into groups that print the same
+  // on their own as in the whole translation unit.  A tag definition
+  // that is not free-standing is held back and grouped with the
+  // declarations that use it, as DeclPrinter does.
+  class GroupingDeclEmitter : public DeclEmitter {
   public:
-    RemoveUPCConsumer(StringRef Output, StringRef FileString, bool Lines) : filename(Output), fileid(FileString), lines(Lines) {}
-    virtual void HandleTranslationUnit(clang::ASTContext &Context) {
-      if(Context.getDiagnostics().hasUncompilableErrorOccurred())
-	return;
-
-      TranslationUnitDecl *top = Context.getTranslationUnitDecl();
-      // Copy the ASTContext and Sema
-      LangOptions LangOpts = Context.getLangOpts();
-      ASTContext newContext(LangOpts, Context.getSourceManager(),
-			    Context.Idents, Context.Selectors, Context.BuiltinInfo);
-      newContext.InitBuiltinTypes(Context.getTargetInfo());
-      newContext.getDiagnostics().setIgnoreAllWarnings(true);
-      ASTConsumer nullConsumer;
-      UPCRDecls Decls(newContext);
-      Sema newSema(S->getPreprocessor(), newContext, nullConsumer);
-      RemoveUPCTransform Trans(newSema, &Decls, fileid);
-      Decl *Result = Trans.TransformTranslationUnitDecl(top);
-      std::error_code error;
-      llvm::raw_fd_ostream OS(filename.c_str(), error, llvm::sys::fs::F_None);
-      OS << "#include <upcr.h>\n";
-
-      Trans.PrintIncludes(OS);
+    GroupingDeclEmitter(ASTContext &C) : Context(C) {}
+    virtual void emit(Decl *D) {
+      QualType CurDeclType = getDeclType(D);
+      if(!Pending.empty() && !CurDeclType.isNull()) {
+        QualType BaseType = GetBaseType(CurDeclType);
+        if(!BaseType.isNull() && isa<ElaboratedType>(BaseType) &&
+           cast<ElaboratedType>(BaseType)->getOwnedTagDecl() == Pending[0]) {
+          Pending.push_back(D);
+          return;
+        }
+      }
+      flush();
+      Pending.push_back(D);
+      if(!isa<TagDecl>(D) || cast<TagDecl>(D)->isFreeStanding())
+        flush();
+    }
+    virtual void finish() { flush(); }
+  protected:
+    virtual void emitGroup(TranslationUnitDecl *Group) = 0;
+  private:
+    // Each group is printed through its own translation unit,
+    // so that nothing links the printed declarations together.
+    void flush() {
+      if(Pending.empty())
+        return;
+      TranslationUnitDecl *Group = TranslationUnitDecl::Create(Context);
+      for(std::vector<Decl*>::const_iterator iter = Pending.begin(), end = Pending.end(); iter != end; ++iter) {
+        (*iter)->setLexicalDeclContext(Group);
+        Group->addHiddenDecl(*iter);
+      }
+      emitGroup(Group);
+      Pending.clear();
+    }
+    ASTContext &Context;
+    std::vector<Decl*> Pending;
+  };
 
-      OS << "#ifndef UPCR_TRANS_EXTRA_INCL\n"
+  // Keeps the groups of a whole file, then prints them on a thread
+  // pool into separate buffers that are written out in order.
+  // Printing only reads the finished AST, except for the layout
+  // queries in UPCPrintHelper, which are locked, and the source
+  // manager's caches behind line directives, so those files are
+  // printed serially.
+  class ParallelDeclEmitter : public GroupingDeclEmitter {
+  public:
+    ParallelDeclEmitter(ASTContext &C) : GroupingDeclEmitter(C) {}
+    void print(llvm::raw_ostream &OS, const PrintingPolicy &Policy, unsigned Threads) {
+      printGroups(Policy, Threads);
+      for(std::vector<std::string>::const_iterator iter = Texts.begin(), end = Texts.end(); iter != end; ++iter)
+        OS << *iter;
+    }
+    const std::vector<TranslationUnitDecl*> &getGroups() const { return Groups; }
+    // Leaves out the groups marked in Unused.  Returns the number
+    // of declarations in them.
+    unsigned leaveOut(const std::vector<bool> &Unused) {
+      unsigned Count = 0;
+      for(std::size_t i = 0; i < Groups.size(); ++i) {
+        if(!Unused[i] || !Groups[i])
+          continue;
+        Count += std::distance(Groups[i]->decls_begin(), Groups[i]->decls_end());
+        Groups[i] = 0;
+      }
+      return Count;
+    }
+  protected:
+    virtual void emitGroup(TranslationUnitDecl *Group) {
+      Groups.push_back(Group);
+      Texts.push_back(std::string());
+    }
+    // Prints each group into its own entry of Texts.  A null group
+    // stands for text that was added directly, or for a group that
+    // was left out.
+    void printGroups(const PrintingPolicy &Policy, unsigned Threads) {
+      if(Threads <= 1) {
+        for(std::size_t i = 0; i < Groups.size(); ++i)
+          printGroup(i, Policy);
+        return;
+      }
+      // Several chunks per thread even out the cost of large
+      // function bodies.
+      std::size_t NumChunks = std::min<std::size_t>(Groups.size(), Threads * 8);
+      llvm::ThreadPool Pool(Threads);
+      for(std::size_t i = 0; i < NumChunks; ++i) {
+        Pool.async([&, i] {
+          for(std::size_t j = i * Groups.size() / NumChunks, end = (i + 1) * Groups.size() / NumChunks; j != end; ++j)
+            printGroup(j, Policy);
+        });
+      }
+      Pool.wait();
+    }
+    std::vector<TranslationUnitDecl*> Groups;
+    std::vector<std::string> Texts;
+  private:
+    void printGroup(std::size_t i, const PrintingPolicy &Policy) {
+      if(!Groups[i])
+        return;
+      llvm::raw_string_ostream GroupOS(Texts[i]);
+      Groups[i]->print(GroupOS, Policy);
+    }
+  };
+
+  // Finds the declarations that a declaration refers to, through
+  // its expressions and through the types that it uses.
+  class CollectDeclRefs : public RecursiveASTVisitor<CollectDeclRefs> {
+  public:
+    CollectDeclRefs(std::vector<Decl*> &R) : Refs(R) {}
+    bool VisitDeclRefExpr(DeclRefExpr *E) {
+      Refs.push_back(E->getDecl());
+      return true;
+    }
+    bool VisitMemberExpr(MemberExpr *E) {
+      Refs.push_back(E->getMemberDecl());
+      return true;
+    }
+    bool VisitExpr(Expr *E) {
+      addType(E->getType());
+      return true;
+    }
+    bool VisitUnaryExprOrTypeTraitExpr(UnaryExprOrTypeTraitExpr *E) {
+      if(E->isArgumentType())
+        addType(E->getArgumentType());
+      return true;
+    }
+    bool VisitOffsetOfExpr(OffsetOfExpr *E) {
+      addType(E->getTypeSourceInfo()->getType());
+      return true;
+    }
+    bool VisitValueDecl(ValueDecl *D) {
+      addType(D->getType());
+      return true;
+    }
+    bool VisitTypedefNameDecl(TypedefNameDecl *D) {
+      addType(D->getUnderlyingType());
+      return true;
+    }
+    bool VisitTypedefType(TypedefType *T) {
+      Refs.push_back(T->getDecl());
+      return true;
+    }
+    bool VisitTagType(TagType *T) {
+      Refs.push_back(T->getDecl());
+      return true;
+    }
+  private:
+    void addType(QualType T) {
+      if(!T.isNull() && SeenTypes.insert(T.getTypePtr()).second)
+        TraverseType(T);
+    }
+    std::vector<Decl*> &Refs;
+    llvm::SmallPtrSet<const Type *, 32> SeenTypes;
+  };
+
+  // Finds the groups of top-level declarations that -strip-unused
+  // leaves out: static functions and variables, typedefs and tags
+  // that nothing else needs.  Everything else is kept, along with
+  // what it refers to, directly or through other kept groups.  That
+  // covers the external definitions, UPCRI_ALLOC_ and UPCRI_INIT_,
+  // and the shared data that they register.  Redeclarations are
+  // matched by name, as are the names in the text of copied
+  // definitions, which have no body to visit.
+  class FindUnusedGroups {
+  public:
+    FindUnusedGroups(const std::vector<TranslationUnitDecl*> &G, RemoveUPCTransform &T) : Groups(G), Trans(T) {}
+    std::vector<bool> find() {
+      Live.assign(Groups.size(), false);
+      for(std::size_t i = 0; i < Groups.size(); ++i) {
+        if(!Groups[i]) {
+          Live[i] = true;
+          continue;
+        }
+        bool Needed = false;
+        for(DeclContext::decl_iterator iter = Groups[i]->decls_begin(), end = Groups[i]->decls_end(); iter != end; ++iter) {
+          DeclGroups[*iter] = i;
+          std::string Key = getNameKey(*iter);
+          if(!Key.empty())
+            NameGroups[Key].push_back(i);
+          Needed |= !isStrippable(*iter);
+        }
+        if(Needed)
+          markLive(i);
+      }
+      while(!Worklist.empty()) {
+        std::size_t i = Worklist.back();
+        Worklist.pop_back();
+        std::vector<Decl*> Refs;
+        CollectDeclRefs Collector(Refs);
+        Collector.TraverseDecl(Groups[i]);
+        std::vector<std::string> Names;
+        for(std::vector<Decl*>::const_iterator iter = Refs.begin(), end = Refs.end(); iter != end; ++iter) {
+          Decl *D = *iter;
+          while(D->getLexicalDeclContext() && !isa<TranslationUnitDecl>(D->getLexicalDeclContext()))
+            D = cast<Decl>(D->getLexicalDeclContext());
+          llvm::DenseMap<Decl*, std::size_t>::const_iterator pos = DeclGroups.find(D);
+          if(pos != DeclGroups.end())
+            markLive(pos->second);
+          Names.push_back(getNameKey(D));
+        }
+        for(DeclContext::decl_iterator iter = Groups[i]->decls_begin(), end = Groups[i]->decls_end(); iter != end; ++iter) {
+          if(AliasAttr *Alias = iter->getAttr<AliasAttr>())
+            Names.push_back(Alias->getAliasee().str());
+          StringRef Text = Trans.getVerbatimText(*iter);
+          for(std::size_t Pos = 0; Pos < Text.size();) {
+            std::size_t End = Pos;
+            while(End < Text.size() && is_ident_char()(Text[End]))
+              ++End;
+            if(End == Pos) {
+              ++Pos;
+              continue;
+            }
+            Names.push_back(Text.slice(Pos, End).str());
+            Names.push_back("tag " + Names.back());
+            Pos = End;
+          }
+        }
+        for(std::vector<std::string>::const_iterator iter = Names.begin(), end = Names.end(); iter != end; ++iter) {
+          llvm::StringMap<std::vector<std::size_t> >::const_iterator pos = NameGroups.find(*iter);
+          if(iter->empty() || pos == NameGroups.end())
+            continue;
+          for(std::vector<std::size_t>::const_iterator group = pos->second.begin(), group_end = pos->second.end(); group != group_end; ++group)
+            markLive(*group);
+        }
+      }
+      std::vector<bool> Unused(Groups.size());
+      for(std::size_t i = 0; i < Groups.size(); ++i)
+        Unused[i] = !Live[i];
+      return Unused;
+    }
+  private:
+    static bool isStrippable(Decl *D) {
+      if(D->hasAttr<UsedAttr>() || D->hasAttr<ConstructorAttr>() || D->hasAttr<DestructorAttr>())
+        return false;
+      if(isa<TypeDecl>(D))
+        return true;
+      if(FunctionDecl *FD = dyn_cast<FunctionDecl>(D))
+        return FD->getStorageClass() == SC_Static;
+      if(VarDecl *VD = dyn_cast<VarDecl>(D))
+        return VD->getStorageClass() == SC_Static;
+      return false;
+    }
+    // Tags have their own namespace
+    static std::string getNameKey(Decl *D) {
+      NamedDecl *ND = dyn_cast<NamedDecl>(D);
+      if(!ND || !ND->getIdentifier())
+        return std::string();
+      return (isa<TagDecl>(ND)? "tag " : "") + ND->getName().str();
+    }
+    void markLive(std::size_t i) {
+      if(!Live[i]) {
+        Live[i] = true;
+        Worklist.push_back(i);
+      }
+    }
+    const std::vector<TranslationUnitDecl*> &Groups;
+    RemoveUPCTransform &Trans;
+    std::vector<bool> Live;
+    std::vector<std::size_t> Worklist;
+    llvm::DenseMap<Decl*, std::size_t> DeclGroups;
+    llvm::StringMap<std::vector<std::size_t> > NameGroups;
+  };
+
+  // Fingerprints top-level declarations for -incremental-dir=.  A
+  // fingerprint covers the declaration's text, the macros and
+  // conditions in it, where it is and the fingerprints of the
+  // top-level declarations that it refers to, so it changes
+  // whenever the lowering of the declaration might.  Declarations
+  // that refer to each other share a fingerprint, found with
+  // Tarjan's algorithm.  An empty fingerprint means that the
+  // declaration cannot be cached.
+  class DeclFingerprinter {
+  public:
+    DeclFingerprinter(ASTContext &C, MacroUseRecorder &M)
+      : SM(C.getSourceManager()), LangOpts(C.getLangOpts()), Macros(M), NextIndex(0) {}
+    const std::string &get(Decl *D) {
+      std::size_t V = getNode(getTopLevel(D));
+      if(!Nodes[V].Done)
+        visit(V);
+      return Nodes[V].Fingerprint;
+    }
+  private:
+    struct Node {
+      Node() : Index(0), LowLink(0), Visited(false), OnStack(false), Done(false), Cacheable(true) {}
+      Decl *D;
+      std::string Text;
+      std::vector<Decl*> Refs;
+      unsigned Index, LowLink;
+      bool Visited, OnStack, Done, Cacheable;
+      std::string Fingerprint;
+    };
+    static Decl *getTopLevel(Decl *D) {
+      while(!isa<TranslationUnitDecl>(D->getLexicalDeclContext()))
+        D = cast<Decl>(D->getLexicalDeclContext());
+      return D;
+    }
+    std::size_t getNode(Decl *D) {
+      std::pair<llvm::DenseMap<Decl*, std::size_t>::iterator, bool> Inserted = NodeIndex.insert(std::make_pair(D, Nodes.size()));
+      if(!Inserted.second)
+        return Inserted.first->second;
+      Nodes.push_back(Node());
+      Node &N = Nodes.back();
+      N.D = D;
+      N.Cacheable = hashText(D, N.Text);
+      std::vector<Decl*> Refs;
+      CollectDeclRefs Collector(Refs);
+      Collector.TraverseDecl(D);
+      llvm::SmallPtrSet<Decl*, 16> Seen;
+      for(std::vector<Decl*>::const_iterator iter = Refs.begin(), end = Refs.end(); iter != end; ++iter) {
+        Decl *Ref = getTopLevel(*iter);
+        if(Ref != D && Seen.insert(Ref).second)
+          N.Refs.push_back(Ref);
+      }
+      return Inserted.first->second;
+    }
+    // The hash of the declaration by itself.  Names are left out,
+    // as lowering renames anonymous records.
+    bool hashText(Decl *D, std::string &Result) {
+      std::vector<std::string> Parts;
+      Parts.push_back(D->getDeclKindName());
+      SourceRange Range = D->getSourceRange();
+      if(Range.isInvalid()) {
+        if(NamedDecl *ND = dyn_cast<NamedDecl>(D))
+          Parts.push_back(ND->getNameAsString());
+        Result = HashStrings(Parts);
+        return true;
+      }
+      CharSourceRange Expansion = SM.getExpansionRange(Range);
+      SourceLocation EndLoc = Expansion.getEnd();
+      if(Expansion.isTokenRange())
+        EndLoc = Lexer::getLocForEndOfToken(EndLoc, 0, SM, LangOpts);
+      std::pair<FileID, unsigned> Begin = SM.getDecomposedLoc(Expansion.getBegin());
+      std::pair<FileID, unsigned> End = SM.getDecomposedLoc(EndLoc);
+      bool Invalid = false;
+      StringRef Buffer = SM.getBufferData(Begin.first, &Invalid);
+      if(Invalid || EndLoc.isInvalid() || Begin.first != End.first || End.second < Begin.second)
+        return false;
+      PresumedLoc Presumed = SM.getPresumedLoc(Expansion.getBegin());
+      if(Presumed.isInvalid())
+        return false;
+      Parts.push_back(Presumed.getFilename());
+      Parts.push_back(SM.isInSystemHeader(Expansion.getBegin())? "system" : "user");
+      Parts.push_back(Buffer.slice(Begin.second, End.second).str());
+      if(!Macros.addUses(Begin.first, Begin.second, End.second, Parts))
+        return false;
+      Result = HashStrings(Parts);
+      return true;
+    }
+    void visit(std::size_t V) {
+      Nodes[V].Index = Nodes[V].LowLink = NextIndex++;
+      Nodes[V].Visited = Nodes[V].OnStack = true;
+      Stack.push_back(V);
+      for(std::size_t i = 0; i < Nodes[V].Refs.size(); ++i) {
+        std::size_t W = getNode(Nodes[V].Refs[i]);
+        if(!Nodes[W].Visited) {
+          visit(W);
+          Nodes[V].LowLink = std::min(Nodes[V].LowLink, Nodes[W].LowLink);
+        } else if(Nodes[W].OnStack) {
+          Nodes[V].LowLink = std::min(Nodes[V].LowLink, Nodes[W].Index);
+        }
+      }
+      if(Nodes[V].LowLink != Nodes[V].Index)
+        return;
+      std::vector<std::size_t> Component;
+      do {
+        Component.push_back(Stack.back());
+        Nodes[Stack.back()].OnStack = false;
+        Stack.pop_back();
+      } while(Component.back() != V);
+      // The parts are sorted, so that the result does not depend
+      // on where the search entered the component.
+      std::vector<std::string> Texts, Successors;
+      bool Cacheable = true;
+      for(std::vector<std::size_t>::const_iterator iter = Component.begin(), end = Component.end(); iter != end; ++iter) {
+        Node &Member = Nodes[*iter];
+        Cacheable &= Member.Cacheable;
+        Texts.push_back(Member.Text);
+        for(std::vector<Decl*>::const_iterator ref = Member.Refs.begin(), ref_end = Member.Refs.end(); ref != ref_end; ++ref) {
+          Node &Target = Nodes[NodeIndex[*ref]];
+          if(Target.Done) {
+            Cacheable &= !Target.Fingerprint.empty();
+            Successors.push_back(Target.Fingerprint);
+          }
+        }
+      }
+      std::string Fingerprint;
+      if(Cacheable) {
+        std::sort(Texts.begin(), Texts.end());
+        std::sort(Successors.begin(), Successors.end());
+        Successors.erase(std::unique(Successors.begin(), Successors.end()), Successors.end());
+        Texts.push_back("->");
+        Texts.insert(Texts.end(), Successors.begin(), Successors.end());
+        Fingerprint = HashStrings(Texts);
+      }
+      for(std::vector<std::size_t>::const_iterator iter = Component.begin(), end = Component.end(); iter != end; ++iter) {
+        Nodes[*iter].Fingerprint = Fingerprint;
+        Nodes[*iter].Done = true;
+      }
+    }
+    SourceManager &SM;
+    const LangOptions &LangOpts;
+    MacroUseRecorder &Macros;
+    // Nodes is a deque, so that references to its elements stay
+    // valid as it grows.
+    std::deque<Node> Nodes;
+    llvm::DenseMap<Decl*, std::size_t> NodeIndex;
+    std::vector<std::size_t> Stack;
+    unsigned NextIndex;
+  };
+
+  // Splits a "#line N "file"" or "# N "file"" directive into the
+  // digits of N and the rest of the line after them.
+  bool ParseLineDirective(StringRef Line, StringRef &Number, StringRef &Rest) {
+    if(!Line.consume_front("#"))
+      return false;
+    Line = Line.ltrim(" ");
+    Line.consume_front("line");
+    Line = Line.ltrim(" ");
+    std::size_t Digits = Line.find_first_not_of("0123456789");
+    if(Digits == 0 || Digits == StringRef::npos)
+      return false;
+    Number = Line.substr(0, Digits);
+    Rest = Line.substr(Digits).ltrim(" ");
+    return true;
+  }
+
+  // Moves the line directives for File in the text of a function
+  // definition by Delta lines, for a definition that has moved
+  // since the text was printed.
+  std::string RebaseLineDirectives(StringRef Text, StringRef File, int Delta) {
+    if(Delta == 0)
+      return Text.str();
+    std::string Quoted = ("\"" + File + "\"").str();
+    std::string Result;
+    Result.reserve(Text.size());
+    for(std::size_t Pos = 0; Pos < Text.size(); ) {
+      std::size_t End = Text.find('\n', Pos);
+      End = End == StringRef::npos? Text.size() : End + 1;
+      StringRef Line = Text.slice(Pos, End);
+      Pos = End;
+      StringRef Digits, Rest;
+      int Number;
+      if(ParseLineDirective(Line, Digits, Rest) && !Digits.getAsInteger(10, Number) &&
+         Rest.startswith(Quoted)) {
+        Result.append(Line.begin(), Digits.begin());
+        Result += llvm::Twine(Number + Delta).str();
+        Result.append(Digits.end(), Line.end());
+        continue;
+      }
+      Result.append(Line.begin(), Line.end());
+    }
+    return Result;
+  }
+
+  // Passes text through to OS without the #line directives that
+  // do not change the numbering: those naming the line that comes
+  // next anyway, and those followed directly by another directive.
+  class LineDirectiveFilter : public llvm::raw_ostream {
+  public:
+    LineDirectiveFilter(llvm::raw_ostream &O) : OS(O), Line(0), Written(0) {}
+    ~LineDirectiveFilter() {
+      flush();
+      OS << Partial;
+    }
+  private:
+    virtual void write_impl(const char *Ptr, size_t Size) {
+      Written += Size;
+      Partial.append(Ptr, Size);
+      std::size_t Pos = 0;
+      for(std::size_t End; (End = Partial.find('\n', Pos)) != std::string::npos; Pos = End + 1)
+        addLine(StringRef(Partial).slice(Pos, End + 1));
+      Partial.erase(0, Pos);
+    }
+    virtual uint64_t current_pos() const { return Written; }
+    void addLine(StringRef Text) {
+      StringRef Number, Rest;
+      if(ParseLineDirective(Text, Number, Rest)) {
+        Pending = Text.str();
+        return;
+      }
+      if(!Pending.empty()) {
+        ParseLineDirective(Pending, Number, Rest);
+        unsigned N = 0;
+        Number.getAsInteger(10, N);
+        if(N != Line || Rest != File) {
+          OS << Pending;
+          File = Rest.str();
+        }
+        Line = N;
+        Pending.clear();
+      }
+      OS << Text;
+      ++Line;
+    }
+    llvm::raw_ostream &OS;
+    // Where the next line is, as far as the compiler knows
+    unsigned Line;
+    std::string File;
+    std::string Pending;
+    std::string Partial;
+    uint64_t Written;
+  };
+
+  // Collects the groups of a file like ParallelDeclEmitter, noting
+  // the function definition that each one comes from, and takes
+  // the text of definitions copied from an earlier translation.
+  class IncrementalDeclEmitter : public ParallelDeclEmitter {
+  public:
+    IncrementalDeclEmitter(ASTContext &C) : ParallelDeclEmitter(C), CurrentUnit(-1) {}
+    // The declarations emitted from now on come from Unit, or from
+    // no function definition if it is -1.
+    void setUnit(int Unit) { CurrentUnit = Unit; }
+    virtual void emit(Decl *D) {
+      DeclUnits[D] = CurrentUnit;
+      ParallelDeclEmitter::emit(D);
+    }
+    void emitText(int Unit, StringRef Text) {
+      finish();
+      Groups.push_back(0);
+      Texts.push_back(Text.str());
+      GroupUnits.push_back(Unit);
+    }
+    // After printing, gets the text of each unit.  A unit that was
+    // printed in a group with other declarations has no text.
+    void getUnitTexts(std::vector<std::string> &UnitTexts, std::vector<bool> &HasText) {
+      for(std::size_t i = 0; i < Groups.size(); ++i) {
+        int Unit = GroupUnits[i];
+        if(Unit < 0)
+          continue;
+        if(UnitTexts.size() <= std::size_t(Unit))
+          UnitTexts.resize(Unit + 1);
+        UnitTexts[Unit] += Texts[i];
+      }
+      HasText.assign(UnitTexts.size(), true);
+      for(std::set<int>::const_iterator iter = SharedUnits.begin(), end = SharedUnits.end(); iter != end; ++iter) {
+        if(*iter >= 0 && std::size_t(*iter) < HasText.size())
+          HasText[*iter] = false;
+      }
+    }
+  protected:
+    virtual void emitGroup(TranslationUnitDecl *Group) {
+      std::set<int> Units;
+      for(DeclContext::decl_iterator iter = Group->decls_begin(), end = Group->decls_end(); iter != end; ++iter) {
+        llvm::DenseMap<Decl*, int>::const_iterator pos = DeclUnits.find(*iter);
+        Units.insert(pos == DeclUnits.end()? -1 : pos->second);
+      }
+      int Unit = Units.size() == 1? *Units.begin() : -1;
+      if(Units.size() > 1)
+        SharedUnits.insert(Units.begin(), Units.end());
+      ParallelDeclEmitter::emitGroup(Group);
+      GroupUnits.push_back(Unit);
+    }
+  private:
+    int CurrentUnit;
+    llvm::DenseMap<Decl*, int> DeclUnits;
+    std::vector<int> GroupUnits;
+    std::set<int> SharedUnits;
+  };
+
+  // Spreads the groups of a file over the C files of -split=, so
+  // that they can be compiled in parallel.  Groups that define
+  // nothing are printed in every file.  Each definition goes to
+  // one file, and the others declare it extern.  Definitions that
+  // refer to the same static name, such as a promoted static local
+  // or the shared data that the allocation function registers,
+  // stay in one file with it, so no name changes linkage.  Inline
+  // functions and variables of unnamed struct types are kept with
+  // their users in the same way.  The largest sets of definitions
+  // are placed first, each in the file with the least text so far.
+  class SplitDeclEmitter : public ParallelDeclEmitter {
+  public:
+    SplitDeclEmitter(ASTContext &C, UPCPrintHelper &H) : ParallelDeclEmitter(C), Helper(H) {}
+    void split(unsigned NumParts, const PrintingPolicy &Policy, unsigned Threads) {
+      printGroups(Policy, Threads);
+      std::size_t NumGroups = Groups.size();
+      Leaders.resize(NumGroups);
+      for(std::size_t i = 0; i < NumGroups; ++i)
+        Leaders[i] = i;
+      std::vector<bool> Owned(NumGroups, false);
+      // Join the groups that declare the same static name, and
+      // those that define the same external variable, since each
+      // tentative definition is a definition in its own file...
+      llvm::StringMap<std::size_t> LocalNames;
+      llvm::StringMap<std::size_t> ExternalVars;
+      for(std::size_t i = 0; i < NumGroups; ++i) {
+        if(!Groups[i])
+          continue;
+        for(DeclContext::decl_iterator iter = Groups[i]->decls_begin(), end = Groups[i]->decls_end(); iter != end; ++iter) {
+          NamedDecl *ND = dyn_cast<NamedDecl>(*iter);
+          if(ND && isLocalToPart(ND)) {
+            Owned[i] = true;
+            std::pair<llvm::StringMap<std::size_t>::iterator, bool> Inserted = LocalNames.insert(std::make_pair(ND->getName(), i));
+            if(!Inserted.second)
+              join(i, Inserted.first->second);
+          } else if(isDefinition(*iter)) {
+            Owned[i] = true;
+            if(isa<VarDecl>(*iter)) {
+              std::pair<llvm::StringMap<std::size_t>::iterator, bool> Inserted = ExternalVars.insert(std::make_pair(ND->getName(), i));
+              if(!Inserted.second)
+                join(i, Inserted.first->second);
+            }
+          }
+        }
+      }
+      // ...and the definitions that refer to one.  Copied function
+      // definitions have no body, so their text is searched for
+      // the names instead.
+      for(std::size_t i = 0; i < NumGroups; ++i) {
+        if(!Owned[i])
+          continue;
+        std::vector<Decl*> Refs;
+        CollectDeclRefs Collector(Refs);
+        Collector.TraverseDecl(Groups[i]);
+        for(std::vector<Decl*>::const_iterator iter = Refs.begin(), end = Refs.end(); iter != end; ++iter) {
+          NamedDecl *ND = dyn_cast<NamedDecl>(*iter);
+          if(ND && isLocalToPart(ND)) {
+            llvm::StringMap<std::size_t>::const_iterator pos = LocalNames.find(ND->getName());
+            if(pos != LocalNames.end())
+              join(i, pos->second);
+          }
+        }
+        for(DeclContext::decl_iterator iter = Groups[i]->decls_begin(), end = Groups[i]->decls_end(); iter != end; ++iter) {
+          StringRef Text = Helper.Trans.getVerbatimText(*iter);
+          for(std::size_t Pos = 0; Pos < Text.size();) {
+            std::size_t End = Pos;
+            while(End < Text.size() && is_ident_char()(Text[End]))
+              ++End;
+            llvm::StringMap<std::size_t>::const_iterator pos = LocalNames.find(Text.slice(Pos, End));
+            if(End != Pos && pos != LocalNames.end())
+              join(i, pos->second);
+            Pos = End == Pos? Pos + 1 : End;
+          }
+        }
+      }
+      std::vector<std::size_t> Sizes(NumGroups, 0);
+      std::vector<std::size_t> Sets;
+      for(std::size_t i = 0; i < NumGroups; ++i) {
+        if(!Owned[i])
+          continue;
+        std::size_t Leader = find(i);
+        if(Leader == i)
+          Sets.push_back(i);
+        Sizes[Leader] += Texts[i].size();
+      }
+      std::stable_sort(Sets.begin(), Sets.end(), [&](std::size_t A, std::size_t B) { return Sizes[A] > Sizes[B]; });
+      std::vector<std::size_t> PartSizes(NumParts, 0);
+      std::vector<int> SetParts(NumGroups, -1);
+      for(std::vector<std::size_t>::const_iterator iter = Sets.begin(), end = Sets.end(); iter != end; ++iter) {
+        std::size_t Part = std::min_element(PartSizes.begin(), PartSizes.end()) - PartSizes.begin();
+        SetParts[*iter] = Part;
+        PartSizes[Part] += Sizes[*iter];
+      }
+      Parts.assign(NumGroups, -1);
+      Stubs.assign(NumGroups, std::string());
+      for(std::size_t i = 0; i < NumGroups; ++i) {
+        if(!Owned[i])
+          continue;
+        Parts[i] = SetParts[find(i)];
+        llvm::raw_string_ostream StubOS(Stubs[i]);
+        for(DeclContext::decl_iterator iter = Groups[i]->decls_begin(), end = Groups[i]->decls_end(); iter != end; ++iter)
+          printStub(*iter, Policy, StubOS);
+      }
+    }
+    // Prints the groups of one file, after split
+    void printPart(llvm::raw_ostream &OS, unsigned Part) {
+      for(std::size_t i = 0; i < Groups.size(); ++i)
+        OS << (Parts[i] < 0 || unsigned(Parts[i]) == Part? Texts[i] : Stubs[i]);
+    }
+  private:
+    bool isDefinition(Decl *D) {
+      if(FunctionDecl *FD = dyn_cast<FunctionDecl>(D))
+        return FD->doesThisDeclarationHaveABody() || !Helper.Trans.getVerbatimText(FD).empty();
+      if(VarDecl *VD = dyn_cast<VarDecl>(D))
+        return VD->isThisDeclarationADefinition() != VarDecl::DeclarationOnly;
+      return false;
+    }
+    // Whether every use of D has to be in the file that defines it
+    static bool isLocalToPart(NamedDecl *D) {
+      if(FunctionDecl *FD = dyn_cast<FunctionDecl>(D))
+        return FD->getStorageClass() == SC_Static ||
+          (FD->isInlineSpecified() && FD->getStorageClass() != SC_Extern);
+      if(VarDecl *VD = dyn_cast<VarDecl>(D)) {
+        if(!VD->getDeclContext()->isFileContext())
+          return false;
+        if(VD->getStorageClass() == SC_Static)
+          return true;
+        // The type cannot be named in an extern declaration
+        QualType BaseType = GetBaseType(VD->getType());
+        if(const ElaboratedType *ET = dyn_cast<ElaboratedType>(BaseType))
+          BaseType = ET->getNamedType();
+        const TagType *TT = dyn_cast<TagType>(BaseType);
+        return TT && !TT->getDecl()->getIdentifier() && !TT->getDecl()->getTypedefNameForAnonDecl();
+      }
+      return false;
+    }
+    // What the other files see of a declaration in a group that
+    // one file defines
+    void printStub(Decl *D, const PrintingPolicy &Policy, llvm::raw_ostream &OS) {
+      NamedDecl *ND = dyn_cast<NamedDecl>(D);
+      if(ND && isLocalToPart(ND))
+        return;
+      if(isDefinition(D)) {
+        Helper.printExternDecl(cast<ValueDecl>(D), Policy, OS);
+        return;
+      }
+      D->print(OS, Policy);
+      OS << ";\n";
+    }
+    std::size_t find(std::size_t i) {
+      while(Leaders[i] != i)
+        i = Leaders[i] = Leaders[Leaders[i]];
+      return i;
+    }
+    // The group that comes first leads the set
+    void join(std::size_t A, std::size_t B) {
+      A = find(A);
+      B = find(B);
+      if(A > B)
+        std::swap(A, B);
+      Leaders[B] = A;
+    }
+    UPCPrintHelper &Helper;
+    std::vector<std::size_t> Leaders;
+    // The file of each group, or -1 for all of them, and what the
+    // other files print instead
+    std::vector<int> Parts;
+    std::vector<std::string> Stubs;
+  };
+
+  // The lowered text of function definitions, kept between
+  // translations of a file by -incremental-dir=.  A definition is
+  // copied if its fingerprint is unchanged and the names invented
+  // before it are numbered as they were, so that the output is the
+  // same as from lowering it again.
+  class IncrementalTranslation : public UnitCache {
+  public:
+    IncrementalTranslation(ASTContext &C, MacroUseRecorder &Macros, StringRef Key,
+                           IncrementalDeclEmitter &E, bool Lines)
+      : SM(C.getSourceManager()), Fingerprints(C, Macros), key(Key), Emitter(E), lines(Lines) {}
+
+    // The state file holds a header line, the key, and then one
+    // entry per definition: a line of fields followed by the file
+    // name and the text, whose lengths are the last two fields.
+    void load(StringRef Path) {
+      llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer> > File = llvm::MemoryBuffer::getFile(Path);
+      if(!File)
+        return;
+      StringRef Data = (*File)->getBuffer();
+      StringRef Line;
+      std::tie(Line, Data) = Data.split('\n');
+      if(Line != Magic)
+        return;
+      std::tie(Line, Data) = Data.split('\n');
+      if(Line != key)
+        return;
+      while(!Data.empty()) {
+        std::tie(Line, Data) = Data.split('\n');
+        llvm::SmallVector<StringRef, 10> Fields;
+        Line.split(Fields, ' ');
+        Entry E;
+        unsigned VAArg, OffsetOf, FileLength, TextLength;
+        if(Fields.size() != 10 ||
+           Fields[1].getAsInteger(10, E.Start.AnonRecordID) || Fields[2].getAsInteger(10, E.Start.StaticLocalVarID) ||
+           Fields[3].getAsInteger(10, E.End.AnonRecordID) || Fields[4].getAsInteger(10, E.End.StaticLocalVarID) ||
+           Fields[5].getAsInteger(10, VAArg) || Fields[6].getAsInteger(10, OffsetOf) ||
+           Fields[7].getAsInteger(10, E.Line) || Fields[8].getAsInteger(10, FileLength) ||
+           Fields[9].getAsInteger(10, TextLength) || Data.size() < std::size_t(FileLength) + TextLength) {
+          Entries.clear();
+          return;
+        }
+        E.Fingerprint = Fields[0].str();
+        E.End.VAArg = VAArg;
+        E.End.OffsetOf = OffsetOf;
+        E.File = Data.substr(0, FileLength).str();
+        E.Text = Data.substr(FileLength, TextLength).str();
+        Data = Data.drop_front(std::size_t(FileLength) + TextLength);
+        Entries[getEntryKey(E.Fingerprint, E.Start)] = std::move(E);
+      }
+    }
+
+    // Writes the definitions of this translation, replacing the
+    // state file atomically.
+    void save(StringRef Path) {
+      std::vector<std::string> UnitTexts;
+      std::vector<bool> HasText;
+      Emitter.getUnitTexts(UnitTexts, HasText);
+      if(llvm::sys::fs::create_directories(llvm::sys::path::parent_path(Path)))
+        return;
+      int FD;
+      llvm::SmallString<256> TempPath;
+      if(llvm::sys::fs::createUniqueFile(Path + "-%%%%%%%%.tmp", FD, TempPath))
+        return;
+      {
+        llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+        OS << Magic << "\n" << key << "\n";
+        for(std::size_t i = 0; i < Units.size(); ++i) {
+          const Entry &U = Units[i];
+          if(U.Fingerprint.empty() || i >= UnitTexts.size() || !HasText[i])
+            continue;
+          OS << U.Fingerprint << " " << U.Start.AnonRecordID << " " << U.Start.StaticLocalVarID << " "
+             << U.End.AnonRecordID << " " << U.End.StaticLocalVarID << " "
+             << (U.End.VAArg? 1 : 0) << " " << (U.End.OffsetOf? 1 : 0) << " " << U.Line << " "
+             << U.File.size() << " " << UnitTexts[i].size() << "\n" << U.File << UnitTexts[i];
+        }
+        if(OS.has_error()) {
+          OS.clear_error();
+          llvm::sys::fs::remove(TempPath);
+          return;
+        }
+      }
+      if(llvm::sys::fs::rename(TempPath, Path))
+        llvm::sys::fs::remove(TempPath);
+    }
+
+    virtual bool reuse(FunctionDecl *FD, UnitState &State) {
+      int Unit = Units.size();
+      Units.push_back(Entry());
+      Entry &U = Units.back();
+      U.Start = State;
+      PresumedLoc Presumed = SM.getPresumedLoc(SM.getExpansionLoc(FD->getBeginLoc()));
+      if(Presumed.isValid()) {
+        U.Fingerprint = Fingerprints.get(FD);
+        U.File = Presumed.getFilename();
+        U.Line = Presumed.getLine();
+      }
+      if(!U.Fingerprint.empty()) {
+        llvm::StringMap<Entry>::const_iterator pos = Entries.find(getEntryKey(U.Fingerprint, State));
+        if(pos != Entries.end() && pos->second.File == U.File) {
+          U.End = pos->second.End;
+          Emitter.emitText(Unit, lines? RebaseLineDirectives(pos->second.Text, U.File, int(U.Line) - int(pos->second.Line))
+                                      : pos->second.Text);
+          State = U.End;
+          return true;
+        }
+      }
+      Emitter.setUnit(Unit);
+      return false;
+    }
+    virtual void lowered(FunctionDecl *FD, const UnitState &Before, const UnitState &After, bool Reusable) {
+      Entry &U = Units.back();
+      U.End = After;
+      if(!Reusable)
+        U.Fingerprint.clear();
+      Emitter.setUnit(-1);
+    }
+  private:
+    struct Entry {
+      Entry() : Line(0) {}
+      std::string Fingerprint;
+      UnitState Start, End;
+      std::string File;
+      unsigned Line;
+      std::string Text;
+    };
+    static std::string getEntryKey(StringRef Fingerprint, const UnitState &Start) {
+      return (Fingerprint + " " + llvm::Twine(Start.AnonRecordID) + " " + llvm::Twine(Start.StaticLocalVarID)).str();
+    }
+    static const char Magic[];
+    SourceManager &SM;
+    DeclFingerprinter Fingerprints;
+    std::string key;
+    IncrementalDeclEmitter &Emitter;
+    bool lines;
+    llvm::StringMap<Entry> Entries;
+    // The function definitions of this translation, in order
+    std::vector<Entry> Units;
+  };
+  const char IncrementalTranslation::Magic[] = "clang-upc2c incremental 1";
+
+  // Settings for translating one file.
+  struct TranslationOptions {
+    TranslationOptions() : FileIdFromContent(false), Lines(true), PrintThreads(1),
+                           Profiler(0), Stats(0), Verbatim(false), StableNames(false), Compact(false), ABI(0), Program(0),
+                           SplitParts(1), SplitTexts(0), Preprocessed(false), VariantTexts(0), StripUnused(false) {}
+    // Makes the names of the per-file runtime hooks unique.  If it
+    // is not given, it is made from the input's name or contents.
+    std::string FileId;
+    bool FileIdFromContent;
+    // Emit #line directives
+    bool Lines;
+    // Threads for printing the transformed file.  The output is
+    // the same for any number, so it is not part of the cache key.
+    unsigned PrintThreads;
+    // Receives the timing of each phase, if set
+    PhaseProfiler *Profiler;
+    // Receives the transformation counters, if set
+    TransformStats *Stats;
+    // The state file of -incremental-dir=, and the key of the
+    // settings that its entries are valid for
+    std::string IncrementalFile;
+    std::string IncrementalKey;
+    // Copy function definitions without UPC constructs as they
+    // are written
+    bool Verbatim;
+    // Number the names invented for each top-level declaration
+    // separately
+    bool StableNames;
+    // Print less redundant C; see RemoveUPCTransform::enableCompact
+    // and LineDirectiveFilter
+    bool Compact;
+    // The runtime entry points to call, from -runtime-abi=.  The
+    // built-in table is used if it is not set.
+    const RuntimeABI *ABI;
+    // The call graph of the whole program, from -whole-program=
+    const ProgramSummary *Program;
+    // The number of C files to print the translation as, and the
+    // texts of the files when there is more than one
+    unsigned SplitParts;
+    std::vector<std::string> *SplitTexts;
+    // The input is the output of the preprocessor, with linemarkers
+    bool Preprocessed;
+    // The configurations to lower the parsed file for, "tld" or
+    // "notld", and the text of each
+    std::vector<std::string> Variants;
+    std::vector<std::string> *VariantTexts;
+    // Leave out the static declarations that nothing refers to
+    bool StripUnused;
+    // Adds the settings that affect the output, other than the
+    // file id, to a cache key.
+    void addToKey(std::vector<std::string> &Key) const {
+      Key.push_back(Lines? "lines" : "nolines");
+      Key.push_back(Verbatim? "verbatim" : "noverbatim");
+      Key.push_back(StableNames? "stablenames" : "nostablenames");
+      Key.push_back(Compact? "compact" : "nocompact");
+      if(ABI)
+        Key.push_back("abi " + ABI->getKey());
+      if(Program)
+        Key.push_back("program " + Program->getHash());
+      if(SplitParts > 1)
+        Key.push_back("split " + llvm::utostr(SplitParts));
+      if(Preprocessed)
+        Key.push_back("preprocessed");
+      if(!Variants.empty())
+        Key.push_back("variants " + llvm::join(Variants.begin(), Variants.end(), ","));
+      if(StripUnused)
+        Key.push_back("stripunused");
+    }
+  };
+
+  class RemoveUPCConsumer : public clang::SemaConsumer {
+  public:
+    // If OutputStream is given, the translation is written to it
+    // instead of to the file named by Output.
+    RemoveUPCConsumer(StringRef Output, const TranslationOptions &Options,
+                      llvm::raw_ostream *OutputStream = nullptr)
+      : Macros(0), filename(Output), opts(Options), Out(OutputStream) {}
+    virtual void HandleTranslationUnit(clang::ASTContext &Context) {
+      if(ParsePhase) {
+        ParsePhase.reset();
+      }
+      if(Context.getDiagnostics().hasUncompilableErrorOccurred())
+	return;
+
+      if(opts.VariantTexts) {
+        // The settings of each variant only matter after Sema, unless
+        // the code tests the threading model as it is preprocessed
+        if(Macros && Macros->getModelMacroUse().isValid()) {
+          DiagnosticsEngine &Diags = Context.getDiagnostics();
+          Diags.Report(Macros->getModelMacroUse(),
+                       Diags.getCustomDiagID(DiagnosticsEngine::Error,
+                                             "-variants= cannot translate code that uses the threading model macro '%0'"))
+            << Macros->getModelMacro();
+          return;
+        }
+        opts.VariantTexts->assign(opts.Variants.size(), std::string());
+        for(std::size_t i = 0; i < opts.Variants.size(); ++i) {
+          PhaseScope Phase(opts.Profiler, "Variant", opts.Variants[i]);
+          LangOptions LangOpts = Context.getLangOpts();
+          LangOpts.UPCTLDEnable = opts.Variants[i] == "tld";
+          llvm::raw_string_ostream VariantOS((*opts.VariantTexts)[i]);
+          Translate(Context, LangOpts, VariantOS);
+        }
+        return;
+      }
+      std::error_code error;
+      std::unique_ptr<llvm::raw_fd_ostream> File;
+      if(!Out)
+        File.reset(new llvm::raw_fd_ostream(filename.c_str(), error, llvm::sys::fs::F_None));
+      LangOptions LangOpts = Context.getLangOpts();
+      Translate(Context, LangOpts, Out? *Out : *File);
+    }
+    // Lowers the parsed translation unit with LangOpts, which the
+    // new ASTContext refers to, and prints it to Output.
+    void Translate(ASTContext &Context, LangOptions &LangOpts, llvm::raw_ostream &Output) {
+      TranslationUnitDecl *top = Context.getTranslationUnitDecl();
+      // Copy the ASTContext and Sema
+      ASTContext newContext(LangOpts, Context.getSourceManager(),
+			    Context.Idents, Context.Selectors, Context.BuiltinInfo);
+      newContext.InitBuiltinTypes(Context.getTargetInfo());
+      newContext.getDiagnostics().setIgnoreAllWarnings(true);
+      ASTConsumer nullConsumer;
+      UPCRDecls Decls(newContext, opts.ABI? *opts.ABI : RuntimeABI::getDefault());
+      Sema newSema(S->getPreprocessor(), newContext, nullConsumer);
+      RemoveUPCTransform Trans(newSema, &Decls, opts.FileId);
+      Trans.setProfiler(opts.Profiler);
+      if(opts.StableNames)
+        Trans.enableStableNames();
+      if(opts.Compact)
+        Trans.enableCompact();
+      if(opts.Stats)
+        Trans.enableCallCounts();
+      Trans.setProgram(opts.Program);
+      if(opts.Preprocessed)
+        Trans.enablePreprocessedInput();
+
+      PrintingPolicy Policy = newContext.getPrintingPolicy();
+      //
+      // Adjust the printing policy to NOT print the source location for
+      // anonymous tags.  In Clang 9.0.1, this is true by default
+      //
+      Policy.AnonymousTagLocations = false;
+      UPCPrintHelper helper(Trans);
+      Policy.IncludeLineDirectives = opts.Lines;
+      Policy.SM = &newContext.getSourceManager();
+      Policy.Helper = &helper;
+
+      std::unique_ptr<LineDirectiveFilter> Filter;
+      if(opts.Compact && opts.Lines)
+        Filter.reset(new LineDirectiveFilter(Output));
+      llvm::raw_ostream &OS = Filter? *Filter : Output;
+      if(opts.Verbatim)
+        Trans.setVerbatim(Macros, opts.Lines);
+      if(!opts.IncrementalFile.empty()) {
+        IncrementalDeclEmitter Emitter(newContext);
+        IncrementalTranslation Incremental(Context, *Macros,
+                                           opts.IncrementalKey + (LangOpts.UPCTLDEnable? " tld" : " notld"),
+                                           Emitter, opts.Lines);
+        {
+          PhaseScope Phase(opts.Profiler, "IncrementalLoad");
+          Incremental.load(opts.IncrementalFile);
+        }
+        Trans.setEmitter(&Emitter);
+        Trans.setUnitCache(&Incremental);
+        {
+          PhaseScope Phase(opts.Profiler, "Transform");
+          Trans.TransformTranslationUnitDecl(top);
+        }
+        {
+          PhaseScope Phase(opts.Profiler, "Print");
+          PrintHeader(OS, Trans, LangOpts);
+          Emitter.print(OS, Policy, opts.Lines? 1 : opts.PrintThreads);
+        }
+        PhaseScope Phase(opts.Profiler, "IncrementalSave");
+        Incremental.save(opts.IncrementalFile);
+      } else if(opts.SplitTexts) {
+        SplitDeclEmitter Emitter(newContext, helper);
+        Trans.setEmitter(&Emitter);
+        {
+          PhaseScope Phase(opts.Profiler, "Transform");
+          Trans.TransformTranslationUnitDecl(top);
+        }
+        if(opts.StripUnused)
+          StripUnused(Emitter, Trans);
+        PhaseScope Phase(opts.Profiler, "Print");
+        Emitter.split(opts.SplitParts, Policy, opts.Lines? 1 : opts.PrintThreads);
+        opts.SplitTexts->assign(opts.SplitParts, std::string());
+        for(unsigned i = 0; i < opts.SplitParts; ++i) {
+          llvm::raw_string_ostream PartOS((*opts.SplitTexts)[i]);
+          std::unique_ptr<LineDirectiveFilter> PartFilter;
+          if(opts.Compact && opts.Lines)
+            PartFilter.reset(new LineDirectiveFilter(PartOS));
+          llvm::raw_ostream &POS = PartFilter? *PartFilter : PartOS;
+          PrintHeader(POS, Trans, LangOpts);
+          Emitter.printPart(POS, i);
+        }
+      } else if((opts.PrintThreads > 1 && !opts.Lines) || opts.StripUnused) {
+        ParallelDeclEmitter Emitter(newContext);
+        Trans.setEmitter(&Emitter);
+        {
+          PhaseScope Phase(opts.Profiler, "Transform");
+          Trans.TransformTranslationUnitDecl(top);
+        }
+        if(opts.StripUnused)
+          StripUnused(Emitter, Trans);
+        PhaseScope Phase(opts.Profiler, "Print");
+        PrintHeader(OS, Trans, LangOpts);
+        Emitter.print(OS, Policy, opts.Lines? 1 : opts.PrintThreads);
+      } else {
+        Decl *Result;
+        {
+          PhaseScope Phase(opts.Profiler, "Transform");
+          Result = Trans.TransformTranslationUnitDecl(top);
+        }
+        PhaseScope Phase(opts.Profiler, "Print");
+        PrintHeader(OS, Trans, LangOpts);
+        Result->print(OS, Policy);
+      }
+      if(opts.Stats) {
+        *opts.Stats = Trans.Stats;
+        opts.Stats->Collected = true;
+      }
+    }
+    void StripUnused(ParallelDeclEmitter &Emitter, RemoveUPCTransform &Trans) {
+      PhaseScope Phase(opts.Profiler, "StripUnused");
+      FindUnusedGroups Finder(Emitter.getGroups(), Trans);
+      Trans.Stats.UnusedDecls += Emitter.leaveOut(Finder.find());
+    }
+    // Parsing, with preprocessing and Sema, runs from the start
+    // of the action until the translation unit is complete.
+    std::unique_ptr<PhaseScope> ParsePhase;
+    // Set for -incremental-dir= and -verbatim-c.  Owned by the
+    // preprocessor.
+    MacroUseRecorder *Macros;
+    void PrintHeader(llvm::raw_ostream &OS, RemoveUPCTransform &Trans, const LangOptions &LangOpts) {
+      OS << "#include <upcr.h>\n";
+
+      Trans.PrintIncludes(OS);
+
+      OS << "#ifndef UPCR_TRANS_EXTRA_INCL\n"
 	"#define UPCR_TRANS_EXTRA_INCL\n";
       if (Trans.HaveVAArg()) { // subclass of Expr - cannot be renamed directly
         OS <<
@@ -2622,82 +4823,1858 @@ namespace {
 	"      { &(sptr), (blockbytes), (numblocks), (mult_by_threads), (elemsz), #sptr, (typestr) }\n"
 	"#define UPCRT_STARTUP_PSHALLOC UPCRT_STARTUP_SHALLOC\n"
 	"#endif\n";
-
-      PrintingPolicy Policy = newContext.getPrintingPolicy();
-      //
-      // Adjust the printing policy to NOT print the source location for
-      // anonymous tags.  In Clang 9.0.1, this is true by default
-      //
-      Policy.AnonymousTagLocations = false;
-      UPCPrintHelper helper(Trans);
-      Policy.IncludeLineDirectives = lines;
-      Policy.SM = &newContext.getSourceManager();
-      Policy.Helper = &helper;
-      Result->print(OS, Policy);
     }
     void InitializeSema(Sema& SemaRef) { S = &SemaRef; }
     void ForgetSema() { S = 0; }
   private:
     Sema *S;
     std::string filename;
-    std::string fileid;
-    bool lines;
+    TranslationOptions opts;
+    llvm::raw_ostream *Out;
   };
 
   class RemoveUPCAction : public clang::ASTFrontendAction {
   public:
-    RemoveUPCAction(StringRef OutputFile, StringRef FileString, bool Lines) : filename(OutputFile), fileid(FileString), lines(Lines) {}
+    RemoveUPCAction(StringRef OutputFile, const TranslationOptions &Options,
+                    llvm::raw_ostream *OutputStream = nullptr)
+      : filename(OutputFile), opts(Options), Out(OutputStream) {}
     virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance &Compiler, llvm::StringRef InFile) {
-      return std::unique_ptr<ASTConsumer>(new RemoveUPCConsumer(filename, fileid, lines));
+      RemoveUPCConsumer *Consumer = new RemoveUPCConsumer(filename, opts, Out);
+      if(opts.Profiler)
+        Consumer->ParsePhase.reset(new PhaseScope(opts.Profiler, "Parse"));
+      if(!opts.IncrementalFile.empty() || opts.Verbatim || opts.VariantTexts) {
+        Consumer->Macros = new MacroUseRecorder(Compiler.getPreprocessor());
+        Compiler.getPreprocessor().addPPCallbacks(std::unique_ptr<PPCallbacks>(Consumer->Macros));
+      }
+      return std::unique_ptr<ASTConsumer>(Consumer);
     }
     std::string filename;
-    std::string fileid;
-    bool lines;
+    TranslationOptions opts;
+    llvm::raw_ostream *Out;
   };
 
 }
 
-int main(int argc, const char ** argv) {
-  using namespace llvm::opt;
-  using namespace clang::driver;
+namespace {
 
-  // Parse the arguments
-  std::unique_ptr<OptTable> Opts(createDriverOptTable());
-  unsigned MissingArgIndex, MissingArgCount;
-  const unsigned IncludedFlagsBitmask = options::CC1Option;
-  InputArgList Args(
-      Opts->ParseArgs(llvm::makeArrayRef(argv, argc),
-                      MissingArgIndex, MissingArgCount, IncludedFlagsBitmask));
-
-  // Read the input and output files and adjust the arguments
-  std::string InputFile = Args.getLastArgValue(options::OPT_INPUT);
-  std::string DefaultOutputFile = (llvm::sys::path::stem(InputFile) + ".trans.c").str();
-  std::string OutputFile = Args.getLastArgValue(options::OPT_o, DefaultOutputFile);
-  Args.eraseArg(options::OPT_o);
-
-  bool Lines = !Args.hasArg(options::OPT_P);
-  Args.eraseArg(options::OPT_P);
-
-  // Write the arguments to a vector
-  ArgStringList NewOptions;
-
-  for(auto iter = Args.begin(), end = Args.end(); iter != end; ++iter) {
-    // Always parse as UPC
-    if((*iter)->getOption().getID() == options::OPT_INPUT &&
-       iter != Args.begin()) {
-      NewOptions.push_back("-xupc");
+  // Options understood by clang-upc2c itself.  These are removed from
+  // the command line before the remaining arguments reach the driver.
+  struct TranslatorOptions {
+    TranslatorOptions() : Jobs(1), CacheStats(false), TimeReport(false), PrintStats(false), WriteIfChanged(false) {}
+    unsigned Jobs;
+    std::string CompileCommands;
+    // Socket to listen on (-server=) or to forward to (-use-server=)
+    std::string ServerSocket;
+    std::string UseServer;
+    // Directories whose contents do not change while a server runs
+    std::vector<std::string> StableDirs;
+    // Where precompiled -include preambles are kept
+    std::string PCHDir;
+    // Where translated files are cached, and whether to report
+    // the cache hits and misses
+    std::string CacheDir;
+    bool CacheStats;
+    // Where the lowered function definitions of each file are
+    // kept for the next translation of the file
+    std::string IncrementalDir;
+    // Defaults for each file translated
+    TranslationOptions Translation;
+    // Print a summary of the time spent in each phase, and/or
+    // write a Chrome trace of the phases to a file
+    bool TimeReport;
+    std::string TimeTrace;
+    // Print the transformation counters, and/or write them
+    // to a JSON file
+    bool PrintStats;
+    std::string StatsFile;
+    // Shell command that reads each translation on its standard
+    // input (-pipe-to=), instead of it being written to a file.
+    // -pipe-to='clang -xc -c -o %s.o -' compiles each file
+    // without writing the C out; upcr.h must be on its path.
+    std::string PipeTo;
+    // Leave output files whose contents would not change untouched
+    bool WriteIfChanged;
+    // Changes to the runtime entry points; see RuntimeABI
+    std::string RuntimeABIFile;
+    // Translate the inputs as one program, and write the unit
+    // that allocates and initializes their shared data here
+    std::string ProgramUnit;
+  };
+
+  bool ParseTranslatorOptions(llvm::ArrayRef<const char *> Argv, TranslatorOptions &ToolOpts,
+                              llvm::SmallVectorImpl<const char *> &ClangArgv,
+                              llvm::raw_ostream &Errs) {
+    for(std::size_t i = 0; i < Argv.size(); ++i) {
+      StringRef Arg = Argv[i];
+      if(i != 0 && (Arg == "-j" || (Arg.startswith("-j") && std::isdigit(Arg[2])))) {
+        StringRef Value = Arg.substr(2);
+        if(Value.empty()) {
+          if(i + 1 == Argv.size()) {
+            Errs << "clang-upc2c: argument to '-j' is missing\n";
+            return false;
+          }
+          Value = Argv[++i];
+        }
+        if(Value.getAsInteger(10, ToolOpts.Jobs) || ToolOpts.Jobs == 0) {
+          Errs << "clang-upc2c: invalid job count '" << Value << "'\n";
+          return false;
+        }
+      } else if(Arg.consume_front("-compile-commands=")) {
+        ToolOpts.CompileCommands = Arg.str();
+      } else if(Arg.consume_front("-server=")) {
+        ToolOpts.ServerSocket = Arg.str();
+      } else if(Arg.consume_front("-use-server=")) {
+        ToolOpts.UseServer = Arg.str();
+      } else if(Arg.consume_front("-server-stable-dir=")) {
+        ToolOpts.StableDirs.push_back(Arg.str());
+      } else if(Arg.consume_front("-pch-dir=")) {
+        ToolOpts.PCHDir = Arg.str();
+      } else if(Arg.consume_front("-cache-dir=")) {
+        ToolOpts.CacheDir = Arg.str();
+      } else if(Arg == "-cache-stats") {
+        ToolOpts.CacheStats = true;
+      } else if(Arg.consume_front("-incremental-dir=")) {
+        ToolOpts.IncrementalDir = Arg.str();
+      } else if(Arg.consume_front("-variants=")) {
+        llvm::SmallVector<StringRef, 4> Names;
+        Arg.split(Names, ',');
+        for(llvm::SmallVectorImpl<StringRef>::const_iterator iter = Names.begin(), end = Names.end(); iter != end; ++iter) {
+          if((*iter != "tld" && *iter != "notld") ||
+             std::find(ToolOpts.Translation.Variants.begin(), ToolOpts.Translation.Variants.end(), *iter) != ToolOpts.Translation.Variants.end()) {
+            Errs << "clang-upc2c: invalid variant '" << *iter << "'\n";
+            return false;
+          }
+          ToolOpts.Translation.Variants.push_back(iter->str());
+        }
+      } else if(Arg == "-preprocessed") {
+        ToolOpts.Translation.Preprocessed = true;
+      } else if(Arg == "-verbatim-c") {
+        ToolOpts.Translation.Verbatim = true;
+      } else if(Arg.consume_front("-file-id=")) {
+        if(Arg.empty() || std::find_if(Arg.begin(), Arg.end(), std::not1(is_ident_char())) != Arg.end()) {
+          Errs << "clang-upc2c: invalid file id '" << Arg << "'\n";
+          return false;
+        }
+        ToolOpts.Translation.FileId = Arg.str();
+      } else if(Arg == "-file-id-from-content") {
+        ToolOpts.Translation.FileIdFromContent = true;
+      } else if(Arg == "-compact") {
+        ToolOpts.Translation.Compact = true;
+      } else if(Arg == "-stable-names") {
+        ToolOpts.Translation.StableNames = true;
+      } else if(Arg == "-strip-unused") {
+        ToolOpts.Translation.StripUnused = true;
+      } else if(Arg == "-write-if-changed") {
+        ToolOpts.WriteIfChanged = true;
+      } else if(Arg.consume_front("-runtime-abi=")) {
+        ToolOpts.RuntimeABIFile = Arg.str();
+      } else if(Arg.consume_front("-whole-program=")) {
+        ToolOpts.ProgramUnit = Arg.str();
+      } else if(Arg.consume_front("-split=")) {
+        if(Arg.getAsInteger(10, ToolOpts.Translation.SplitParts) || ToolOpts.Translation.SplitParts == 0) {
+          Errs << "clang-upc2c: invalid file count '" << Arg << "'\n";
+          return false;
+        }
+      } else if(Arg.consume_front("-print-threads=")) {
+        if(Arg.getAsInteger(10, ToolOpts.Translation.PrintThreads) || ToolOpts.Translation.PrintThreads == 0) {
+          Errs << "clang-upc2c: invalid thread count '" << Arg << "'\n";
+          return false;
+        }
+      } else if(Arg == "-time-report") {
+        ToolOpts.TimeReport = true;
+      } else if(Arg.consume_front("-time-trace=")) {
+        ToolOpts.TimeTrace = Arg.str();
+      } else if(Arg == "-print-stats") {
+        ToolOpts.PrintStats = true;
+      } else if(Arg.consume_front("-stats-file=")) {
+        ToolOpts.StatsFile = Arg.str();
+      } else if(Arg.consume_front("-pipe-to=")) {
+#ifndef LLVM_ON_UNIX
+        Errs << "clang-upc2c: -pipe-to= is not supported on this platform\n";
+        return false;
+#endif
+        ToolOpts.PipeTo = Arg.str();
+      } else {
+        ClangArgv.push_back(Argv[i]);
+      }
+    }
+    // Nothing can be left out once it has been printed
+    if(ToolOpts.Translation.StripUnused && !ToolOpts.IncrementalDir.empty()) {
+      Errs << "clang-upc2c: -strip-unused and -incremental-dir= cannot be used together\n";
+      return false;
+    }
+    if(ToolOpts.Translation.SplitParts > 1 || !ToolOpts.Translation.Variants.empty()) {
+      const char *Option = ToolOpts.Translation.SplitParts > 1? "-split=" : "-variants=";
+      const char *Other = 0;
+      if(ToolOpts.Translation.SplitParts > 1 && !ToolOpts.Translation.Variants.empty())
+        Other = "-variants=";
+      else if(!ToolOpts.IncrementalDir.empty())
+        Other = "-incremental-dir=";
+      else if(!ToolOpts.CacheDir.empty())
+        Other = "-cache-dir=";
+      else if(!ToolOpts.PipeTo.empty())
+        Other = "-pipe-to=";
+      if(Other) {
+        Errs << "clang-upc2c: " << Option << " and " << Other << " cannot be used together\n";
+        return false;
+      }
     }
-    (*iter)->renderAsInput(Args, NewOptions);
+    return true;
+  }
+
+  // One input file to be translated.  Args holds the driver
+  // options other than the -include files and the input.
+  struct TranslationJob {
+    TranslationJob() : Diags(nullptr) {}
+    std::vector<std::string> Args;
+    std::vector<std::string> Includes;
+    std::string InputFile;
+    std::string OutputFile;
+    std::string WorkingDir;
+    TranslationOptions Options;
+    // Receives the compiler's diagnostics instead of DiagOS, if set
+    DiagnosticConsumer *Diags;
+  };
+
+  std::string MakeAbsolute(StringRef WorkingDir, StringRef Path) {
+    llvm::SmallString<256> Result(Path);
+    if(!WorkingDir.empty())
+      llvm::sys::fs::make_absolute(WorkingDir, Result);
+    return Result.str().str();
   }
-  // Disable CodeGen
-  NewOptions.push_back("-fsyntax-only");
 
-  // convert to std::string
-  std::vector<std::string> options(NewOptions.begin(), NewOptions.end());
+  // Splits a clang-upc2c command line into one job per input.
+  // If WorkingDir is non-empty, relative paths are resolved
+  // against it instead of the current directory.
+  bool CreateTranslationJobs(llvm::opt::OptTable &Opts, llvm::ArrayRef<const char *> Argv,
+                             StringRef WorkingDir, bool AllowOutput,
+                             const TranslationOptions &Defaults,
+                             std::vector<TranslationJob> &Jobs, llvm::raw_ostream &Errs) {
+    using namespace llvm::opt;
+    using namespace clang::driver;
+
+    unsigned MissingArgIndex, MissingArgCount;
+    const unsigned IncludedFlagsBitmask = options::CC1Option;
+    InputArgList Args(
+        Opts.ParseArgs(Argv, MissingArgIndex, MissingArgCount, IncludedFlagsBitmask));
+
+    std::string OutputFile = AllowOutput? Args.getLastArgValue(options::OPT_o) : "";
+    Args.eraseArg(options::OPT_o);
+
+    bool Lines = !Args.hasArg(options::OPT_P);
+    Args.eraseArg(options::OPT_P);
 
-  FileManager * Files(new FileManager(FileSystemOptions()));
-  ToolInvocation tool(options, new RemoveUPCAction(OutputFile, get_file_id(InputFile), Lines), Files);
-  if(tool.run()) {
+    // Write the arguments other than the inputs to a vector.
+    // The program name parses as the first input.
+    ArgStringList CommonOptions;
+    std::vector<std::string> Inputs;
+    std::vector<std::string> Includes;
+    for(auto iter = Args.begin(), end = Args.end(); iter != end; ++iter) {
+      if((*iter)->getOption().getID() == options::OPT_INPUT &&
+         iter != Args.begin()) {
+        Inputs.push_back((*iter)->getValue());
+        continue;
+      }
+      if((*iter)->getOption().getID() == options::OPT_include) {
+        Includes.push_back((*iter)->getValue());
+        continue;
+      }
+      (*iter)->renderAsInput(Args, CommonOptions);
+    }
+
+    if(Inputs.empty()) {
+      Errs << "clang-upc2c: no input files\n";
+      return false;
+    }
+    if(!OutputFile.empty() && Inputs.size() > 1) {
+      Errs << "clang-upc2c: cannot specify -o when translating multiple files\n";
+      return false;
+    }
+
+    for(std::vector<std::string>::const_iterator iter = Inputs.begin(), end = Inputs.end(); iter != end; ++iter) {
+      TranslationJob Job;
+      Job.InputFile = MakeAbsolute(WorkingDir, *iter);
+      std::string DefaultOutputFile = (llvm::sys::path::stem(*iter) + ".trans.c").str();
+      // -o - writes to stdout.
+      if(OutputFile == "-")
+        Job.OutputFile = OutputFile;
+      else
+        Job.OutputFile = MakeAbsolute(WorkingDir, OutputFile.empty()? DefaultOutputFile : OutputFile);
+      // The file id depends only on the name as written, or on
+      // the contents of the file, so that every way of running a
+      // job gives the same output.
+      Job.Options = Defaults;
+      if(Job.Options.FileId.empty()) {
+        std::unique_ptr<llvm::MemoryBuffer> Contents;
+        if(Defaults.FileIdFromContent) {
+          llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer> > File = llvm::MemoryBuffer::getFile(Job.InputFile);
+          if(File)
+            Contents = std::move(*File);
+        }
+        Job.Options.FileId = get_file_id(*iter, Contents? Contents->getBuffer() : StringRef(*iter));
+      }
+      Job.Options.Lines = Lines;
+      Job.WorkingDir = WorkingDir.str();
+      Job.Args.assign(CommonOptions.begin(), CommonOptions.end());
+      Job.Includes = Includes;
+      Jobs.push_back(Job);
+    }
+    return true;
+  }
+
+  bool CreateJobsFromCompilationDatabase(llvm::opt::OptTable &Opts, StringRef Path,
+                                         const TranslationOptions &Defaults,
+                                         std::vector<TranslationJob> &Jobs,
+                                         llvm::raw_ostream &Errs) {
+    std::string ErrorMessage;
+    std::unique_ptr<JSONCompilationDatabase> Database =
+      JSONCompilationDatabase::loadFromFile(Path, ErrorMessage, JSONCommandLineSyntax::AutoDetect);
+    if(!Database) {
+      Errs << "clang-upc2c: " << ErrorMessage << "\n";
+      return false;
+    }
+    std::vector<CompileCommand> Commands = Database->getAllCompileCommands();
+    for(std::vector<CompileCommand>::const_iterator iter = Commands.begin(), end = Commands.end(); iter != end; ++iter) {
+      std::vector<const char *> Argv;
+      for(std::vector<std::string>::const_iterator arg = iter->CommandLine.begin(), arg_end = iter->CommandLine.end(); arg != arg_end; ++arg) {
+        Argv.push_back(arg->c_str());
+      }
+      // The -o of a compile command names the object file, not
+      // the translated output, so it is ignored.
+      if(!CreateTranslationJobs(Opts, Argv, iter->Directory, false, Defaults, Jobs, Errs))
+        return false;
+    }
+    return true;
+  }
+
+  // Remembers status() results, including failures, for paths under
+  // directories that do not change while a translation server is
+  // running.  Header search probes the same system directories for
+  // every request; other paths always go to the real file system.
+  class StableStatCacheFS : public llvm::vfs::ProxyFileSystem {
+  public:
+    StableStatCacheFS(llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS,
+                      const std::vector<std::string> &Dirs)
+      : ProxyFileSystem(FS), StableDirs(Dirs) {}
+    llvm::ErrorOr<llvm::vfs::Status> status(const llvm::Twine &Path) override {
+      llvm::SmallString<256> Name;
+      Path.toVector(Name);
+      if(!isStable(Name))
+        return ProxyFileSystem::status(Path);
+      {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        llvm::StringMap<CachedStatus>::const_iterator pos = Cache.find(Name);
+        if(pos != Cache.end()) {
+          if(pos->second.Error)
+            return pos->second.Error;
+          return pos->second.Value;
+        }
+      }
+      llvm::ErrorOr<llvm::vfs::Status> Result = ProxyFileSystem::status(Path);
+      CachedStatus Entry;
+      if(Result)
+        Entry.Value = *Result;
+      else
+        Entry.Error = Result.getError();
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Cache[Name] = Entry;
+      return Result;
+    }
+  private:
+    struct CachedStatus {
+      llvm::vfs::Status Value;
+      std::error_code Error;
+    };
+    bool isStable(StringRef Path) const {
+      if(!llvm::sys::path::is_absolute(Path))
+        return false;
+      for(std::vector<std::string>::const_iterator iter = StableDirs.begin(), end = StableDirs.end(); iter != end; ++iter) {
+        StringRef Dir = *iter;
+        if(!Path.startswith(Dir))
+          continue;
+        // /usr/lib must not match /usr/lib64
+        if(Path.size() == Dir.size() || llvm::sys::path::is_separator(Dir.back()) ||
+           llvm::sys::path::is_separator(Path[Dir.size()]))
+          return true;
+      }
+      return false;
+    }
+    std::vector<std::string> StableDirs;
+    llvm::StringMap<CachedStatus> Cache;
+    std::mutex Mutex;
+  };
+
+  // Builds the driver command line for a job.  If Preamble names
+  // a precompiled header, it replaces the -include files.  Input
+  // that has been preprocessed already holds the -include files,
+  // and needs no predefined macros.
+  std::vector<std::string> GetCommandLine(const TranslationJob &Job, StringRef Preamble) {
+    std::vector<std::string> Args(Job.Args);
+    if(Job.Options.Preprocessed) {
+      Args.push_back("-undef");
+    } else if(Preamble.empty()) {
+      for(std::vector<std::string>::const_iterator iter = Job.Includes.begin(), end = Job.Includes.end(); iter != end; ++iter) {
+        Args.push_back("-include");
+        Args.push_back(*iter);
+      }
+    } else {
+      Args.push_back("-include-pch");
+      Args.push_back(Preamble);
+    }
+    // Always parse as UPC
+    Args.push_back("-xupc");
+    Args.push_back(Job.InputFile);
+    // Disable CodeGen
+    Args.push_back("-fsyntax-only");
+    return Args;
+  }
+
+  // Writes Text to Path through a temporary file, so that other
+  // processes never see part of it.
+  std::error_code WriteFileAtomically(const std::string &Path, StringRef Text) {
+    int FD;
+    llvm::SmallString<256> TempPath;
+    if(std::error_code error = llvm::sys::fs::createUniqueFile(Path + "-%%%%%%%%.tmp", FD, TempPath))
+      return error;
+    {
+      llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+      OS << Text;
+      OS.close();
+      if(OS.has_error()) {
+        std::error_code error = OS.error();
+        OS.clear_error();
+        llvm::sys::fs::remove(TempPath);
+        return error;
+      }
+    }
+    if(std::error_code error = llvm::sys::fs::rename(TempPath, Path)) {
+      llvm::sys::fs::remove(TempPath);
+      return error;
+    }
+    return std::error_code();
+  }
+
+  // Writes a precompiled header to a fixed file, regardless
+  // of the -o on the command line, and records the files that
+  // went into it.
+  class BuildPreambleAction : public GeneratePCHAction {
+  public:
+    BuildPreambleAction(StringRef OutputFile, StringRef WorkingDir, std::vector<std::string> &Inputs)
+      : filename(OutputFile), workingDir(WorkingDir), inputs(Inputs) {}
+    virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance &Compiler, llvm::StringRef InFile) {
+      Compiler.getFrontendOpts().OutputFile = filename;
+      Compiler.getPreprocessor().addPPCallbacks(std::unique_ptr<PPCallbacks>(
+        new RecordInputs(Compiler.getSourceManager(), workingDir, inputs)));
+      return GeneratePCHAction::CreateASTConsumer(Compiler, InFile);
+    }
+    std::string filename;
+  private:
+    class RecordInputs : public PPCallbacks {
+    public:
+      RecordInputs(SourceManager &S, StringRef W, std::vector<std::string> &I) : SM(S), WorkingDir(W), Inputs(I) {}
+      virtual void FileChanged(SourceLocation Loc, FileChangeReason Reason, SrcMgr::CharacteristicKind FileType,
+                               FileID PrevFID) {
+        if(Reason != EnterFile)
+          return;
+        const FileEntry *File = SM.getFileEntryForID(SM.getFileID(Loc));
+        if(File && SM.getFileID(Loc) != SM.getMainFileID())
+          Inputs.push_back(MakeAbsolute(WorkingDir, File->getName()));
+      }
+    private:
+      SourceManager &SM;
+      std::string WorkingDir;
+      std::vector<std::string> &Inputs;
+    };
+    std::string workingDir;
+    std::vector<std::string> &inputs;
+  };
+
+  // Precompiled headers for the -include prefix (upcr.h and the
+  // UPC preincludes) that every translation parses first.  One is
+  // built per configuration: the driver options, which carry the
+  // target and the TLD setting, and the -include files.  The hash
+  // of every header that went into it is kept beside it and checked
+  // through the job's file system before each use, so that a header
+  // changed on disk or in memory causes a rebuild.
+  class PreambleCache {
+  public:
+    // Returns the precompiled header to use for Job, building it if
+    // needed, or the empty string if the -include files should be
+    // parsed normally.
+    std::string getPreamble(StringRef Dir, const TranslationJob &Job,
+                            llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS,
+                            llvm::raw_ostream *DiagOS) {
+      if(Dir.empty() || Job.Includes.empty() || Job.Options.Preprocessed)
+        return "";
+      if(!FS)
+        FS = llvm::vfs::getRealFileSystem();
+      std::vector<std::string> Key;
+      Key.push_back(UPC2CVersion);
+      Key.insert(Key.end(), Job.Args.begin(), Job.Args.end());
+      for(std::vector<std::string>::const_iterator iter = Job.Includes.begin(), end = Job.Includes.end(); iter != end; ++iter)
+        Key.push_back(MakeAbsolute(Job.WorkingDir, *iter));
+      std::string Base = MakeAbsolute(Job.WorkingDir, (Dir + "/upc2c-" + HashStrings(Key)).str());
+      std::string PCHFile = Base + ".pch";
+
+      // Jobs with the same configuration wait for a single build;
+      // other configurations go ahead.
+      Entry &E = getEntry(PCHFile);
+      std::lock_guard<std::mutex> Lock(E.Mutex);
+      std::string Inputs;
+      if(isUpToDate(Base, *FS, Inputs)) {
+        if(Inputs == E.Loaded)
+          return PCHFile;
+        if(canLoad(Base, PCHFile, Job, FS)) {
+          E.Loaded = Inputs;
+          return PCHFile;
+        }
+      }
+      // Any failure falls back to parsing the -include files
+      E.Loaded.clear();
+      if(!build(Base, PCHFile, Job, FS, DiagOS) || !isUpToDate(Base, *FS, Inputs) ||
+         !canLoad(Base, PCHFile, Job, FS))
+        return "";
+      E.Loaded = Inputs;
+      return PCHFile;
+    }
+  private:
+    struct Entry {
+      std::mutex Mutex;
+      // The inputs file of the preamble last loaded successfully
+      std::string Loaded;
+    };
+    Entry &getEntry(const std::string &PCHFile) {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      std::unique_ptr<Entry> &Result = Entries[PCHFile];
+      if(!Result)
+        Result.reset(new Entry);
+      return *Result;
+    }
+    static std::string HashFile(llvm::vfs::FileSystem &FS, const std::string &Path) {
+      llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer> > Buffer = FS.getBufferForFile(Path);
+      if(!Buffer)
+        return "";
+      llvm::MD5 Hash;
+      Hash.update((*Buffer)->getBuffer());
+      llvm::MD5::MD5Result Result;
+      Hash.final(Result);
+      llvm::SmallString<32> Hex;
+      llvm::MD5::stringifyResult(Result, Hex);
+      return Hex.str().str();
+    }
+    // Whether every header in the inputs file, a line of hash and
+    // path for each, still has the recorded contents.  Inputs is
+    // set to the text of the file.
+    static bool isUpToDate(StringRef Base, llvm::vfs::FileSystem &FS, std::string &Inputs) {
+      llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer> > File = llvm::MemoryBuffer::getFile(Base + ".inputs");
+      if(!File)
+        return false;
+      Inputs = (*File)->getBuffer().str();
+      StringRef Data = Inputs;
+      if(Data.empty())
+        return false;
+      while(!Data.empty()) {
+        StringRef Line, Hash, Path;
+        std::tie(Line, Data) = Data.split('\n');
+        std::tie(Hash, Path) = Line.split(' ');
+        if(Path.empty() || HashFile(FS, Path.str()) != Hash)
+          return false;
+      }
+      return true;
+    }
+    // Loads the preamble for an empty file, as a translation would
+    bool canLoad(StringRef Base, StringRef PCHFile, const TranslationJob &Job,
+                 llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS) {
+      TranslationJob PCHJob(Job);
+      PCHJob.InputFile = (Base + ".upc").str();
+      FileSystemOptions FileSystemOpts;
+      FileSystemOpts.WorkingDir = Job.WorkingDir;
+      llvm::IntrusiveRefCntPtr<FileManager> Files(new FileManager(FileSystemOpts, FS));
+      ToolInvocation tool(GetCommandLine(PCHJob, PCHFile), new SyntaxOnlyAction, Files.get());
+      IgnoringDiagConsumer IgnoreDiags;
+      tool.setDiagnosticConsumer(&IgnoreDiags);
+      return tool.run();
+    }
+    // The precompiled header is built from an empty main file with
+    // the original -include options, so the headers are found and
+    // classified exactly as in a normal translation.
+    bool build(StringRef Base, StringRef PCHFile, const TranslationJob &Job,
+               llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS,
+               llvm::raw_ostream *DiagOS) {
+      if(llvm::sys::fs::create_directories(llvm::sys::path::parent_path(Base)))
+        return false;
+      std::string MainFile = (Base + ".upc").str();
+      {
+        std::error_code error;
+        llvm::raw_fd_ostream Empty(MainFile, error, llvm::sys::fs::F_None);
+        if(error)
+          return false;
+      }
+      TranslationJob PCHJob(Job);
+      PCHJob.InputFile = MainFile;
+      FileSystemOptions FileSystemOpts;
+      FileSystemOpts.WorkingDir = Job.WorkingDir;
+      llvm::IntrusiveRefCntPtr<FileManager> Files(new FileManager(FileSystemOpts, FS));
+      std::vector<std::string> Headers;
+      ToolInvocation tool(GetCommandLine(PCHJob, ""), new BuildPreambleAction(PCHFile, Job.WorkingDir, Headers), Files.get());
+      llvm::IntrusiveRefCntPtr<DiagnosticOptions> DiagOpts(new DiagnosticOptions());
+      std::unique_ptr<TextDiagnosticPrinter> DiagPrinter;
+      if(Job.Diags) {
+        tool.setDiagnosticConsumer(Job.Diags);
+      } else if(DiagOS) {
+        DiagPrinter.reset(new TextDiagnosticPrinter(*DiagOS, &*DiagOpts));
+        tool.setDiagnosticConsumer(DiagPrinter.get());
+      }
+      if(!tool.run() || !llvm::sys::fs::exists(PCHFile))
+        return false;
+      std::string Inputs;
+      for(std::vector<std::string>::const_iterator iter = Headers.begin(), end = Headers.end(); iter != end; ++iter)
+        Inputs += HashFile(*FS, *iter) + " " + *iter + "\n";
+      return !WriteFileAtomically(Base + ".inputs", Inputs);
+    }
+    llvm::StringMap<std::unique_ptr<Entry> > Entries;
+    std::mutex Mutex;
+  };
+
+  // Feeds everything written to it into an MD5 hash.
+  class HashingOStream : public llvm::raw_ostream {
+  public:
+    HashingOStream() : Pos(0) {}
+    ~HashingOStream() { flush(); }
+    std::string result() {
+      flush();
+      llvm::MD5::MD5Result Result;
+      Hash.final(Result);
+      llvm::SmallString<32> Hex;
+      llvm::MD5::stringifyResult(Result, Hex);
+      return Hex.str().str();
+    }
+  private:
+    void write_impl(const char *Ptr, size_t Size) override {
+      Hash.update(llvm::ArrayRef<uint8_t>(reinterpret_cast<const uint8_t *>(Ptr), Size));
+      Pos += Size;
+    }
+    uint64_t current_pos() const override { return Pos; }
+    llvm::MD5 Hash;
+    uint64_t Pos;
+  };
+
+  // Preprocesses the input, with line markers, into a hash.
+  class HashPreprocessedAction : public PreprocessorFrontendAction {
+  public:
+    HashPreprocessedAction(std::string &Result, bool &TLD) : result(Result), tld(TLD) {}
+    virtual void ExecuteAction() {
+      CompilerInstance &CI = getCompilerInstance();
+      PreprocessorOutputOptions Opts = CI.getPreprocessorOutputOpts();
+      Opts.ShowCPP = 1;
+      Opts.ShowLineMarkers = 1;
+      Opts.ShowMacros = 0;
+      HashingOStream OS;
+      DoPrintPreprocessedInput(CI.getPreprocessor(), &OS, Opts);
+      result = OS.result();
+      tld = CI.getLangOpts().UPCTLDEnable;
+    }
+    std::string &result;
+    bool &tld;
+  };
+
+  // Replaces the file id in the names of the shared allocation
+  // and initialization functions, the only places it is used.
+  // Only whole identifiers are replaced, so that names in the
+  // program that merely contain one of them are left alone.
+  std::string ReplaceFileId(StringRef Text, StringRef From, StringRef To) {
+    std::string Result = Text.str();
+    const char *const Prefixes[] = { "UPCRI_ALLOC_", "UPCRI_INIT_" };
+    for(unsigned i = 0; i < 2; ++i) {
+      std::string OldName = std::string(Prefixes[i]) + From.str();
+      std::string NewName = std::string(Prefixes[i]) + To.str();
+      for(std::string::size_type pos = Result.find(OldName); pos != std::string::npos; pos = Result.find(OldName, pos)) {
+        std::string::size_type end = pos + OldName.size();
+        if((pos != 0 && is_ident_char()(Result[pos - 1])) || (end < Result.size() && is_ident_char()(Result[end]))) {
+          pos = end;
+          continue;
+        }
+        Result.replace(pos, OldName.size(), NewName);
+        pos += NewName.size();
+      }
+    }
+    return Result;
+  }
+
+  // An on-disk cache of translated files.  The key is the hash of
+  // the preprocessed input together with the driver options, the
+  // TLD setting, the line directive setting and the translator
+  // version.  The line markers of the preprocessed input name its
+  // files, so inputs at different paths never share an entry.  The
+  // file id is not part of the key, since -file-id= can change it
+  // for the same input, so entries are stored with a placeholder in
+  // its place.
+  class TranslationCache {
+  public:
+    TranslationCache() : Hits(0), Misses(0) {}
+
+    // Returns the key for Job, or the empty string if the input
+    // cannot be preprocessed.  Diagnostics are left to the real
+    // translation.
+    std::string getKey(const TranslationJob &Job, llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS) {
+      std::string Preprocessed;
+      bool TLD = false;
+      FileSystemOptions FileSystemOpts;
+      FileSystemOpts.WorkingDir = Job.WorkingDir;
+      llvm::IntrusiveRefCntPtr<FileManager> Files(new FileManager(FileSystemOpts, FS));
+      ToolInvocation tool(GetCommandLine(Job, ""), new HashPreprocessedAction(Preprocessed, TLD), Files.get());
+      IgnoringDiagConsumer IgnoreDiags;
+      tool.setDiagnosticConsumer(&IgnoreDiags);
+      if(!tool.run() || Preprocessed.empty())
+        return "";
+      std::vector<std::string> Key;
+      Key.push_back(UPC2CVersion);
+      Key.insert(Key.end(), Job.Args.begin(), Job.Args.end());
+      Key.insert(Key.end(), Job.Includes.begin(), Job.Includes.end());
+      Job.Options.addToKey(Key);
+      Key.push_back(TLD? "tld" : "notld");
+      Key.push_back(Preprocessed);
+      return HashStrings(Key);
+    }
+
+    // Writes the cached translation for Key to Out, or if
+    // that is null to the output file.
+    bool lookup(StringRef Dir, StringRef Key, const TranslationJob &Job,
+                llvm::raw_ostream *Out) {
+      llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer> > Entry =
+        llvm::MemoryBuffer::getFile(getEntryPath(Dir, Key, Job));
+      if(!Entry) {
+        ++Misses;
+        return false;
+      }
+      std::error_code error;
+      std::unique_ptr<llvm::raw_fd_ostream> File;
+      if(!Out) {
+        File.reset(new llvm::raw_fd_ostream(Job.OutputFile, error, llvm::sys::fs::F_None));
+        if(error) {
+          ++Misses;
+          return false;
+        }
+        Out = File.get();
+      }
+      *Out << ReplaceFileId((*Entry)->getBuffer(), Placeholder, Job.Options.FileId);
+      ++Hits;
+      return true;
+    }
+
+    // Copies a fresh translation into the cache, from Text if it
+    // was not written to the output file.  The entry is renamed
+    // into place so that concurrent readers never see a partial
+    // file.
+    void store(StringRef Dir, StringRef Key, const TranslationJob &Job,
+               const std::string *Text) {
+      std::unique_ptr<llvm::MemoryBuffer> Output;
+      if(!Text) {
+        if(Job.OutputFile == "-")
+          return;
+        llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer> > File =
+          llvm::MemoryBuffer::getFile(Job.OutputFile);
+        if(!File)
+          return;
+        Output = std::move(*File);
+      }
+      StringRef Translation = Text? StringRef(*Text) : Output->getBuffer();
+      std::string Path = getEntryPath(Dir, Key, Job);
+      if(llvm::sys::fs::create_directories(llvm::sys::path::parent_path(Path)))
+        return;
+      int FD;
+      llvm::SmallString<256> TempPath;
+      if(llvm::sys::fs::createUniqueFile(Path + "-%%%%%%%%.tmp", FD, TempPath))
+        return;
+      {
+        llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+        OS << ReplaceFileId(Translation, Job.Options.FileId, Placeholder);
+        if(OS.has_error()) {
+          OS.clear_error();
+          llvm::sys::fs::remove(TempPath);
+          return;
+        }
+      }
+      if(llvm::sys::fs::rename(TempPath, Path))
+        llvm::sys::fs::remove(TempPath);
+    }
+
+    std::atomic<unsigned> Hits;
+    std::atomic<unsigned> Misses;
+  private:
+    static std::string getEntryPath(StringRef Dir, StringRef Key, const TranslationJob &Job) {
+      return MakeAbsolute(Job.WorkingDir, (Dir + "/" + Key.substr(0, 2) + "/" + Key + ".trans.c").str());
+    }
+    static const char Placeholder[];
+  };
+  const char TranslationCache::Placeholder[] = "@FILEID@";
+
+  // State shared by all the jobs that one process runs.
+  struct TranslationSession {
+    llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS;
+    PreambleCache Preambles;
+    TranslationCache Cache;
+    // Where preambles are kept for command lines without -pch-dir=
+    std::string DefaultPCHDir;
+  };
+
+  std::string ShellQuote(StringRef Arg) {
+    std::string Result = "'";
+    for(StringRef::iterator iter = Arg.begin(), end = Arg.end(); iter != end; ++iter) {
+      if(*iter == '\'')
+        Result += "'\\''";
+      else
+        Result += *iter;
+    }
+    return Result + "'";
+  }
+
+  // Expands the -pipe-to= command for a job: %i is the input
+  // file, %s is its name without directory or extension, and
+  // %% is a literal %.
+  std::string ExpandPipeCommand(StringRef Command, const TranslationJob &Job) {
+    std::string Result;
+    for(std::size_t i = 0; i < Command.size(); ++i) {
+      if(Command[i] != '%' || i + 1 == Command.size()) {
+        Result += Command[i];
+        continue;
+      }
+      switch(Command[++i]) {
+      case 'i': Result += ShellQuote(Job.InputFile); break;
+      case 's': Result += ShellQuote(llvm::sys::path::stem(Job.InputFile)); break;
+      case '%': Result += '%'; break;
+      default: Result += '%'; Result += Command[i]; break;
+      }
+    }
+    return Result;
+  }
+
+#ifdef LLVM_ON_UNIX
+  // The standard input of a command run by the shell, so that the
+  // command (usually the C compiler) runs while the file is being
+  // translated and no intermediate file is written.
+  class OutputPipe {
+  public:
+    OutputPipe() : Stream(nullptr) {}
+    ~OutputPipe() { close(); }
+    bool open(const std::string &Command) {
+      Stream = ::popen(Command.c_str(), "w");
+      if(!Stream)
+        return false;
+      OS.reset(new llvm::raw_fd_ostream(fileno(Stream), /*shouldClose=*/false));
+      return true;
+    }
+    llvm::raw_ostream &getStream() { return *OS; }
+    // Waits for the command.  Returns true if everything was
+    // written and the command succeeded.
+    bool close() {
+      if(!Stream)
+        return true;
+      OS->flush();
+      bool Written = !OS->has_error();
+      OS->clear_error();
+      OS.reset();
+      int Status = ::pclose(Stream);
+      Stream = nullptr;
+      return Written && Status == 0;
+    }
+  private:
+    FILE *Stream;
+    std::unique_ptr<llvm::raw_fd_ostream> OS;
+  };
+#endif
+
+  // Translates one job, or copies it from the cache.  The result
+  // is kept in Text if that is given, and otherwise written to Out
+  // if given or else to the output file.
+  bool RunTranslation(const TranslationJob &Job, const TranslatorOptions &ToolOpts,
+                      TranslationSession &Session, std::string *Text,
+                      llvm::raw_ostream *Out, llvm::raw_ostream *DiagOS) {
+    PhaseProfiler *Profiler = Job.Options.Profiler;
+    std::unique_ptr<llvm::raw_string_ostream> TextOS;
+    if(Text) {
+      TextOS.reset(new llvm::raw_string_ostream(*Text));
+      Out = TextOS.get();
+    }
+    std::string CacheKey;
+    if(!ToolOpts.CacheDir.empty()) {
+      PhaseScope Phase(Profiler, "CacheLookup");
+      CacheKey = Session.Cache.getKey(Job, Session.FS);
+      if(!CacheKey.empty() && Session.Cache.lookup(ToolOpts.CacheDir, CacheKey, Job, Out))
+        return true;
+    }
+    std::string Preamble;
+    {
+      PhaseScope Phase(Profiler, "Preamble");
+      Preamble = Session.Preambles.getPreamble(ToolOpts.PCHDir, Job, Session.FS, DiagOS);
+    }
+    TranslationOptions Options(Job.Options);
+    if(!ToolOpts.IncrementalDir.empty()) {
+      // One state file per input and output, for any settings
+      std::vector<std::string> Names;
+      Names.push_back(Job.InputFile);
+      Names.push_back(Job.OutputFile);
+      Options.IncrementalFile = MakeAbsolute(Job.WorkingDir, (ToolOpts.IncrementalDir + "/" + HashStrings(Names) + ".inc").str());
+      std::vector<std::string> Key;
+      Key.push_back(UPC2CVersion);
+      Key.insert(Key.end(), Job.Args.begin(), Job.Args.end());
+      Key.insert(Key.end(), Job.Includes.begin(), Job.Includes.end());
+      Job.Options.addToKey(Key);
+      Options.IncrementalKey = HashStrings(Key);
+    }
+    FileSystemOptions FileSystemOpts;
+    FileSystemOpts.WorkingDir = Job.WorkingDir;
+    llvm::IntrusiveRefCntPtr<FileManager> Files(new FileManager(FileSystemOpts, Session.FS));
+    ToolInvocation tool(GetCommandLine(Job, Preamble), new RemoveUPCAction(Job.OutputFile, Options, Out), Files.get());
+    llvm::IntrusiveRefCntPtr<DiagnosticOptions> DiagOpts(new DiagnosticOptions());
+    std::unique_ptr<TextDiagnosticPrinter> DiagPrinter;
+    if(Job.Diags) {
+      tool.setDiagnosticConsumer(Job.Diags);
+    } else if(DiagOS) {
+      DiagPrinter.reset(new TextDiagnosticPrinter(*DiagOS, &*DiagOpts));
+      tool.setDiagnosticConsumer(DiagPrinter.get());
+    }
+    if(!tool.run())
+      return false;
+    if(TextOS)
+      TextOS->flush();
+    if(!CacheKey.empty() && (Text || !Out)) {
+      PhaseScope Phase(Profiler, "CacheStore");
+      Session.Cache.store(ToolOpts.CacheDir, CacheKey, Job, Text);
+    }
+    return true;
+  }
+
+  // Writes Text to Path, reporting any error to DiagOS.
+  bool WriteFile(const std::string &Path, StringRef Text, llvm::raw_ostream *DiagOS) {
+    if(std::error_code error = WriteFileAtomically(Path, Text)) {
+      (DiagOS? *DiagOS : llvm::errs()) << "clang-upc2c: cannot write " << Path << ": " << error.message() << "\n";
+      return false;
+    }
+    return true;
+  }
+
+  // Writes Text to Path unless the file already holds it, so that
+  // the file's timestamp only changes with its contents.
+  bool WriteIfChanged(const std::string &Path, StringRef Text, llvm::raw_ostream *DiagOS) {
+    {
+      llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer> > Old = llvm::MemoryBuffer::getFile(Path);
+      if(Old && (*Old)->getBuffer() == Text)
+        return true;
+    }
+    return WriteFile(Path, Text, DiagOS);
+  }
+
+  // The name of one of several outputs, for -split= and
+  // -variants=: foo.trans.c becomes foo.trans.0.c, foo.trans.tld.c
+  // and so on.
+  std::string GetPartOutputFile(StringRef Output, const llvm::Twine &Part) {
+    StringRef Base = Output;
+    if(llvm::sys::path::extension(Base) == ".c")
+      Base = Base.drop_back(2);
+    return (Base + "." + Part + ".c").str();
+  }
+
+  // Runs one job.  If DiagOS is given, diagnostics are written
+  // to it instead of to stderr.
+  bool RunTranslationJob(const TranslationJob &Job, const TranslatorOptions &ToolOpts,
+                         TranslationSession &Session, llvm::raw_ostream *DiagOS) {
+    PhaseProfiler *Profiler = Job.Options.Profiler;
+    PhaseScope Phase(Profiler, "Translate", Job.InputFile);
+    llvm::raw_ostream *Out = nullptr;
+#ifdef LLVM_ON_UNIX
+    OutputPipe Pipe;
+    std::string PipeCommand;
+    if(!ToolOpts.PipeTo.empty()) {
+      PipeCommand = ExpandPipeCommand(ToolOpts.PipeTo, Job);
+      if(!Pipe.open(PipeCommand)) {
+        (DiagOS? *DiagOS : llvm::errs()) << "clang-upc2c: cannot run '" << PipeCommand << "'\n";
+        return false;
+      }
+      Out = &Pipe.getStream();
+    }
+#endif
+    bool Split = Job.Options.SplitParts > 1;
+    if(Split || !Job.Options.Variants.empty()) {
+      if(Job.OutputFile == "-") {
+        (DiagOS? *DiagOS : llvm::errs()) << "clang-upc2c: " << (Split? "-split=" : "-variants=")
+                                         << " cannot write to standard output\n";
+        return false;
+      }
+      std::vector<std::string> Parts;
+      TranslationJob PartsJob(Job);
+      if(Split)
+        PartsJob.Options.SplitTexts = &Parts;
+      else
+        PartsJob.Options.VariantTexts = &Parts;
+      std::string Text;
+      if(!RunTranslation(PartsJob, ToolOpts, Session, &Text, nullptr, DiagOS))
+        return false;
+      PhaseScope Phase(Profiler, "Write");
+      for(std::size_t i = 0; i < Parts.size(); ++i) {
+        std::string Path = Split? GetPartOutputFile(Job.OutputFile, llvm::Twine(i)) :
+          GetPartOutputFile(Job.OutputFile, Job.Options.Variants[i]);
+        if(!(ToolOpts.WriteIfChanged? WriteIfChanged(Path, Parts[i], DiagOS) : WriteFile(Path, Parts[i], DiagOS)))
+          return false;
+      }
+      return true;
+    }
+    if(ToolOpts.WriteIfChanged && !Out && Job.OutputFile != "-") {
+      std::string Text;
+      if(!RunTranslation(Job, ToolOpts, Session, &Text, nullptr, DiagOS))
+        return false;
+      PhaseScope Phase(Profiler, "Write");
+      return WriteIfChanged(Job.OutputFile, Text, DiagOS);
+    }
+    bool Success = RunTranslation(Job, ToolOpts, Session, nullptr, Out, DiagOS);
+#ifdef LLVM_ON_UNIX
+    if(!PipeCommand.empty() && !Pipe.close() && Success) {
+      (DiagOS? *DiagOS : llvm::errs()) << "clang-upc2c: '" << PipeCommand << "' failed\n";
+      Success = false;
+    }
+#endif
+    return Success;
+  }
+
+  // Each job gets its own FileManager and ASTContext, so
+  // independent inputs can be translated concurrently.
+  bool RunTranslationJobs(const std::vector<TranslationJob> &Jobs, const TranslatorOptions &ToolOpts,
+                          TranslationSession &Session, llvm::raw_ostream *DiagOS) {
+    std::vector<std::string> Diagnostics(Jobs.size());
+    std::atomic<bool> Success(true);
+    if(ToolOpts.Jobs <= 1 || Jobs.size() <= 1) {
+      for(std::size_t i = 0; i < Jobs.size(); ++i) {
+        if(!RunTranslationJob(Jobs[i], ToolOpts, Session, DiagOS))
+          Success = false;
+      }
+      return Success;
+    }
+    {
+      llvm::ThreadPool Pool(std::min<std::size_t>(ToolOpts.Jobs, Jobs.size()));
+      for(std::size_t i = 0; i < Jobs.size(); ++i) {
+        Pool.async([&, i] {
+          llvm::raw_string_ostream JobDiags(Diagnostics[i]);
+          if(!RunTranslationJob(Jobs[i], ToolOpts, Session, DiagOS? &JobDiags : nullptr))
+            Success = false;
+        });
+      }
+      Pool.wait();
+    }
+    if(DiagOS) {
+      for(std::vector<std::string>::const_iterator iter = Diagnostics.begin(), end = Diagnostics.end(); iter != end; ++iter)
+        *DiagOS << *iter;
+    }
+    return Success;
+  }
+
+  // Records the functions, calls and function references of a
+  // file for -whole-program=.
+  class CollectProgramSummary : public RecursiveASTVisitor<CollectProgramSummary> {
+    typedef RecursiveASTVisitor<CollectProgramSummary> Base;
+  public:
+    CollectProgramSummary(FileSummary &S, StringRef Id) : Summary(S), FileId(Id), Caller(0), ForallDepth(0) {}
+    bool TraverseFunctionDecl(FunctionDecl *FD) {
+      if(FD->doesThisDeclarationHaveABody())
+        Summary.Defined.push_back(ProgramSummary::getKey(FD, FileId));
+      llvm::SaveAndRestore<FunctionDecl*> Function(Caller, FD);
+      return Base::TraverseFunctionDecl(FD);
+    }
+    // Everything in a upc_forall with an affinity, including its
+    // header, runs with upcrt_forall_control set.
+    bool TraverseUPCForAllStmt(UPCForAllStmt *S) {
+      llvm::SaveAndRestore<unsigned> Depth(ForallDepth, ForallDepth + (S->getAfnty()? 1 : 0));
+      return Base::TraverseUPCForAllStmt(S);
+    }
+    bool VisitCallExpr(CallExpr *E) {
+      if(FunctionDecl *Callee = E->getDirectCallee()) {
+        DirectCallees.insert(E->getCallee()->IgnoreParenImpCasts());
+        if(Caller) {
+          FileSummary::Call Call;
+          Call.Caller = ProgramSummary::getKey(Caller, FileId);
+          Call.Callee = ProgramSummary::getKey(Callee, FileId);
+          Call.InForall = ForallDepth != 0;
+          Summary.Calls.push_back(Call);
+        }
+      }
+      return true;
+    }
+    // Calls are visited before their callee, so any other
+    // reference to a function takes its address.
+    bool VisitDeclRefExpr(DeclRefExpr *E) {
+      if(FunctionDecl *FD = dyn_cast<FunctionDecl>(E->getDecl())) {
+        if(!DirectCallees.count(E))
+          Summary.AddressTaken.push_back(ProgramSummary::getKey(FD, FileId));
+      }
+      return true;
+    }
+  private:
+    FileSummary &Summary;
+    StringRef FileId;
+    FunctionDecl *Caller;
+    unsigned ForallDepth;
+    llvm::SmallPtrSet<Expr*, 32> DirectCallees;
+  };
+
+  class ProgramSummaryConsumer : public ASTConsumer {
+  public:
+    ProgramSummaryConsumer(FileSummary &S, StringRef Id) : Summary(S), FileId(Id) {}
+    virtual void HandleTranslationUnit(ASTContext &Context) {
+      if(Context.getDiagnostics().hasUncompilableErrorOccurred())
+        return;
+      CollectProgramSummary(Summary, FileId).TraverseDecl(Context.getTranslationUnitDecl());
+    }
+  private:
+    FileSummary &Summary;
+    std::string FileId;
+  };
+
+  class ProgramSummaryAction : public ASTFrontendAction {
+  public:
+    ProgramSummaryAction(FileSummary &S, StringRef Id) : Summary(S), FileId(Id) {}
+    virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance &Compiler, llvm::StringRef InFile) {
+      return std::unique_ptr<ASTConsumer>(new ProgramSummaryConsumer(Summary, FileId));
+    }
+  private:
+    FileSummary &Summary;
+    std::string FileId;
+  };
+
+  // Parses one input of -whole-program= for its summary.
+  bool SummarizeJob(const TranslationJob &Job, const TranslatorOptions &ToolOpts,
+                    TranslationSession &Session, FileSummary &Summary, llvm::raw_ostream *DiagOS) {
+    PhaseScope Phase(Job.Options.Profiler, "Summarize", Job.InputFile);
+    std::string Preamble = Session.Preambles.getPreamble(ToolOpts.PCHDir, Job, Session.FS, DiagOS);
+    FileSystemOptions FileSystemOpts;
+    FileSystemOpts.WorkingDir = Job.WorkingDir;
+    llvm::IntrusiveRefCntPtr<FileManager> Files(new FileManager(FileSystemOpts, Session.FS));
+    ToolInvocation tool(GetCommandLine(Job, Preamble), new ProgramSummaryAction(Summary, Job.Options.FileId), Files.get());
+    llvm::IntrusiveRefCntPtr<DiagnosticOptions> DiagOpts(new DiagnosticOptions());
+    std::unique_ptr<TextDiagnosticPrinter> DiagPrinter;
+    if(DiagOS) {
+      DiagPrinter.reset(new TextDiagnosticPrinter(*DiagOS, &*DiagOpts));
+      tool.setDiagnosticConsumer(DiagPrinter.get());
+    }
+    return tool.run();
+  }
+
+  // Summarizes every input, in parallel like the translations,
+  // and analyzes the call graph of the whole program.
+  bool SummarizeProgram(const std::vector<TranslationJob> &Jobs, const TranslatorOptions &ToolOpts,
+                        TranslationSession &Session, ProgramSummary &Program, llvm::raw_ostream *DiagOS) {
+    std::vector<FileSummary> Summaries(Jobs.size());
+    std::vector<std::string> Diagnostics(Jobs.size());
+    std::atomic<bool> Success(true);
+    if(ToolOpts.Jobs <= 1 || Jobs.size() <= 1) {
+      for(std::size_t i = 0; i < Jobs.size(); ++i) {
+        if(!SummarizeJob(Jobs[i], ToolOpts, Session, Summaries[i], DiagOS))
+          Success = false;
+      }
+    } else {
+      llvm::ThreadPool Pool(std::min<std::size_t>(ToolOpts.Jobs, Jobs.size()));
+      for(std::size_t i = 0; i < Jobs.size(); ++i) {
+        Pool.async([&, i] {
+          llvm::raw_string_ostream JobDiags(Diagnostics[i]);
+          if(!SummarizeJob(Jobs[i], ToolOpts, Session, Summaries[i], DiagOS? &JobDiags : nullptr))
+            Success = false;
+        });
+      }
+      Pool.wait();
+    }
+    if(DiagOS) {
+      for(std::vector<std::string>::const_iterator iter = Diagnostics.begin(), end = Diagnostics.end(); iter != end; ++iter)
+        *DiagOS << *iter;
+    }
+    if(!Success)
+      return false;
+    for(std::vector<FileSummary>::const_iterator iter = Summaries.begin(), end = Summaries.end(); iter != end; ++iter)
+      Program.add(*iter);
+    Program.analyze();
+    return true;
+  }
+
+  // Writes the program-level unit of -whole-program=, which runs
+  // the shared allocation and initialization functions of every
+  // file from upcri_alloc_all and upcri_init_all, the entry points
+  // that the runtime in bench/runtime calls at startup.
+  bool WriteProgramUnit(const std::string &Path, const std::vector<TranslationJob> &Jobs,
+                        llvm::raw_ostream *DiagOS) {
+    std::string Text;
+    llvm::raw_string_ostream OS(Text);
+    OS << "/* Generated by clang-upc2c -whole-program= */\n";
+    const char *const Kinds[] = { "ALLOC", "INIT" };
+    const char *const Entries[] = { "upcri_alloc_all", "upcri_init_all" };
+    for(unsigned i = 0; i < 2; ++i) {
+      for(std::vector<TranslationJob>::const_iterator iter = Jobs.begin(), end = Jobs.end(); iter != end; ++iter)
+        OS << "void UPCRI_" << Kinds[i] << "_" << iter->Options.FileId << "(void);\n";
+      OS << "void " << Entries[i] << "(void) {\n";
+      for(std::vector<TranslationJob>::const_iterator iter = Jobs.begin(), end = Jobs.end(); iter != end; ++iter)
+        OS << "  UPCRI_" << Kinds[i] << "_" << iter->Options.FileId << "();\n";
+      OS << "}\n";
+    }
+    OS.flush();
+    return WriteIfChanged(Path, Text, DiagOS);
+  }
+
+  // Writes the phases of each job in the Chrome trace event
+  // format, one thread per job.
+  bool WriteTimeTrace(StringRef Path, const std::vector<TranslationJob> &Jobs,
+                      llvm::raw_ostream &Errs) {
+    llvm::json::Array Events;
+    for(std::size_t i = 0; i < Jobs.size(); ++i) {
+      Events.push_back(llvm::json::Object{
+        {"ph", "M"}, {"pid", 1}, {"tid", int64_t(i)}, {"name", "thread_name"},
+        {"args", llvm::json::Object{{"name", Jobs[i].InputFile}}}});
+      const std::vector<PhaseProfiler::Span> &Spans = Jobs[i].Options.Profiler->getSpans();
+      for(std::vector<PhaseProfiler::Span>::const_iterator iter = Spans.begin(), end = Spans.end(); iter != end; ++iter) {
+        llvm::json::Object Args{{"peak_rss_kb", int64_t(iter->PeakRSS)}};
+        if(!iter->Detail.empty())
+          Args["detail"] = iter->Detail;
+        Events.push_back(llvm::json::Object{
+          {"ph", "X"}, {"pid", 1}, {"tid", int64_t(i)}, {"cat", "upc2c"},
+          {"name", iter->Name}, {"ts", int64_t(iter->Start)}, {"dur", int64_t(iter->Duration)},
+          {"args", std::move(Args)}});
+      }
+    }
+    std::error_code error;
+    llvm::raw_fd_ostream OS(Path, error, llvm::sys::fs::F_None);
+    if(error) {
+      Errs << "clang-upc2c: cannot write " << Path << ": " << error.message() << "\n";
+      return false;
+    }
+    OS << llvm::json::Value(llvm::json::Object{{"traceEvents", std::move(Events)}}) << "\n";
+    return true;
+  }
+
+  // Prints the time of each phase summed over all the jobs,
+  // and the functions that took longest to transform.
+  void PrintTimeReport(const std::vector<TranslationJob> &Jobs, llvm::raw_ostream &OS) {
+    std::vector<std::string> Order;
+    llvm::StringMap<double> PhaseTimes;
+    llvm::StringMap<long> PhaseRSS;
+    std::vector<const PhaseProfiler::Span *> Functions;
+    for(std::vector<TranslationJob>::const_iterator job = Jobs.begin(), job_end = Jobs.end(); job != job_end; ++job) {
+      const std::vector<PhaseProfiler::Span> &Spans = job->Options.Profiler->getSpans();
+      for(std::vector<PhaseProfiler::Span>::const_iterator iter = Spans.begin(), end = Spans.end(); iter != end; ++iter) {
+        if(iter->Name == "Function") {
+          Functions.push_back(&*iter);
+          continue;
+        }
+        if(PhaseTimes.find(iter->Name) == PhaseTimes.end())
+          Order.push_back(iter->Name);
+        PhaseTimes[iter->Name] += iter->Duration;
+        PhaseRSS[iter->Name] = std::max(PhaseRSS[iter->Name], iter->PeakRSS);
+      }
+    }
+    OS << "===-------------------------------------------------------------------------===\n"
+       << "                          clang-upc2c time report\n"
+       << "===-------------------------------------------------------------------------===\n";
+    OS << llvm::format("%-24s %12s %14s\n", "Phase", "Wall (ms)", "Peak RSS (MB)");
+    for(std::vector<std::string>::const_iterator iter = Order.begin(), end = Order.end(); iter != end; ++iter) {
+      OS << llvm::format("%-24s %12.2f %14.1f\n", iter->c_str(), PhaseTimes[*iter] / 1000,
+                         PhaseRSS[*iter] / 1024.0);
+    }
+    if(Functions.empty())
+      return;
+    struct LongerFirst {
+      bool operator()(const PhaseProfiler::Span *LHS, const PhaseProfiler::Span *RHS) const {
+        return LHS->Duration > RHS->Duration;
+      }
+    };
+    std::size_t Count = std::min<std::size_t>(Functions.size(), 10);
+    std::partial_sort(Functions.begin(), Functions.begin() + Count, Functions.end(), LongerFirst());
+    OS << "\nSlowest functions to transform:\n";
+    for(std::size_t i = 0; i < Count; ++i) {
+      OS << llvm::format("  %10.2f ms  ", Functions[i]->Duration / 1000) << Functions[i]->Detail << "\n";
+    }
+  }
+
+  void PrintStats(const TranslationJob &Job, llvm::raw_ostream &OS) {
+    const TransformStats &Stats = *Job.Options.Stats;
+    OS << "===-------------------------------------------------------------------------===\n"
+       << "  clang-upc2c statistics: " << Job.InputFile << "\n"
+       << "===-------------------------------------------------------------------------===\n";
+    if(!Stats.Collected) {
+      OS << "  (not transformed)\n";
+      return;
+    }
+#define UPC2C_PRINT_STAT(Name, Desc) \
+    OS << llvm::format("%8u %-18s - %s\n", Stats.Name, #Name, Desc);
+    UPC2C_STATS(UPC2C_PRINT_STAT)
+#undef UPC2C_PRINT_STAT
+  }
+
+  // Writes the counters of every job as a JSON array, so that
+  // they can be compared across releases.
+  bool WriteStatsFile(StringRef Path, const std::vector<TranslationJob> &Jobs,
+                      llvm::raw_ostream &Errs) {
+    llvm::json::Array Files;
+    for(std::vector<TranslationJob>::const_iterator iter = Jobs.begin(), end = Jobs.end(); iter != end; ++iter) {
+      const TransformStats &Stats = *iter->Options.Stats;
+      llvm::json::Object File{{"file", iter->InputFile}, {"transformed", Stats.Collected}};
+      if(Stats.Collected) {
+        llvm::json::Object Counters;
+#define UPC2C_JSON_STAT(Name, Desc) Counters[#Name] = int64_t(Stats.Name);
+        UPC2C_STATS(UPC2C_JSON_STAT)
+#undef UPC2C_JSON_STAT
+        File["stats"] = std::move(Counters);
+      }
+      Files.push_back(std::move(File));
+    }
+    std::error_code error;
+    llvm::raw_fd_ostream OS(Path, error, llvm::sys::fs::F_None);
+    if(error) {
+      Errs << "clang-upc2c: cannot write " << Path << ": " << error.message() << "\n";
+      return false;
+    }
+    OS << llvm::formatv("{0:2}", llvm::json::Value(std::move(Files))) << "\n";
+    return true;
+  }
+
+  // Creates and runs the jobs for one command line.
+  bool TranslateCommandLine(llvm::opt::OptTable &Opts, llvm::ArrayRef<const char *> Argv,
+                            StringRef WorkingDir, TranslationSession &Session,
+                            llvm::raw_ostream &Errs, llvm::raw_ostream *DiagOS) {
+    TranslatorOptions ToolOpts;
+    llvm::SmallVector<const char *, 64> ClangArgv;
+    if(!ParseTranslatorOptions(Argv, ToolOpts, ClangArgv, Errs))
+      return false;
+    if(ToolOpts.PCHDir.empty())
+      ToolOpts.PCHDir = Session.DefaultPCHDir;
+
+    std::unique_ptr<RuntimeABI> ABI;
+    if(!ToolOpts.RuntimeABIFile.empty()) {
+      ABI.reset(new RuntimeABI);
+      if(!ABI->load(MakeAbsolute(WorkingDir, ToolOpts.RuntimeABIFile), Errs))
+        return false;
+      ToolOpts.Translation.ABI = ABI.get();
+    }
+
+    std::vector<TranslationJob> Jobs;
+    if(!ToolOpts.CompileCommands.empty()) {
+      // The database gives the flags and inputs of every file
+      if(ClangArgv.size() > 1) {
+        Errs << "clang-upc2c: -compile-commands= cannot be used with compiler options or inputs, such as '"
+             << ClangArgv[1] << "'\n";
+        return false;
+      }
+      std::string Database = MakeAbsolute(WorkingDir, ToolOpts.CompileCommands);
+      if(!CreateJobsFromCompilationDatabase(Opts, Database, ToolOpts.Translation, Jobs, Errs))
+        return false;
+    } else if(!CreateTranslationJobs(Opts, ClangArgv, WorkingDir, true, ToolOpts.Translation, Jobs, Errs)) {
+      return false;
+    }
+    if(!ToolOpts.Translation.FileId.empty() && Jobs.size() > 1) {
+      Errs << "clang-upc2c: cannot specify -file-id= when translating multiple files\n";
+      return false;
+    }
+    // A compilation database may list the same command more than
+    // once, for instance for two targets built from one source.
+    // Only the first of identical jobs is run.
+    std::set<std::vector<std::string> > Seen;
+    for(std::vector<TranslationJob>::iterator iter = Jobs.begin(); iter != Jobs.end(); ) {
+      std::vector<std::string> Key;
+      Key.push_back(iter->InputFile);
+      Key.push_back(iter->OutputFile);
+      Key.push_back(iter->WorkingDir);
+      Key.push_back(iter->Options.FileId);
+      iter->Options.addToKey(Key);
+      Key.insert(Key.end(), iter->Args.begin(), iter->Args.end());
+      Key.push_back("includes");
+      Key.insert(Key.end(), iter->Includes.begin(), iter->Includes.end());
+      if(Seen.insert(Key).second)
+        ++iter;
+      else
+        iter = Jobs.erase(iter);
+    }
+    // The default output of an input is named after it in the
+    // working directory, so a/foo.upc and b/foo.upc would both
+    // write foo.trans.c
+    llvm::StringMap<std::string> Outputs;
+    for(std::vector<TranslationJob>::const_iterator iter = Jobs.begin(), end = Jobs.end(); iter != end; ++iter) {
+      if(iter->OutputFile == "-")
+        continue;
+      std::pair<llvm::StringMap<std::string>::iterator, bool> Inserted =
+        Outputs.insert(std::make_pair(iter->OutputFile, iter->InputFile));
+      if(!Inserted.second && Inserted.first->second != iter->InputFile) {
+        Errs << "clang-upc2c: " << Inserted.first->second << " and " << iter->InputFile
+             << " would both be translated to " << iter->OutputFile << "\n";
+        return false;
+      }
+    }
+    std::vector<std::unique_ptr<PhaseProfiler> > Profilers;
+    if(ToolOpts.TimeReport || !ToolOpts.TimeTrace.empty()) {
+      std::chrono::steady_clock::time_point Origin = std::chrono::steady_clock::now();
+      for(std::vector<TranslationJob>::iterator iter = Jobs.begin(), end = Jobs.end(); iter != end; ++iter) {
+        Profilers.emplace_back(new PhaseProfiler(Origin));
+        iter->Options.Profiler = Profilers.back().get();
+      }
+    }
+    std::vector<TransformStats> Stats(Jobs.size());
+    if(ToolOpts.PrintStats || !ToolOpts.StatsFile.empty()) {
+      for(std::size_t i = 0; i < Jobs.size(); ++i)
+        Jobs[i].Options.Stats = &Stats[i];
+    }
+    ProgramSummary Program;
+    if(!ToolOpts.ProgramUnit.empty()) {
+      if(!SummarizeProgram(Jobs, ToolOpts, Session, Program, DiagOS))
+        return false;
+      for(std::vector<TranslationJob>::iterator iter = Jobs.begin(), end = Jobs.end(); iter != end; ++iter)
+        iter->Options.Program = &Program;
+    }
+    unsigned Hits = Session.Cache.Hits, Misses = Session.Cache.Misses;
+    bool Success = RunTranslationJobs(Jobs, ToolOpts, Session, DiagOS);
+    if(Success && !ToolOpts.ProgramUnit.empty() &&
+       !WriteProgramUnit(MakeAbsolute(WorkingDir, ToolOpts.ProgramUnit), Jobs, DiagOS))
+      Success = false;
+    if(ToolOpts.CacheStats)
+      Errs << "clang-upc2c: translation cache: " << Session.Cache.Hits - Hits << " hits, "
+           << Session.Cache.Misses - Misses << " misses\n";
+    if(ToolOpts.PrintStats) {
+      for(std::vector<TranslationJob>::const_iterator iter = Jobs.begin(), end = Jobs.end(); iter != end; ++iter)
+        PrintStats(*iter, Errs);
+    }
+    if(!ToolOpts.StatsFile.empty() &&
+       !WriteStatsFile(MakeAbsolute(WorkingDir, ToolOpts.StatsFile), Jobs, Errs))
+      Success = false;
+    if(ToolOpts.TimeReport)
+      PrintTimeReport(Jobs, Errs);
+    if(!ToolOpts.TimeTrace.empty() &&
+       !WriteTimeTrace(MakeAbsolute(WorkingDir, ToolOpts.TimeTrace), Jobs, Errs))
+      Success = false;
+    return Success;
+  }
+
+  // Keeps the diagnostics of a library translation as data
+  class CollectDiagnostics : public DiagnosticConsumer {
+  public:
+    CollectDiagnostics(std::vector<upc2c::Diagnostic> &D) : Diags(D) {}
+    virtual void HandleDiagnostic(DiagnosticsEngine::Level Level, const clang::Diagnostic &Info) {
+      DiagnosticConsumer::HandleDiagnostic(Level, Info);
+      upc2c::Diagnostic D;
+      switch(Level) {
+      case DiagnosticsEngine::Note: D.Level = upc2c::Diagnostic::Note; break;
+      case DiagnosticsEngine::Remark: D.Level = upc2c::Diagnostic::Remark; break;
+      case DiagnosticsEngine::Warning: D.Level = upc2c::Diagnostic::Warning; break;
+      case DiagnosticsEngine::Fatal: D.Level = upc2c::Diagnostic::Fatal; break;
+      default: D.Level = upc2c::Diagnostic::Error; break;
+      }
+      D.Line = D.Column = 0;
+      if(Info.getLocation().isValid() && Info.hasSourceManager()) {
+        PresumedLoc Presumed = Info.getSourceManager().getPresumedLoc(Info.getLocation());
+        if(Presumed.isValid()) {
+          D.File = Presumed.getFilename();
+          D.Line = Presumed.getLine();
+          D.Column = Presumed.getColumn();
+        }
+      }
+      llvm::SmallString<128> Message;
+      Info.FormatDiagnostic(Message);
+      D.Message = Message.str().str();
+      Diags.push_back(D);
+    }
+  private:
+    std::vector<upc2c::Diagnostic> &Diags;
+  };
+
+  // Adds the errors that clang-upc2c itself reports, one per line
+  // of Text, to Diags.
+  void AddTranslatorErrors(StringRef Text, std::vector<upc2c::Diagnostic> &Diags) {
+    llvm::SmallVector<StringRef, 4> Lines;
+    Text.split(Lines, '\n', -1, false);
+    for(llvm::SmallVectorImpl<StringRef>::const_iterator iter = Lines.begin(), end = Lines.end(); iter != end; ++iter) {
+      StringRef Message = *iter;
+      Message.consume_front("clang-upc2c: ");
+      upc2c::Diagnostic D;
+      D.Level = upc2c::Diagnostic::Error;
+      D.Line = D.Column = 0;
+      D.Message = Message.str();
+      Diags.push_back(D);
+    }
+  }
+
+  // Translates a request of the library interface in UPC2C.h.  The
+  // source and the other files of the request are laid over the
+  // session's file system for this request only.
+  bool TranslateRequest(llvm::opt::OptTable &Opts, TranslationSession &Session,
+                        const upc2c::TranslationRequest &Request, upc2c::TranslationResult &Result,
+                        llvm::raw_ostream &Errs) {
+    std::vector<const char *> Argv;
+    Argv.push_back("clang-upc2c");
+    for(std::vector<std::string>::const_iterator iter = Request.Args.begin(), end = Request.Args.end(); iter != end; ++iter)
+      Argv.push_back(iter->c_str());
+    Argv.push_back(Request.FileName.c_str());
+    TranslatorOptions ToolOpts;
+    llvm::SmallVector<const char *, 64> ClangArgv;
+    if(!ParseTranslatorOptions(Argv, ToolOpts, ClangArgv, Errs))
+      return false;
+    const char *Unsupported = 0;
+    if(!ToolOpts.CompileCommands.empty())
+      Unsupported = "-compile-commands=";
+    else if(!ToolOpts.ServerSocket.empty())
+      Unsupported = "-server=";
+    else if(!ToolOpts.UseServer.empty())
+      Unsupported = "-use-server=";
+    else if(!ToolOpts.PipeTo.empty())
+      Unsupported = "-pipe-to=";
+    else if(!ToolOpts.ProgramUnit.empty())
+      Unsupported = "-whole-program=";
+    else if(ToolOpts.TimeReport)
+      Unsupported = "-time-report";
+    else if(!ToolOpts.TimeTrace.empty())
+      Unsupported = "-time-trace=";
+    else if(ToolOpts.PrintStats)
+      Unsupported = "-print-stats";
+    else if(!ToolOpts.StatsFile.empty())
+      Unsupported = "-stats-file=";
+    else if(ToolOpts.CacheStats)
+      Unsupported = "-cache-stats";
+    else if(ToolOpts.WriteIfChanged)
+      Unsupported = "-write-if-changed";
+    if(Unsupported) {
+      Errs << "clang-upc2c: " << Unsupported << " cannot be used in a library translation\n";
+      return false;
+    }
+
+    std::string WorkingDir = Request.WorkingDir;
+    if(WorkingDir.empty()) {
+      llvm::SmallString<256> Current;
+      if(llvm::sys::fs::current_path(Current)) {
+        Errs << "clang-upc2c: cannot get the current directory\n";
+        return false;
+      }
+      WorkingDir = Current.str().str();
+    }
+    std::unique_ptr<RuntimeABI> ABI;
+    if(!ToolOpts.RuntimeABIFile.empty()) {
+      ABI.reset(new RuntimeABI);
+      if(!ABI->load(MakeAbsolute(WorkingDir, ToolOpts.RuntimeABIFile), Errs))
+        return false;
+      ToolOpts.Translation.ABI = ABI.get();
+    }
+    std::vector<TranslationJob> Jobs;
+    if(!CreateTranslationJobs(Opts, ClangArgv, WorkingDir, false, ToolOpts.Translation, Jobs, Errs))
+      return false;
+    if(Jobs.size() != 1) {
+      Errs << "clang-upc2c: a library translation has exactly one input\n";
+      return false;
+    }
+    TranslationJob &Job = Jobs[0];
+    // The source is not on disk for CreateTranslationJobs to read
+    if(ToolOpts.Translation.FileId.empty() && ToolOpts.Translation.FileIdFromContent)
+      Job.Options.FileId = get_file_id(Request.FileName, Request.Source);
+
+    llvm::IntrusiveRefCntPtr<llvm::vfs::InMemoryFileSystem> Memory(new llvm::vfs::InMemoryFileSystem);
+    Memory->addFile(Job.InputFile, 0, llvm::MemoryBuffer::getMemBufferCopy(Request.Source, Job.InputFile));
+    for(std::vector<std::pair<std::string, std::string> >::const_iterator iter = Request.Files.begin(), end = Request.Files.end(); iter != end; ++iter) {
+      std::string Path = MakeAbsolute(WorkingDir, iter->first);
+      Memory->addFile(Path, 0, llvm::MemoryBuffer::getMemBufferCopy(iter->second, Path));
+    }
+    llvm::IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> Overlay(
+      new llvm::vfs::OverlayFileSystem(Session.FS? Session.FS : llvm::vfs::getRealFileSystem()));
+    Overlay->pushOverlay(Memory);
+    llvm::SaveAndRestore<llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> > FS(Session.FS, Overlay);
+
+    CollectDiagnostics Diags(Result.Diagnostics);
+    Job.Diags = &Diags;
+    if(Job.Options.SplitParts > 1)
+      Job.Options.SplitTexts = &Result.Parts;
+    else if(!Job.Options.Variants.empty())
+      Job.Options.VariantTexts = &Result.Parts;
+    return RunTranslation(Job, ToolOpts, Session, &Result.Output, nullptr, &Errs);
+  }
+
+#ifdef LLVM_ON_UNIX
+  // A translation server reads requests from a Unix socket and
+  // handles them one at a time in a single long-lived process.
+  // Every message is a list of strings: a 32-bit count followed
+  // by each string as a 32-bit length and its bytes.  A request
+  // is the client's working directory followed by its argv; the
+  // reply is the exit status followed by the diagnostics.
+
+  bool WriteAll(int FD, const void *Data, std::size_t Size) {
+    const char *Ptr = static_cast<const char *>(Data);
+    while(Size > 0) {
+      ssize_t Written = ::write(FD, Ptr, Size);
+      if(Written < 0) {
+        if(errno == EINTR)
+          continue;
+        return false;
+      }
+      Ptr += Written;
+      Size -= Written;
+    }
+    return true;
+  }
+
+  bool ReadAll(int FD, void *Data, std::size_t Size) {
+    char *Ptr = static_cast<char *>(Data);
+    while(Size > 0) {
+      ssize_t Read = ::read(FD, Ptr, Size);
+      if(Read < 0 && errno == EINTR)
+        continue;
+      if(Read <= 0)
+        return false;
+      Ptr += Read;
+      Size -= Read;
+    }
+    return true;
+  }
+
+  bool WriteMessage(int FD, const std::vector<std::string> &Message) {
+    uint32_t Count = Message.size();
+    if(!WriteAll(FD, &Count, sizeof(Count)))
+      return false;
+    for(std::vector<std::string>::const_iterator iter = Message.begin(), end = Message.end(); iter != end; ++iter) {
+      uint32_t Length = iter->size();
+      if(!WriteAll(FD, &Length, sizeof(Length)) || !WriteAll(FD, iter->data(), Length))
+        return false;
+    }
+    return true;
+  }
+
+  // Messages that claim to be larger than these are refused
+  // before anything is allocated for them.
+  const uint32_t MaxMessageStrings = 1 << 16;
+  const uint32_t MaxMessageBytes = 1 << 28;
+
+  bool ReadMessage(int FD, std::vector<std::string> &Message) {
+    uint32_t Count;
+    if(!ReadAll(FD, &Count, sizeof(Count)) || Count > MaxMessageStrings)
+      return false;
+    Message.resize(Count);
+    uint32_t Total = 0;
+    for(uint32_t i = 0; i < Count; ++i) {
+      uint32_t Length;
+      if(!ReadAll(FD, &Length, sizeof(Length)) || Length > MaxMessageBytes - Total)
+        return false;
+      Total += Length;
+      Message[i].resize(Length);
+      if(Length && !ReadAll(FD, &Message[i][0], Length))
+        return false;
+    }
+    return true;
+  }
+
+  bool MakeSocketAddress(StringRef Path, sockaddr_un &Addr) {
+    std::memset(&Addr, 0, sizeof(Addr));
+    Addr.sun_family = AF_UNIX;
+    if(Path.size() >= sizeof(Addr.sun_path))
+      return false;
+    std::memcpy(Addr.sun_path, Path.data(), Path.size());
+    return true;
+  }
+
+  // Seconds that a server connection may wait for the client.
+  const int ServerTimeoutSeconds = 30;
+
+  void ServeConnection(int Conn, llvm::opt::OptTable &Opts, TranslationSession &Session) {
+    std::vector<std::string> Request;
+    if(!ReadMessage(Conn, Request) || Request.size() < 2)
+      return;
+    std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+    std::vector<const char *> Argv;
+    for(std::size_t i = 1; i < Request.size(); ++i)
+      Argv.push_back(Request[i].c_str());
+    std::string Diagnostics;
+    llvm::raw_string_ostream DiagOS(Diagnostics);
+    bool Success = TranslateCommandLine(Opts, Argv, Request[0], Session, DiagOS, &DiagOS);
+    DiagOS.flush();
+    std::vector<std::string> Reply;
+    Reply.push_back(Success? "0" : "1");
+    Reply.push_back(Diagnostics);
+    WriteMessage(Conn, Reply);
+    std::chrono::duration<double, std::milli> Elapsed = std::chrono::steady_clock::now() - Start;
+    // One write per line, so that lines from concurrent requests
+    // are not interleaved.
+    std::string Log;
+    llvm::raw_string_ostream LogOS(Log);
+    LogOS << "clang-upc2c server: " << Argv.back() << " " << llvm::format("%.1f", Elapsed.count()) << " ms\n";
+    llvm::errs() << LogOS.str();
+  }
+
+  int RunTranslationServer(const TranslatorOptions &ToolOpts) {
+    sockaddr_un Addr;
+    if(!MakeSocketAddress(ToolOpts.ServerSocket, Addr)) {
+      llvm::errs() << "clang-upc2c: socket path too long: " << ToolOpts.ServerSocket << "\n";
+      return EXIT_FAILURE;
+    }
+    int Listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if(Listener < 0) {
+      llvm::errs() << "clang-upc2c: cannot create socket: " << strerror(errno) << "\n";
+      return EXIT_FAILURE;
+    }
+    // A socket left behind by an earlier server is replaced, but
+    // anything else at the path is left alone.
+    struct stat Existing;
+    if(::lstat(Addr.sun_path, &Existing) == 0) {
+      if(!S_ISSOCK(Existing.st_mode)) {
+        llvm::errs() << "clang-upc2c: " << ToolOpts.ServerSocket << " exists and is not a socket\n";
+        ::close(Listener);
+        return EXIT_FAILURE;
+      }
+      ::unlink(Addr.sun_path);
+    }
+    // Requests name files for the server to write, so only the
+    // user who started it may connect: the socket is created 0600,
+    // and the peer of each connection is checked where possible.
+    mode_t OldMask = ::umask(0077);
+    int Bound = ::bind(Listener, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr));
+    ::umask(OldMask);
+    if(Bound < 0 || ::listen(Listener, 64) < 0) {
+      llvm::errs() << "clang-upc2c: cannot listen on " << ToolOpts.ServerSocket << ": " << strerror(errno) << "\n";
+      ::close(Listener);
+      return EXIT_FAILURE;
+    }
+
+    // State shared by all requests: the driver option table, the
+    // status cache for the compiler's own headers and the preambles.
+    std::unique_ptr<llvm::opt::OptTable> Opts(clang::driver::createDriverOptTable());
+    std::vector<std::string> StableDirs(ToolOpts.StableDirs);
+    StableDirs.push_back("/usr/include/");
+    StableDirs.push_back("/usr/lib/");
+    TranslationSession Session;
+    Session.FS = new StableStatCacheFS(llvm::vfs::getRealFileSystem(), StableDirs);
+    // The headers of the -include prefix are parsed once for each
+    // configuration and kept as preambles, beside the socket unless
+    // the server was given -pch-dir=.
+    Session.DefaultPCHDir = ToolOpts.PCHDir.empty()? ToolOpts.ServerSocket + ".pch" : ToolOpts.PCHDir;
+
+    // Each connection is served on the pool, so a long translation
+    // does not hold up the others.  The session's caches lock their
+    // own state.  The server's -j sets the number of threads.
+    llvm::ThreadPool Pool(ToolOpts.Jobs > 1? ToolOpts.Jobs : llvm::hardware_concurrency());
+    while(true) {
+      int Conn = ::accept(Listener, nullptr, nullptr);
+      if(Conn < 0) {
+        if(errno == EINTR)
+          continue;
+        break;
+      }
+#ifdef SO_PEERCRED
+      ucred Peer;
+      socklen_t PeerSize = sizeof(Peer);
+      if(::getsockopt(Conn, SOL_SOCKET, SO_PEERCRED, &Peer, &PeerSize) < 0 || Peer.uid != ::getuid()) {
+        ::close(Conn);
+        continue;
+      }
+#endif
+      // A client that stops sending or reading its reply gives up
+      // its connection instead of holding a thread forever.
+      timeval Timeout;
+      Timeout.tv_sec = ServerTimeoutSeconds;
+      Timeout.tv_usec = 0;
+      ::setsockopt(Conn, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+      ::setsockopt(Conn, SOL_SOCKET, SO_SNDTIMEO, &Timeout, sizeof(Timeout));
+      Pool.async([Conn, &Opts, &Session] {
+        ServeConnection(Conn, *Opts, Session);
+        ::close(Conn);
+      });
+    }
+    Pool.wait();
+    ::close(Listener);
+    return EXIT_SUCCESS;
+  }
+
+  bool WritesToStdout(llvm::ArrayRef<const char *> Argv) {
+    for(std::size_t i = 1; i < Argv.size(); ++i) {
+      StringRef Arg = Argv[i];
+      if(Arg == "-o-" || (Arg == "-o" && i + 1 < Argv.size() && StringRef(Argv[i + 1]) == "-"))
+        return true;
+    }
+    return false;
+  }
+
+  // Forwards a command line to a running server.  Returns false if
+  // no server could be reached, so that the caller can translate
+  // locally instead.
+  bool ForwardToServer(StringRef SocketPath, llvm::ArrayRef<const char *> Argv, int &ExitStatus) {
+    sockaddr_un Addr;
+    if(!MakeSocketAddress(SocketPath, Addr))
+      return false;
+    int Conn = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if(Conn < 0)
+      return false;
+    if(::connect(Conn, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) < 0) {
+      ::close(Conn);
+      return false;
+    }
+    llvm::SmallString<256> WorkingDir;
+    llvm::sys::fs::current_path(WorkingDir);
+    std::vector<std::string> Request;
+    Request.push_back(WorkingDir.str().str());
+    for(std::size_t i = 0; i < Argv.size(); ++i) {
+      if(!StringRef(Argv[i]).startswith("-use-server="))
+        Request.push_back(Argv[i]);
+    }
+    std::vector<std::string> Reply;
+    bool Success = WriteMessage(Conn, Request) && ReadMessage(Conn, Reply) && Reply.size() == 2;
+    ::close(Conn);
+    if(!Success)
+      return false;
+    llvm::errs() << Reply[1];
+    ExitStatus = Reply[0] == "0"? EXIT_SUCCESS : EXIT_FAILURE;
+    return true;
+  }
+#endif
+
+}
+
+struct upc2c::Translator::Impl {
+  Impl() : Opts(clang::driver::createDriverOptTable()) {}
+  std::unique_ptr<llvm::opt::OptTable> Opts;
+  TranslationSession Session;
+};
+
+upc2c::Translator::Translator() : impl(new Impl) {}
+
+upc2c::Translator::~Translator() {}
+
+bool upc2c::Translator::translate(const TranslationRequest &Request, TranslationResult &Result) {
+  Result = TranslationResult();
+  std::string Errors;
+  llvm::raw_string_ostream Errs(Errors);
+  Result.Success = TranslateRequest(*impl->Opts, impl->Session, Request, Result, Errs);
+  Errs.flush();
+  AddTranslatorErrors(Errors, Result.Diagnostics);
+  return Result.Success;
+}
+
+int upc2c::runCommandLine(int argc, const char ** argv) {
+  llvm::ArrayRef<const char *> Argv = llvm::makeArrayRef(argv, argc);
+  TranslatorOptions ToolOpts;
+  llvm::SmallVector<const char *, 64> ClangArgv;
+  if(!ParseTranslatorOptions(Argv, ToolOpts, ClangArgv, llvm::errs()))
+    return EXIT_FAILURE;
+
+#ifdef LLVM_ON_UNIX
+  if(!ToolOpts.ServerSocket.empty())
+    return RunTranslationServer(ToolOpts);
+
+  // The client side keeps the usual command line.  The server
+  // is named with -use-server= or CLANG_UPC2C_SERVER.  Output to
+  // stdout or to a pipe has to come from this process, so those
+  // are always translated locally.
+  std::string UseServer = ToolOpts.UseServer;
+  if(UseServer.empty()) {
+    if(const char *Env = ::getenv("CLANG_UPC2C_SERVER"))
+      UseServer = Env;
+  }
+  if(!UseServer.empty() && ToolOpts.PipeTo.empty() && !WritesToStdout(ClangArgv)) {
+    int ExitStatus;
+    if(ForwardToServer(UseServer, Argv, ExitStatus))
+      return ExitStatus;
+  }
+
+  // A -pipe-to= command that exits early is reported when it is
+  // waited for, rather than killing the translator.
+  if(!ToolOpts.PipeTo.empty())
+    ::signal(SIGPIPE, SIG_IGN);
+#endif
+
+  // Parse the arguments
+  std::unique_ptr<llvm::opt::OptTable> Opts(clang::driver::createDriverOptTable());
+  TranslationSession Session;
+  if(TranslateCommandLine(*Opts, Argv, "", Session, llvm::errs(), nullptr)) {
     return EXIT_SUCCESS;
   } else {
     return EXIT_FAILURE;
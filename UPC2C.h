@@ -0,0 +1,90 @@
+//===- UPC2C.h - Translating UPC to C in-process -----------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// The translator behind clang-upc2c, for tools that translate UPC
+// in-process.  The source is passed in memory and the C comes back
+// in memory, with the diagnostics as data rather than text, so no
+// process is started and no file is written.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CLANG_UPC2C_UPC2C_H
+#define CLANG_UPC2C_UPC2C_H
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace upc2c {
+
+  // One diagnostic of a translation
+  struct Diagnostic {
+    enum LevelKind { Note, Remark, Warning, Error, Fatal };
+    LevelKind Level;
+    // Where the diagnostic points, as the #line directives of the
+    // source present it.  File is empty for errors about the
+    // translation as a whole, such as an invalid option.
+    std::string File;
+    unsigned Line, Column;
+    std::string Message;
+  };
+
+  struct TranslationRequest {
+    // The name of the source, used for #line directives, the file
+    // id and quoted #includes, and its contents
+    std::string FileName;
+    std::string Source;
+    // Other files that only exist in memory, such as generated
+    // headers, as pairs of a path and its contents
+    std::vector<std::pair<std::string, std::string> > Files;
+    // clang-upc2c options and compiler flags, as on the command
+    // line but without the input file and -o
+    std::vector<std::string> Args;
+    // What relative paths are resolved against, or the current
+    // directory if empty
+    std::string WorkingDir;
+  };
+
+  struct TranslationResult {
+    TranslationResult() : Success(false) {}
+    bool Success;
+    // The translated C.  With -split= or -variants=, Parts holds
+    // the text of each file instead, in the order of the files or
+    // of the variants.
+    std::string Output;
+    std::vector<std::string> Parts;
+    std::vector<Diagnostic> Diagnostics;
+  };
+
+  // Translates one request at a time.  The caches of -pch-dir=,
+  // -cache-dir= and -incremental-dir= are the only files written,
+  // in the directories the options name, and they see the files
+  // of the request as a translation does.  Options that write
+  // any other file, start processes or report on stderr, such as
+  // -pipe-to=, -time-trace= and -print-stats, are not
+  // accepted.  A Translator must not be used by several threads at
+  // once; each thread can have its own.
+  class Translator {
+  public:
+    Translator();
+    ~Translator();
+    // Returns Result.Success
+    bool translate(const TranslationRequest &Request, TranslationResult &Result);
+  private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+  };
+
+  // Runs a clang-upc2c command line, and returns the exit status
+  int runCommandLine(int argc, const char **argv);
+
+}
+
+#endif // CLANG_UPC2C_UPC2C_H
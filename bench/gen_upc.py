@@ -0,0 +1,172 @@
+#!/usr/bin/env python
+#===- gen_upc.py - Synthetic UPC source generator ------------*- python -*--===#
+#
+#                     The LLVM Compiler Infrastructure
+#
+# This file is distributed under the University of Illinois Open Source
+# License. See LICENSE.TXT for details.
+#
+#===------------------------------------------------------------------------===#
+"""Generates synthetic UPC translation units for benchmarking clang-upc2c.
+
+Each axis scales one kind of construct that the translator handles:
+
+  --functions     function definitions
+  --accesses      shared reads and writes in each function
+  --foralls       upc_forall nests in each function
+  --forall-depth  depth of each upc_forall nest
+  --structs       shared struct types, with a shared array of each
+  --anon          anonymous records (typedefs and variables)
+  --tld           TLD globals (plain file scope variables)
+
+The output only uses UPC keywords, so it needs no headers, and it is
+valid for both static and dynamic THREADS.  The same arguments and
+--seed always produce the same file.
+"""
+
+from __future__ import print_function
+
+import argparse
+import random
+import sys
+
+DEFAULTS = {
+    'functions': 20,
+    'accesses': 20,
+    'foralls': 1,
+    'forall_depth': 1,
+    'structs': 4,
+    'anon': 4,
+    'tld': 8,
+}
+
+# Elements per thread of the shared arrays.  Indices are always
+# reduced modulo this, so every access stays in bounds.
+BLOCK = 256
+
+
+def generate(out, functions, accesses, foralls, forall_depth, structs,
+             anon, tld, seed=1):
+    rng = random.Random(seed)
+    w = out.write
+    w('/* Generated by gen_upc.py: functions=%d accesses=%d foralls=%d '
+      'forall_depth=%d structs=%d anon=%d tld=%d seed=%d */\n\n' %
+      (functions, accesses, foralls, forall_depth, structs, anon, tld, seed))
+
+    w('shared int A[%d*THREADS];\n' % BLOCK)
+    w('shared double B[%d*THREADS];\n' % BLOCK)
+    w('shared [4] int C[%d*THREADS];\n' % BLOCK)
+    w('strict shared int flag;\n')
+    w('shared int *shared sp;\n\n')
+
+    for s in range(structs):
+        w('struct s%d {\n  int i;\n  double d;\n  long l[4];\n};\n' % s)
+        w('shared struct s%d S%d[%d*THREADS];\n' % (s, s, BLOCK))
+    w('\n')
+
+    for a in range(anon):
+        w('typedef struct { int x; double y; } anon_t%d;\n' % a)
+        w('struct { int x; double y; } anon%d;\n' % a)
+        w('shared struct { int x; int y[2]; } sanon%d[THREADS];\n' % a)
+    w('\n')
+
+    for t in range(tld):
+        w('int tld%d;\n' % t)
+        w('double tlda%d[8];\n' % t)
+    w('\n')
+
+    def index(expr):
+        return '(%s) %% (%d*THREADS)' % (expr, BLOCK)
+
+    def access():
+        kinds = ['get', 'put', 'double', 'blocked', 'pointer', 'strict']
+        if structs:
+            kinds += ['struct_get', 'struct_put']
+        if anon:
+            kinds += ['anon']
+        if tld:
+            kinds += ['tld']
+        kind = rng.choice(kinds)
+        k = rng.randrange(BLOCK)
+        if kind == 'get':
+            return 'sum += A[%s];' % index('n + %d' % k)
+        if kind == 'put':
+            return 'A[%s] = sum;' % index('i + %d' % k)
+        if kind == 'double':
+            return 'B[%d] = B[%s] * 2.0 + sum;' % (k, index('n * %d' % (k + 1)))
+        if kind == 'blocked':
+            return 'sum += C[%s];' % index('MYTHREAD + %d' % k)
+        if kind == 'pointer':
+            return 'p[%d] += %d;' % (k, rng.randrange(100))
+        if kind == 'strict':
+            return 'flag = sum;'
+        if kind == 'struct_get':
+            return 'sum += (int)S%d[%s].d + S%d[%d].l[%d];' % (
+                rng.randrange(structs), index('n + %d' % k),
+                rng.randrange(structs), k, rng.randrange(4))
+        if kind == 'struct_put':
+            return 'S%d[%s].i = sum;' % (rng.randrange(structs),
+                                         index('i + %d' % k))
+        if kind == 'anon':
+            a = rng.randrange(anon)
+            return 'sanon%d[MYTHREAD].y[%d] = sum + anon%d.x;' % (
+                a, rng.randrange(2), a)
+        t = rng.randrange(tld)
+        return 'tld%d += sum; tlda%d[%d] = tld%d;' % (t, t, rng.randrange(8), t)
+
+    def forall(depth, indent):
+        pad = '  ' * indent
+        var = 'i%d' % depth
+        if depth == 0:
+            affinity = '&A[%s]' % var
+            bound = '%d*THREADS' % BLOCK
+        else:
+            affinity = var
+            bound = '4'
+        w('%supc_forall (%s = 0; %s < %s; %s++; %s) {\n' %
+          (pad, var, var, bound, var, affinity))
+        if depth + 1 < forall_depth:
+            forall(depth + 1, indent + 1)
+        else:
+            w('%s  A[i0] += %s;\n' % (pad, ' + '.join(
+                'i%d' % d for d in range(depth + 1))))
+        w('%s}\n' % pad)
+
+    for f in range(functions):
+        w('int f%d(int n) {\n' % f)
+        w('  int i = n, sum = 0;\n')
+        if foralls:
+            w('  int %s;\n' % ', '.join('i%d' % d for d in range(forall_depth)))
+        w('  shared int *p = &A[MYTHREAD];\n')
+        for _ in range(accesses):
+            w('  %s\n' % access())
+        for _ in range(foralls):
+            forall(0, 1)
+        w('  return sum;\n}\n\n')
+
+    w('int main(void) {\n  int sum = 0;\n')
+    for f in range(functions):
+        w('  sum += f%d(%d);\n' % (f, f))
+    w('  upc_barrier;\n  return sum == 0;\n}\n')
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    for name, value in sorted(DEFAULTS.items()):
+        parser.add_argument('--' + name.replace('_', '-'), type=int, default=value)
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('-o', '--output', default='-',
+                        help='output file (default: stdout)')
+    args = parser.parse_args(argv)
+    params = dict((name, getattr(args, name)) for name in DEFAULTS)
+    if args.output == '-':
+        generate(sys.stdout, seed=args.seed, **params)
+    else:
+        with open(args.output, 'w') as out:
+            generate(out, seed=args.seed, **params)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
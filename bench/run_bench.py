@@ -0,0 +1,203 @@
+#!/usr/bin/env python
+#===- run_bench.py - clang-upc2c throughput benchmarks -------*- python -*--===#
+#
+#                     The LLVM Compiler Infrastructure
+#
+# This file is distributed under the University of Illinois Open Source
+# License. See LICENSE.TXT for details.
+#
+#===------------------------------------------------------------------------===#
+"""Times clang-upc2c on synthetic inputs scaled along each axis.
+
+For every axis of gen_upc.py, one input is generated per scale factor,
+with the other axes left at their defaults.  Each input is translated
+--repeat times and the fastest run is kept.  The report gives source
+lines per second and the peak RSS of the translator.  The "growth"
+column is the increase in time divided by the increase in size since
+the previous step: about 1.0 means linear scaling, and values well
+above 1.0 mark a scaling cliff.  The size of the translated file is
+reported too, and with --cc, the time to compile it against the
+stand-in runtime headers, so that output options such as -compact
+can be compared.  With -split=, the files are compiled in parallel
+and their total size is reported.  With --server, the translations
+go through a clang-upc2c translation server, and the fastest
+translation by a fresh process is reported as the cold time.  With
+--max-growth, the exit status is 1 if any step grows by more than the
+given factor.
+
+Arguments after "--" are passed to clang-upc2c, e.g. -- -P.
+"""
+
+from __future__ import print_function
+
+import argparse
+import glob
+import json
+import os
+import subprocess
+import sys
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, HERE)
+import gen_upc
+
+
+def run(cmd):
+    """Runs cmd and returns (seconds, peak RSS in KB)."""
+    return run_all([cmd])
+
+
+def run_all(cmds):
+    """Runs cmds at the same time and returns (seconds until the last
+    one finished, largest peak RSS in KB)."""
+    start = time.time()
+    procs = [subprocess.Popen(cmd) for cmd in cmds]
+    rss = 0
+    for cmd, proc in zip(cmds, procs):
+        _, status, usage = os.wait4(proc.pid, 0)
+        proc.returncode = status
+        if status != 0:
+            raise RuntimeError('command failed: %s' % ' '.join(cmd))
+        rss = max(rss, usage.ru_maxrss)
+    elapsed = time.time() - start
+    if sys.platform == 'darwin':
+        rss //= 1024
+    return elapsed, rss
+
+
+def split_files(output):
+    """The files that -split= writes instead of output."""
+    return sorted(glob.glob(output[:-len('.c')] + '.*.c'))
+
+
+def main(argv):
+    extra = []
+    if '--' in argv:
+        extra = argv[argv.index('--') + 1:]
+        argv = argv[:argv.index('--')]
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--upc2c', required=True, help='clang-upc2c binary')
+    parser.add_argument('--work-dir', default='upc2c-bench',
+                        help='where inputs and outputs are written')
+    parser.add_argument('--axis', action='append', choices=sorted(gen_upc.DEFAULTS),
+                        help='axis to scale (default: all)')
+    parser.add_argument('--scales', default='1,2,4,8,16',
+                        help='comma-separated scale factors')
+    parser.add_argument('--repeat', type=int, default=3)
+    parser.add_argument('--cc', help='also time compiling the output with this C compiler')
+    parser.add_argument('--cflags', default='-O2',
+                        help='flags for compiling the output with --cc')
+    parser.add_argument('--max-growth', type=float,
+                        help='fail if any step has a larger growth')
+    parser.add_argument('--server', action='store_true',
+                        help='translate through a clang-upc2c server, and compare')
+    parser.add_argument('--json', help='also write the results to this file')
+    args = parser.parse_args(argv)
+
+    axes = args.axis or sorted(gen_upc.DEFAULTS)
+    scales = [int(s) for s in args.scales.split(',')]
+    if not os.path.isdir(args.work_dir):
+        os.makedirs(args.work_dir)
+
+    server = None
+    use_server = []
+    if args.server:
+        socket = os.path.abspath(os.path.join(args.work_dir, 'server.sock'))
+        if os.path.exists(socket):
+            os.remove(socket)
+        server = subprocess.Popen([args.upc2c, '-server=' + socket])
+        while not os.path.exists(socket):
+            if server.poll() is not None:
+                raise RuntimeError('clang-upc2c server exited')
+            time.sleep(0.05)
+        use_server = ['-use-server=' + socket]
+    try:
+        return bench(args, axes, scales, extra, use_server)
+    finally:
+        if server:
+            server.terminate()
+            server.wait()
+
+
+def bench(args, axes, scales, extra, use_server):
+    results = []
+    failed = False
+    cc_cmd = None
+    if args.cc:
+        cc_cmd = [args.cc] + args.cflags.split() + [
+            '-std=gnu11', '-I', os.path.join(HERE, 'runtime'), '-c']
+    print('%-14s %6s %9s %10s %12s %10s %7s %9s %8s' %
+          ('axis', 'value', 'lines', 'time (s)', 'lines/s', 'RSS (MB)', 'growth',
+           'out (KB)', 'cc (s)'))
+    for axis in axes:
+        previous = None
+        for scale in scales:
+            params = dict(gen_upc.DEFAULTS)
+            params[axis] = max(1, gen_upc.DEFAULTS[axis]) * scale
+            name = '%s-%d' % (axis, params[axis])
+            source = os.path.join(args.work_dir, name + '.upc')
+            output = os.path.join(args.work_dir, name + '.trans.c')
+            with open(source, 'w') as out:
+                gen_upc.generate(out, **params)
+            with open(source) as f:
+                lines = sum(1 for _ in f)
+
+            for stale in [output] + split_files(output):
+                if os.path.exists(stale):
+                    os.remove(stale)
+            cold = None
+            if use_server:
+                for _ in range(args.repeat):
+                    t, _ = run([args.upc2c, source, '-o', output] + extra)
+                    if cold is None or t < cold:
+                        cold = t
+            best = None
+            for _ in range(args.repeat):
+                elapsed, rss = run([args.upc2c, source, '-o', output] + use_server + extra)
+                if best is None or elapsed < best[0]:
+                    best = (elapsed, rss)
+            elapsed, rss = best
+            outputs = [output] if os.path.exists(output) else split_files(output)
+            out_bytes = sum(os.path.getsize(f) for f in outputs)
+
+            cc_time = None
+            if cc_cmd:
+                for _ in range(args.repeat):
+                    t, _ = run_all([cc_cmd + [f, '-o', f + '.o'] for f in outputs])
+                    if cc_time is None or t < cc_time:
+                        cc_time = t
+
+            growth = ''
+            if previous:
+                size_ratio = float(lines) / previous[0]
+                time_ratio = elapsed / previous[1] if previous[1] > 0 else 0
+                growth = '%.2f' % (time_ratio / size_ratio)
+                if args.max_growth and time_ratio / size_ratio > args.max_growth:
+                    growth += ' !'
+                    failed = True
+            previous = (lines, elapsed)
+
+            print('%-14s %6d %9d %10.3f %12.0f %10.1f %7s %9.1f %8s%s' %
+                  (axis, params[axis], lines, elapsed,
+                   lines / elapsed if elapsed > 0 else 0, rss / 1024.0, growth,
+                   out_bytes / 1024.0, '%.3f' % cc_time if cc_time is not None else '',
+                   ' (cold %.3f)' % cold if cold is not None else ''))
+            result = {'axis': axis, 'value': params[axis], 'lines': lines,
+                      'seconds': elapsed, 'peak_rss_kb': rss, 'output_bytes': out_bytes}
+            if cc_time is not None:
+                result['cc_seconds'] = cc_time
+            if cold is not None:
+                result['cold_seconds'] = cold
+            results.append(result)
+            sys.stdout.flush()
+
+    if args.json:
+        with open(args.json, 'w') as out:
+            json.dump({'upc2c_args': extra, 'results': results}, out, indent=2)
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
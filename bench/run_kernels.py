@@ -0,0 +1,137 @@
+#!/usr/bin/env python
+#===- run_kernels.py - Run UPC micro-kernels through clang-upc2c -*- python -*-===#
+#
+#                     The LLVM Compiler Infrastructure
+#
+# This file is distributed under the University of Illinois Open Source
+# License. See LICENSE.TXT for details.
+#
+#===------------------------------------------------------------------------===#
+"""Builds the kernels in kernels/ end-to-end and runs them.
+
+Each kernel is translated by clang-upc2c with TLD enabled, compiled
+with the C compiler against the stand-in runtime in runtime/, linked
+with a generated file that calls its allocation and initialization
+functions, and run once for every --threads value.  The report gives
+the wall time of each run and the kernel's own result line, which
+ends in OK or FAILED.
+
+Arguments after "--" are passed to clang-upc2c, e.g. -- -DN=1000000.
+"""
+
+from __future__ import print_function
+
+import argparse
+import glob
+import json
+import os
+import re
+import subprocess
+import sys
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+RUNTIME = os.path.join(HERE, 'runtime')
+
+
+def check_call(cmd):
+    if subprocess.call(cmd) != 0:
+        raise RuntimeError('command failed: %s' % ' '.join(cmd))
+
+
+def write_glue(obj, path):
+    """Writes the functions that run every UPCRI_ALLOC_* and UPCRI_INIT_*."""
+    symbols = subprocess.check_output(['nm', '-g', obj]).decode()
+    names = {'ALLOC': [], 'INIT': []}
+    for line in symbols.splitlines():
+        m = re.match(r'\S+\s+T\s+(UPCRI_(ALLOC|INIT)_\w+)$', line)
+        if m:
+            names[m.group(2)].append(m.group(1))
+    with open(path, 'w') as out:
+        out.write('/* Generated by run_kernels.py */\n')
+        for kind in ('ALLOC', 'INIT'):
+            for name in names[kind]:
+                out.write('void %s(void);\n' % name)
+            out.write('void upcri_%s_all(void) {\n' % kind.lower())
+            for name in names[kind]:
+                out.write('  %s();\n' % name)
+            out.write('}\n')
+
+
+def main(argv):
+    extra = []
+    if '--' in argv:
+        extra = argv[argv.index('--') + 1:]
+        argv = argv[:argv.index('--')]
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--upc2c', required=True, help='clang-upc2c binary')
+    parser.add_argument('--cc', default=os.environ.get('CC', 'cc'),
+                        help='C compiler (default: $CC or cc)')
+    parser.add_argument('--cflags', default='-O2',
+                        help='flags for compiling translated code and the runtime')
+    parser.add_argument('--tld-flag', default='-fupc-pthreads-model-tls',
+                        help='clang-upc2c flag that enables TLD')
+    parser.add_argument('--work-dir', default='upc2c-kernels',
+                        help='where translated code and binaries are written')
+    parser.add_argument('--kernel', action='append',
+                        help='kernel to run (default: all in kernels/)')
+    parser.add_argument('--threads', default='1,4',
+                        help='comma-separated UPC thread counts')
+    parser.add_argument('--latency-ns', type=int, default=0,
+                        help='delay added to every remote access')
+    parser.add_argument('--stats', action='store_true',
+                        help='print the runtime call and byte counts')
+    parser.add_argument('--json', help='also write the results to this file')
+    args = parser.parse_args(argv)
+
+    kernels = args.kernel or sorted(
+        os.path.splitext(os.path.basename(k))[0]
+        for k in glob.glob(os.path.join(HERE, 'kernels', '*.upc')))
+    threads = [int(t) for t in args.threads.split(',')]
+    cflags = args.cflags.split() + ['-std=gnu11', '-I', RUNTIME]
+    if not os.path.isdir(args.work_dir):
+        os.makedirs(args.work_dir)
+
+    runtime = os.path.join(args.work_dir, 'upcr.o')
+    check_call([args.cc] + cflags + ['-c', os.path.join(RUNTIME, 'upcr.c'),
+                                     '-o', runtime])
+
+    results = []
+    for kernel in kernels:
+        base = os.path.join(args.work_dir, kernel)
+        source = os.path.join(HERE, 'kernels', kernel + '.upc')
+        check_call([args.upc2c, args.tld_flag, source, '-o', base + '.trans.c']
+                   + extra)
+        check_call([args.cc] + cflags + ['-c', base + '.trans.c',
+                                         '-o', base + '.o'])
+        write_glue(base + '.o', base + '.glue.c')
+        check_call([args.cc] + cflags + [base + '.o', base + '.glue.c', runtime,
+                                         '-o', base, '-lpthread'])
+
+        for count in threads:
+            env = dict(os.environ)
+            env['UPCR_THREADS'] = str(count)
+            env['UPCR_REMOTE_LATENCY_NS'] = str(args.latency_ns)
+            if args.stats:
+                env['UPCR_STATS'] = '1'
+            start = time.time()
+            proc = subprocess.Popen([base], env=env, stdout=subprocess.PIPE)
+            output = proc.communicate()[0].decode().strip()
+            elapsed = time.time() - start
+            print('%-18s %4d threads %8.3f s  %s' %
+                  (kernel, count, elapsed, output.splitlines()[-1] if output else
+                   'exit status %d' % proc.returncode))
+            sys.stdout.flush()
+            results.append({'kernel': kernel, 'threads': count,
+                            'latency_ns': args.latency_ns, 'seconds': elapsed,
+                            'status': proc.returncode, 'output': output})
+
+    if args.json:
+        with open(args.json, 'w') as out:
+            json.dump({'upc2c_args': extra, 'results': results}, out, indent=2)
+    return 1 if any(r['status'] for r in results) else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,584 @@
+/*===- upcr.c - Stand-in UPC runtime for clang-upc2c output -------*- C -*-===*
+ *
+ *                     The LLVM Compiler Infrastructure
+ *
+ * This file is distributed under the University of Illinois Open Source
+ * License. See LICENSE.TXT for details.
+ *
+ *===----------------------------------------------------------------------===*
+ *
+ * Runs a translated UPC program with one pthread per UPC thread.  Each
+ * thread owns a segment of the shared heap, and a pointer-to-shared is
+ * a thread number and an offset into that thread's segment, so every
+ * access is a memcpy from another part of the process.  An access to
+ * another thread's segment counts as remote.
+ *
+ * The program is linked with a small generated file that defines
+ * upcri_alloc_all() and upcri_init_all(), which call the
+ * UPCRI_ALLOC_<file> and UPCRI_INIT_<file> functions of every
+ * translated file (see bench/run_kernels.py).
+ *
+ * Environment:
+ *   UPCR_THREADS             number of UPC threads (default 4)
+ *   UPCR_SEGMENT_MB          shared segment size per thread (default 256)
+ *   UPCR_REMOTE_LATENCY_NS   delay added to every remote access (default 0)
+ *   UPCR_STATS               if set, print call and byte counts at exit
+ *
+ *===----------------------------------------------------------------------===*/
+
+#include "upcr.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define UPCRI_PHASE_SHIFT (UPCR_THREAD_BITS + UPCR_ADDR_BITS)
+#define UPCRI_THREAD_SHIFT UPCR_ADDR_BITS
+#define UPCRI_ADDR_MASK ((UINT64_C(1) << UPCR_ADDR_BITS) - 1)
+#define UPCRI_THREAD_MASK ((UINT64_C(1) << UPCR_THREAD_BITS) - 1)
+#define UPCRI_PHASE(p) ((size_t)((p) >> UPCRI_PHASE_SHIFT))
+#define UPCRI_THREAD(p) ((int)(((p) >> UPCRI_THREAD_SHIFT) & UPCRI_THREAD_MASK))
+#define UPCRI_ADDR(p) ((size_t)((p) & UPCRI_ADDR_MASK))
+/* Equality of pointers-to-shared ignores the phase. */
+#define UPCRI_NOPHASE(p) ((p) & ((UINT64_C(1) << UPCRI_PHASE_SHIFT) - 1))
+
+/* Static data starts past offset 0 so that no object is null. */
+#define UPCRI_HEAP_START 64
+#define UPCRI_HEAP_ALIGN 64
+
+/* Counters, indexed by kind of call.  Accesses also count bytes. */
+#define UPCRI_COUNTERS(X)                                       \
+  X(GET,       "bulk gets")                                     \
+  X(GET_VAL,   "value gets")                                    \
+  X(PUT,       "bulk puts")                                     \
+  X(PUT_VAL,   "value puts")                                    \
+  X(REMOTE,    "remote accesses")                               \
+  X(STRICT,    "strict accesses")                               \
+  X(ARITH,     "pointer arithmetic")                            \
+  X(CONVERT,   "pointer conversions and comparisons")           \
+  X(BARRIER,   "barriers")
+
+enum {
+#define X(name, desc) UPCRI_##name,
+  UPCRI_COUNTERS(X)
+#undef X
+  UPCRI_NUM_COUNTERS
+};
+
+static const char *const upcri_counter_names[] = {
+#define X(name, desc) desc,
+  UPCRI_COUNTERS(X)
+#undef X
+};
+
+/* Each thread updates only its own counters; padded against false
+ * sharing. */
+struct upcri_counters {
+  uint64_t calls[UPCRI_NUM_COUNTERS];
+  uint64_t bytes[UPCRI_NUM_COUNTERS];
+  char pad[64];
+};
+
+const upcr_shared_ptr_t upcr_null_shared = 0;
+const upcr_pshared_ptr_t upcr_null_pshared = 0;
+
+static int upcri_threads = 4;
+static size_t upcri_segment_size;
+static char *upcri_segments[UPCR_MAX_THREADS];
+static long upcri_latency_ns;
+static struct upcri_counters *upcri_counters;
+static pthread_barrier_t upcri_barrier;
+static int upcri_argc;
+static char **upcri_argv;
+static int *upcri_status;
+
+static _Thread_local int upcri_mythread;
+static _Thread_local struct upcri_counters *upcri_my_counters;
+static _Thread_local size_t upcri_heap_top;
+
+/* Provided by the generated glue and the translated program.
+ * user_main is the program's renamed main, with whatever signature it
+ * was written with. */
+extern void upcri_alloc_all(void);
+extern void upcri_init_all(void);
+extern int user_main();
+
+static void upcri_fatal(const char *msg)
+{
+  fprintf(stderr, "upcr: %s\n", msg);
+  abort();
+}
+
+static upcr_shared_ptr_t upcri_make(int thread, size_t phase, size_t addr)
+{
+  return ((uint64_t)phase << UPCRI_PHASE_SHIFT) |
+         ((uint64_t)thread << UPCRI_THREAD_SHIFT) | (uint64_t)addr;
+}
+
+static void upcri_delay(long ns)
+{
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while ((now.tv_sec - start.tv_sec) * 1000000000L +
+           (now.tv_nsec - start.tv_nsec) < ns);
+}
+
+/* Returns the local address of an access and counts it. */
+static char *upcri_access(upcr_shared_ptr_t p, int offset, int nbytes,
+                          int kind, int strict)
+{
+  struct upcri_counters *c = upcri_my_counters;
+  int thread = UPCRI_THREAD(p);
+  c->calls[kind]++;
+  c->bytes[kind] += nbytes;
+  if (strict) {
+    c->calls[UPCRI_STRICT]++;
+    c->bytes[UPCRI_STRICT] += nbytes;
+  }
+  if (thread != upcri_mythread) {
+    c->calls[UPCRI_REMOTE]++;
+    c->bytes[UPCRI_REMOTE] += nbytes;
+    if (upcri_latency_ns)
+      upcri_delay(upcri_latency_ns);
+  }
+  return upcri_segments[thread] + UPCRI_ADDR(p) + offset;
+}
+
+static void upcri_count(int kind)
+{
+  upcri_my_counters->calls[kind]++;
+}
+
+/* Division rounding towards negative infinity, for negative
+ * increments. */
+static long upcri_floordiv(long a, long b)
+{
+  long q = a / b;
+  return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+
+/*===------------------------------------------------------------------===*
+ * Barriers and threads
+ *===------------------------------------------------------------------===*/
+
+void upcr_notify(int id, int flags)
+{
+  (void)id;
+  (void)flags;
+  upcri_count(UPCRI_BARRIER);
+}
+
+/* Barrier ids are not checked. */
+void upcr_wait(int id, int flags)
+{
+  (void)id;
+  (void)flags;
+  pthread_barrier_wait(&upcri_barrier);
+}
+
+void upcr_barrier(int id, int flags)
+{
+  upcr_notify(id, flags);
+  upcr_wait(id, flags);
+}
+
+void upcr_poll(void)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+int upcr_mythread(void)
+{
+  return upcri_mythread;
+}
+
+int upcr_threads(void)
+{
+  return upcri_threads;
+}
+
+/*===------------------------------------------------------------------===*
+ * Pointer-to-shared manipulation
+ *===------------------------------------------------------------------===*/
+
+int upcr_hasMyAffinity_shared(upcr_shared_ptr_t p)
+{
+  return UPCRI_THREAD(p) == upcri_mythread;
+}
+
+int upcr_hasMyAffinity_pshared(upcr_pshared_ptr_t p)
+{
+  return UPCRI_THREAD(p) == upcri_mythread;
+}
+
+upcr_shared_ptr_t upcr_add_shared(upcr_shared_ptr_t p, int elemsz, int inc,
+                                  int blockelems)
+{
+  long phase = (long)UPCRI_PHASE(p) + inc;
+  long blocks = upcri_floordiv(phase, blockelems);
+  long thread = UPCRI_THREAD(p) + blocks;
+  long courses = upcri_floordiv(thread, upcri_threads);
+  long addr;
+  upcri_count(UPCRI_ARITH);
+  phase -= blocks * blockelems;
+  thread -= courses * upcri_threads;
+  addr = (long)UPCRI_ADDR(p) + ((phase - (long)UPCRI_PHASE(p)) +
+                                courses * blockelems) * elemsz;
+  return upcri_make((int)thread, (size_t)phase, (size_t)addr);
+}
+
+upcr_pshared_ptr_t upcr_add_psharedI(upcr_pshared_ptr_t p, int elemsz, int inc)
+{
+  upcri_count(UPCRI_ARITH);
+  return p + (upcr_pshared_ptr_t)((long)inc * elemsz);
+}
+
+upcr_pshared_ptr_t upcr_add_pshared1(upcr_pshared_ptr_t p, int elemsz, int inc)
+{
+  long thread = UPCRI_THREAD(p) + (long)inc;
+  long courses = upcri_floordiv(thread, upcri_threads);
+  upcri_count(UPCRI_ARITH);
+  thread -= courses * upcri_threads;
+  return upcri_make((int)thread, 0,
+                    (size_t)((long)UPCRI_ADDR(p) + courses * elemsz));
+}
+
+void upcr_inc_shared(upcr_shared_ptr_t *p, int elemsz, int inc, int blockelems)
+{
+  *p = upcr_add_shared(*p, elemsz, inc, blockelems);
+}
+
+void upcr_inc_psharedI(upcr_pshared_ptr_t *p, int elemsz, int inc)
+{
+  *p = upcr_add_psharedI(*p, elemsz, inc);
+}
+
+void upcr_inc_pshared1(upcr_pshared_ptr_t *p, int elemsz, int inc)
+{
+  *p = upcr_add_pshared1(*p, elemsz, inc);
+}
+
+int upcr_sub_shared(upcr_shared_ptr_t p1, upcr_shared_ptr_t p2, int elemsz,
+                    int blockelems)
+{
+  /* Offsets of the start of each block, in blocks of this thread. */
+  long course1 = ((long)UPCRI_ADDR(p1) - (long)UPCRI_PHASE(p1) * elemsz) /
+                 ((long)blockelems * elemsz);
+  long course2 = ((long)UPCRI_ADDR(p2) - (long)UPCRI_PHASE(p2) * elemsz) /
+                 ((long)blockelems * elemsz);
+  upcri_count(UPCRI_ARITH);
+  return (int)((course1 - course2) * blockelems * upcri_threads +
+               ((long)UPCRI_THREAD(p1) - UPCRI_THREAD(p2)) * blockelems +
+               ((long)UPCRI_PHASE(p1) - (long)UPCRI_PHASE(p2)));
+}
+
+int upcr_sub_psharedI(upcr_pshared_ptr_t p1, upcr_pshared_ptr_t p2, int elemsz)
+{
+  upcri_count(UPCRI_ARITH);
+  return (int)(((long)UPCRI_ADDR(p1) - (long)UPCRI_ADDR(p2)) / elemsz);
+}
+
+int upcr_sub_pshared1(upcr_pshared_ptr_t p1, upcr_pshared_ptr_t p2, int elemsz)
+{
+  upcri_count(UPCRI_ARITH);
+  return (int)(((long)UPCRI_ADDR(p1) - (long)UPCRI_ADDR(p2)) / elemsz *
+               upcri_threads +
+               ((long)UPCRI_THREAD(p1) - UPCRI_THREAD(p2)));
+}
+
+int upcr_isequal_shared_shared(upcr_shared_ptr_t p1, upcr_shared_ptr_t p2)
+{
+  upcri_count(UPCRI_CONVERT);
+  return UPCRI_NOPHASE(p1) == UPCRI_NOPHASE(p2);
+}
+
+int upcr_isequal_shared_pshared(upcr_shared_ptr_t p1, upcr_pshared_ptr_t p2)
+{
+  return upcr_isequal_shared_shared(p1, p2);
+}
+
+int upcr_isequal_pshared_shared(upcr_pshared_ptr_t p1, upcr_shared_ptr_t p2)
+{
+  return upcr_isequal_shared_shared(p1, p2);
+}
+
+int upcr_isequal_pshared_pshared(upcr_pshared_ptr_t p1, upcr_pshared_ptr_t p2)
+{
+  return upcr_isequal_shared_shared(p1, p2);
+}
+
+void *upcr_shared_to_local(upcr_shared_ptr_t p)
+{
+  upcri_count(UPCRI_CONVERT);
+  if (p == 0)
+    return NULL;
+  return upcri_segments[UPCRI_THREAD(p)] + UPCRI_ADDR(p);
+}
+
+void *upcr_pshared_to_local(upcr_pshared_ptr_t p)
+{
+  return upcr_shared_to_local(p);
+}
+
+int upcr_isnull_shared(upcr_shared_ptr_t p)
+{
+  upcri_count(UPCRI_CONVERT);
+  return UPCRI_NOPHASE(p) == 0;
+}
+
+int upcr_isnull_pshared(upcr_pshared_ptr_t p)
+{
+  return upcr_isnull_shared(p);
+}
+
+upcr_pshared_ptr_t upcr_shared_to_pshared(upcr_shared_ptr_t p)
+{
+  upcri_count(UPCRI_CONVERT);
+  return UPCRI_NOPHASE(p);
+}
+
+upcr_shared_ptr_t upcr_pshared_to_shared(upcr_pshared_ptr_t p)
+{
+  upcri_count(UPCRI_CONVERT);
+  return p;
+}
+
+upcr_shared_ptr_t upcr_shared_resetphase(upcr_shared_ptr_t p)
+{
+  upcri_count(UPCRI_CONVERT);
+  return UPCRI_NOPHASE(p);
+}
+
+uintptr_t upcr_addrfield_shared(upcr_shared_ptr_t p)
+{
+  upcri_count(UPCRI_CONVERT);
+  return (uintptr_t)UPCRI_ADDR(p);
+}
+
+uintptr_t upcr_addrfield_pshared(upcr_pshared_ptr_t p)
+{
+  return upcr_addrfield_shared(p);
+}
+
+/*===------------------------------------------------------------------===*
+ * Shared accesses
+ *===------------------------------------------------------------------===*/
+
+/* Strict accesses are fenced on both sides.  Value accesses hold the
+ * object in the low-order bytes of the register value. */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define UPCRI_VAL_BYTES(v, n) ((char *)&(v) + sizeof(v) - (n))
+#else
+#define UPCRI_VAL_BYTES(v, n) ((char *)&(v))
+#endif
+
+#define UPCRI_FENCE(strict)                                                 \
+  do {                                                                      \
+    if (strict)                                                             \
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);                              \
+  } while (0)
+
+#define UPCRI_DEFINE_ACCESS(ptr, suffix, strict)                            \
+  void upcr_get_##ptr##suffix(void *dst, upcr_##ptr##_ptr_t src,            \
+                              int offset, int nbytes)                       \
+  {                                                                         \
+    UPCRI_FENCE(strict);                                                    \
+    memcpy(dst, upcri_access(src, offset, nbytes, UPCRI_GET, strict),       \
+           nbytes);                                                         \
+    UPCRI_FENCE(strict);                                                    \
+  }                                                                         \
+  upcr_register_value_t upcr_get_##ptr##_val##suffix(upcr_##ptr##_ptr_t src,\
+                                                     int offset, int nbytes)\
+  {                                                                         \
+    upcr_register_value_t value = 0;                                        \
+    UPCRI_FENCE(strict);                                                    \
+    memcpy(UPCRI_VAL_BYTES(value, nbytes),                                  \
+           upcri_access(src, offset, nbytes, UPCRI_GET_VAL, strict), nbytes);\
+    UPCRI_FENCE(strict);                                                    \
+    return value;                                                           \
+  }                                                                         \
+  float upcr_get_##ptr##_floatval##suffix(upcr_##ptr##_ptr_t src,           \
+                                          int offset)                       \
+  {                                                                         \
+    float value;                                                            \
+    UPCRI_FENCE(strict);                                                    \
+    memcpy(&value, upcri_access(src, offset, sizeof(value), UPCRI_GET_VAL,  \
+                                strict), sizeof(value));                    \
+    UPCRI_FENCE(strict);                                                    \
+    return value;                                                           \
+  }                                                                         \
+  double upcr_get_##ptr##_doubleval##suffix(upcr_##ptr##_ptr_t src,         \
+                                            int offset)                     \
+  {                                                                         \
+    double value;                                                           \
+    UPCRI_FENCE(strict);                                                    \
+    memcpy(&value, upcri_access(src, offset, sizeof(value), UPCRI_GET_VAL,  \
+                                strict), sizeof(value));                    \
+    UPCRI_FENCE(strict);                                                    \
+    return value;                                                           \
+  }                                                                         \
+  void upcr_put_##ptr##suffix(upcr_##ptr##_ptr_t dst, int offset,           \
+                              const void *src, int nbytes)                  \
+  {                                                                         \
+    UPCRI_FENCE(strict);                                                    \
+    memcpy(upcri_access(dst, offset, nbytes, UPCRI_PUT, strict), src,       \
+           nbytes);                                                         \
+    UPCRI_FENCE(strict);                                                    \
+  }                                                                         \
+  void upcr_put_##ptr##_val##suffix(upcr_##ptr##_ptr_t dst, int offset,     \
+                                    upcr_register_value_t value,            \
+                                    int nbytes)                             \
+  {                                                                         \
+    UPCRI_FENCE(strict);                                                    \
+    memcpy(upcri_access(dst, offset, nbytes, UPCRI_PUT_VAL, strict),        \
+           UPCRI_VAL_BYTES(value, nbytes), nbytes);                         \
+    UPCRI_FENCE(strict);                                                    \
+  }                                                                         \
+  void upcr_put_##ptr##_floatval##suffix(upcr_##ptr##_ptr_t dst,            \
+                                         int offset, float value)           \
+  {                                                                         \
+    UPCRI_FENCE(strict);                                                    \
+    memcpy(upcri_access(dst, offset, sizeof(value), UPCRI_PUT_VAL, strict), \
+           &value, sizeof(value));                                          \
+    UPCRI_FENCE(strict);                                                    \
+  }                                                                         \
+  void upcr_put_##ptr##_doubleval##suffix(upcr_##ptr##_ptr_t dst,           \
+                                          int offset, double value)         \
+  {                                                                         \
+    UPCRI_FENCE(strict);                                                    \
+    memcpy(upcri_access(dst, offset, sizeof(value), UPCRI_PUT_VAL, strict), \
+           &value, sizeof(value));                                          \
+    UPCRI_FENCE(strict);                                                    \
+  }
+
+UPCRI_DEFINE_ACCESS(shared, , 0)
+UPCRI_DEFINE_ACCESS(shared, _strict, 1)
+UPCRI_DEFINE_ACCESS(pshared, , 0)
+UPCRI_DEFINE_ACCESS(pshared, _strict, 1)
+
+/*===------------------------------------------------------------------===*
+ * Static shared data
+ *===------------------------------------------------------------------===*/
+
+/* Every thread runs the same allocations in the same order, so each
+ * one can keep its own heap pointer and still agree on every offset
+ * without communicating. */
+void upcr_startup_shalloc(upcr_startup_shalloc_t *infos, int count)
+{
+  int i;
+  for (i = 0; i < count; ++i) {
+    upcr_startup_shalloc_t *info = &infos[i];
+    size_t blocks = info->numblocks *
+                    (info->mult_by_threads ? (size_t)upcri_threads : 1);
+    size_t blocks_per_thread = (blocks + upcri_threads - 1) / upcri_threads;
+    size_t addr = upcri_heap_top;
+    upcri_heap_top += blocks_per_thread * info->blockbytes;
+    upcri_heap_top = (upcri_heap_top + UPCRI_HEAP_ALIGN - 1) &
+                     ~(size_t)(UPCRI_HEAP_ALIGN - 1);
+    if (upcri_heap_top > upcri_segment_size) {
+      fprintf(stderr, "upcr: %s needs more than UPCR_SEGMENT_MB\n",
+              info->name);
+      abort();
+    }
+    *info->sptr = upcri_make(0, 0, addr);
+  }
+}
+
+void upcr_startup_pshalloc(upcr_startup_pshalloc_t *infos, int count)
+{
+  upcr_startup_shalloc(infos, count);
+}
+
+/*===------------------------------------------------------------------===*
+ * Startup
+ *===------------------------------------------------------------------===*/
+
+static long upcri_getenv(const char *name, long def)
+{
+  const char *value = getenv(name);
+  return value && *value ? strtol(value, NULL, 0) : def;
+}
+
+static void *upcri_thread_main(void *arg)
+{
+  upcri_mythread = (int)(intptr_t)arg;
+  upcri_my_counters = &upcri_counters[upcri_mythread];
+  upcri_heap_top = UPCRI_HEAP_START;
+
+  upcri_alloc_all();
+  pthread_barrier_wait(&upcri_barrier);
+  upcri_init_all();
+  pthread_barrier_wait(&upcri_barrier);
+  upcri_status[upcri_mythread] = user_main(upcri_argc, upcri_argv);
+  /* Returning from main is collective. */
+  pthread_barrier_wait(&upcri_barrier);
+  return NULL;
+}
+
+static void upcri_print_stats(void)
+{
+  struct upcri_counters total;
+  int t, k;
+  memset(&total, 0, sizeof(total));
+  for (t = 0; t < upcri_threads; ++t) {
+    for (k = 0; k < UPCRI_NUM_COUNTERS; ++k) {
+      total.calls[k] += upcri_counters[t].calls[k];
+      total.bytes[k] += upcri_counters[t].bytes[k];
+    }
+  }
+  fprintf(stderr, "upcr: %d threads, %ld ns remote latency\n",
+          upcri_threads, upcri_latency_ns);
+  for (k = 0; k < UPCRI_NUM_COUNTERS; ++k) {
+    fprintf(stderr, "upcr: %-36s %14llu", upcri_counter_names[k],
+            (unsigned long long)total.calls[k]);
+    if (total.bytes[k])
+      fprintf(stderr, " %14llu bytes", (unsigned long long)total.bytes[k]);
+    fputc('\n', stderr);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  pthread_t threads[UPCR_MAX_THREADS];
+  int t, status = 0;
+
+  upcri_threads = (int)upcri_getenv("UPCR_THREADS", 4);
+  if (upcri_threads < 1 || upcri_threads > UPCR_MAX_THREADS)
+    upcri_fatal("UPCR_THREADS out of range");
+  upcri_segment_size = (size_t)upcri_getenv("UPCR_SEGMENT_MB", 256) << 20;
+  if (upcri_segment_size == 0 || upcri_segment_size > UPCRI_ADDR_MASK)
+    upcri_fatal("UPCR_SEGMENT_MB out of range");
+  upcri_latency_ns = upcri_getenv("UPCR_REMOTE_LATENCY_NS", 0);
+  upcri_argc = argc;
+  upcri_argv = argv;
+
+  /* calloc maps large segments lazily, so unused space is free. */
+  for (t = 0; t < upcri_threads; ++t) {
+    upcri_segments[t] = calloc(1, upcri_segment_size);
+    if (!upcri_segments[t])
+      upcri_fatal("cannot allocate the shared segments");
+  }
+  upcri_counters = calloc(upcri_threads, sizeof(*upcri_counters));
+  upcri_status = calloc(upcri_threads, sizeof(*upcri_status));
+  if (!upcri_counters || !upcri_status)
+    upcri_fatal("out of memory");
+  pthread_barrier_init(&upcri_barrier, NULL, upcri_threads);
+
+  for (t = 1; t < upcri_threads; ++t) {
+    if (pthread_create(&threads[t], NULL, upcri_thread_main,
+                       (void *)(intptr_t)t))
+      upcri_fatal("cannot create threads");
+  }
+  upcri_thread_main((void *)(intptr_t)0);
+  for (t = 1; t < upcri_threads; ++t)
+    pthread_join(threads[t], NULL);
+
+  if (getenv("UPCR_STATS"))
+    upcri_print_stats();
+  for (t = 0; t < upcri_threads && !status; ++t)
+    status = upcri_status[t];
+  return status;
+}
@@ -0,0 +1,141 @@
+/*===- upcr.h - Stand-in UPC runtime for clang-upc2c output -------*- C -*-===*
+ *
+ *                     The LLVM Compiler Infrastructure
+ *
+ * This file is distributed under the University of Illinois Open Source
+ * License. See LICENSE.TXT for details.
+ *
+ *===----------------------------------------------------------------------===*
+ *
+ * Declares the upcr_* entry points that clang-upc2c output calls, so
+ * that translated code can be compiled and run without a Berkeley UPC
+ * installation.  UPC threads are pthreads in a single process; see
+ * upcr.c and bench/README.txt.
+ *
+ * Generated code must be translated with TLD enabled, so that file
+ * scope variables (and upcrt_forall_control) are private to each
+ * thread.
+ *
+ *===----------------------------------------------------------------------===*/
+
+#ifndef UPCR_STANDIN_H
+#define UPCR_STANDIN_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Pointers-to-shared use clang-upc's default packed representation,
+ * so that the element sizes computed by the translator match the C
+ * compiler's layout of structs containing them: 20 bits of phase,
+ * 10 bits of thread and 34 bits of offset into the thread's shared
+ * segment.  Offset 0 is never allocated, so 0 is the null pointer. */
+typedef uint64_t upcr_shared_ptr_t;
+typedef uint64_t upcr_pshared_ptr_t;
+typedef uintptr_t upcr_register_value_t;
+
+#define UPCR_PHASE_BITS  20
+#define UPCR_THREAD_BITS 10
+#define UPCR_ADDR_BITS   34
+#define UPCR_MAX_THREADS (1 << UPCR_THREAD_BITS)
+
+extern const upcr_shared_ptr_t upcr_null_shared;
+extern const upcr_pshared_ptr_t upcr_null_pshared;
+
+/* Barriers and threads */
+void upcr_notify(int id, int flags);
+void upcr_wait(int id, int flags);
+void upcr_barrier(int id, int flags);
+void upcr_poll(void);
+int upcr_mythread(void);
+int upcr_threads(void);
+
+/* Pointer-to-shared manipulation */
+int upcr_hasMyAffinity_shared(upcr_shared_ptr_t p);
+int upcr_hasMyAffinity_pshared(upcr_pshared_ptr_t p);
+upcr_shared_ptr_t upcr_add_shared(upcr_shared_ptr_t p, int elemsz, int inc, int blockelems);
+upcr_pshared_ptr_t upcr_add_psharedI(upcr_pshared_ptr_t p, int elemsz, int inc);
+upcr_pshared_ptr_t upcr_add_pshared1(upcr_pshared_ptr_t p, int elemsz, int inc);
+void upcr_inc_shared(upcr_shared_ptr_t *p, int elemsz, int inc, int blockelems);
+void upcr_inc_psharedI(upcr_pshared_ptr_t *p, int elemsz, int inc);
+void upcr_inc_pshared1(upcr_pshared_ptr_t *p, int elemsz, int inc);
+int upcr_sub_shared(upcr_shared_ptr_t p1, upcr_shared_ptr_t p2, int elemsz, int blockelems);
+int upcr_sub_psharedI(upcr_pshared_ptr_t p1, upcr_pshared_ptr_t p2, int elemsz);
+int upcr_sub_pshared1(upcr_pshared_ptr_t p1, upcr_pshared_ptr_t p2, int elemsz);
+int upcr_isequal_shared_shared(upcr_shared_ptr_t p1, upcr_shared_ptr_t p2);
+int upcr_isequal_shared_pshared(upcr_shared_ptr_t p1, upcr_pshared_ptr_t p2);
+int upcr_isequal_pshared_shared(upcr_pshared_ptr_t p1, upcr_shared_ptr_t p2);
+int upcr_isequal_pshared_pshared(upcr_pshared_ptr_t p1, upcr_pshared_ptr_t p2);
+void *upcr_shared_to_local(upcr_shared_ptr_t p);
+void *upcr_pshared_to_local(upcr_pshared_ptr_t p);
+int upcr_isnull_shared(upcr_shared_ptr_t p);
+int upcr_isnull_pshared(upcr_pshared_ptr_t p);
+upcr_pshared_ptr_t upcr_shared_to_pshared(upcr_shared_ptr_t p);
+upcr_shared_ptr_t upcr_pshared_to_shared(upcr_pshared_ptr_t p);
+upcr_shared_ptr_t upcr_shared_resetphase(upcr_shared_ptr_t p);
+uintptr_t upcr_addrfield_shared(upcr_shared_ptr_t p);
+uintptr_t upcr_addrfield_pshared(upcr_pshared_ptr_t p);
+
+/* Shared accesses.  offset is in bytes, relative to p. */
+#define UPCR_DECLARE_ACCESS(ptr, suffix)                                    \
+  void upcr_get_##ptr##suffix(void *dst, upcr_##ptr##_ptr_t src,            \
+                              int offset, int nbytes);                      \
+  upcr_register_value_t upcr_get_##ptr##_val##suffix(upcr_##ptr##_ptr_t src,\
+                                                     int offset, int nbytes);\
+  float upcr_get_##ptr##_floatval##suffix(upcr_##ptr##_ptr_t src,           \
+                                          int offset);                      \
+  double upcr_get_##ptr##_doubleval##suffix(upcr_##ptr##_ptr_t src,         \
+                                            int offset);                    \
+  void upcr_put_##ptr##suffix(upcr_##ptr##_ptr_t dst, int offset,           \
+                              const void *src, int nbytes);                 \
+  void upcr_put_##ptr##_val##suffix(upcr_##ptr##_ptr_t dst, int offset,     \
+                                    upcr_register_value_t value,            \
+                                    int nbytes);                            \
+  void upcr_put_##ptr##_floatval##suffix(upcr_##ptr##_ptr_t dst,            \
+                                         int offset, float value);          \
+  void upcr_put_##ptr##_doubleval##suffix(upcr_##ptr##_ptr_t dst,           \
+                                          int offset, double value);
+UPCR_DECLARE_ACCESS(shared, )
+UPCR_DECLARE_ACCESS(shared, _strict)
+UPCR_DECLARE_ACCESS(pshared, )
+UPCR_DECLARE_ACCESS(pshared, _strict)
+#undef UPCR_DECLARE_ACCESS
+
+/* Static shared data, allocated by the UPCRI_ALLOC_<file> functions.
+ * The field order matches the UPCRT_STARTUP_SHALLOC macro that the
+ * translator prints at the top of each file. */
+typedef struct {
+  upcr_shared_ptr_t *sptr;
+  size_t blockbytes;
+  size_t numblocks;
+  size_t mult_by_threads;
+  size_t elemsz;
+  const char *name;
+  const char *typestr;
+} upcr_startup_shalloc_t;
+typedef upcr_startup_shalloc_t upcr_startup_pshalloc_t;
+
+void upcr_startup_shalloc(upcr_startup_shalloc_t *infos, int count);
+void upcr_startup_pshalloc(upcr_startup_pshalloc_t *infos, int count);
+
+/* Thread-local data.  The size and alignment are only needed by
+ * runtimes that lay out TLD themselves.  Every translated file
+ * defines upcrt_forall_control tentatively, so those are weak. */
+#define UPCR_TLD_DEFINE(name, size, align) _Thread_local name
+#define UPCR_TLD_DEFINE_TENTATIVE(name, size, align) \
+  __attribute__((weak)) _Thread_local name
+#define UPCR_TLD_ADDR(name) ((void *)&(name))
+
+#define UPCR_BEGIN_FUNCTION() ((void)0)
+#define UPCR_EXIT_FUNCTION() ((void)0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* UPCR_STANDIN_H */